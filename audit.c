@@ -0,0 +1,292 @@
+//
+// Audit log of auth events.
+//
+// Each event is formatted as a JSON line into a slot of a ring buffer,
+// and a writer thread picks up all slots filled so far and writes them
+// with a single writev(2). Event loop (the only producer) never does
+// I/O nor takes a lock; if the writer falls behind and the ring is
+// full, the event is dropped and counted, and the count is written as
+// an event of its own once there is room.
+//
+// Line Format:
+//   {"time":<epoch>,"event":"<event>","user":"<user>",
+//    "addr":"<client address>","detail":"<detail>"}
+//
+// File is reopened in append mode when it has been renamed away, and
+// renamed to "<path>.1" by the writer itself when it grows beyond
+// given size (unless it is 0).
+//
+// Thread is started on first event, not at ac_audit_open(), as
+// lighttpd forks (daemonize and server.max-worker) after set_defaults
+// stage.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "audit.h"
+
+#define RING_SIZE 4096 // number of slots, must be power of 2
+#define SLOT_LEN  512  // max length of a line, including newline
+#define BATCH_MAX 64   // max number of lines per writev(2)
+#define IDLE_USEC 100000 // writer sleep when there's nothing to write
+
+typedef struct {
+    size_t len;
+    char   line[SLOT_LEN];
+} slot;
+
+struct ac_audit {
+    char  *path;
+    size_t rotate_size;
+    int    fd;
+    ino_t  ino;
+
+    pthread_t thread;
+    int       started; // tried to start, successfully or not
+    int       running;
+    int       stop;
+
+    size_t        head;    // next slot to fill, written by event loop
+    size_t        tail;    // next slot to write, written by writer
+    unsigned long dropped; // events lost as ring was full
+
+    slot ring[RING_SIZE];
+};
+
+//
+// Append JSON string (quoted and escaped) within given space.
+// Returns number of bytes written, or 0 if it does not fit.
+//
+static size_t
+json_string(char *dst, size_t size, ac_slice s) {
+    static const char hex[] = "0123456789abcdef";
+    size_t i, n = 0;
+
+    if (size < 2) return 0;
+    dst[n++] = '"';
+    for (i = 0; i < s.len; i++) {
+        unsigned char c = s.ptr[i];
+
+        if (c == '"' || c == '\\') {
+            if (n + 2 >= size) return 0;
+            dst[n++] = '\\';
+            dst[n++] = c;
+        } else if (c < 0x20 || c == 0x7f) {
+            if (n + 6 >= size) return 0;
+            memcpy(dst + n, "\\u00", 4);
+            dst[n + 4] = hex[c >> 4];
+            dst[n + 5] = hex[c & 15];
+            n += 6;
+        } else {
+            if (n + 1 >= size) return 0;
+            dst[n++] = c;
+        }
+    }
+    dst[n++] = '"';
+    return n;
+}
+
+static size_t
+format(char *dst, time_t now, const char *event,
+       ac_slice user, ac_slice addr, ac_slice detail) {
+    const char *name[] = { ",\"user\":", ",\"addr\":", ",\"detail\":" };
+    ac_slice value[3];
+    size_t n, m, i;
+
+    value[0] = user;
+    value[1] = addr;
+    value[2] = detail;
+
+    n = snprintf(dst, SLOT_LEN, "{\"time\":%ld,\"event\":\"%s\"",
+                 (long)now, event);
+    if (n >= SLOT_LEN) return 0;
+
+    for (i = 0; i < 3; i++) {
+        if (! value[i].len) continue;
+        m = strlen(name[i]);
+        if (n + m >= SLOT_LEN - 2) return 0;
+        memcpy(dst + n, name[i], m);
+        n += m;
+        // field too long for a slot is written as empty string
+        if ((m = json_string(dst + n, SLOT_LEN - 2 - n, value[i])) == 0) {
+            m = json_string(dst + n, SLOT_LEN - 2 - n, AC_SLICE("", 0));
+            if (m == 0) return 0;
+        }
+        n += m;
+    }
+    dst[n++] = '}';
+    dst[n++] = '\n';
+    return n;
+}
+
+//
+// (Re)open the file if it is not open yet, or has been renamed away.
+//
+static void
+reopen(ac_audit *a) {
+    struct stat st;
+
+    if (a->fd >= 0 && stat(a->path, &st) == 0 && st.st_ino == a->ino) {
+        return;
+    }
+    if (a->fd >= 0) close(a->fd);
+
+    a->fd = open(a->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+    if (a->fd >= 0 && fstat(a->fd, &st) == 0) a->ino = st.st_ino;
+}
+
+static void
+rotate(ac_audit *a) {
+    struct stat st;
+    char *old;
+
+    if (! a->rotate_size || a->fd < 0) return;
+    if (fstat(a->fd, &st) != 0 || (size_t)st.st_size < a->rotate_size) return;
+
+    if ((old = malloc(strlen(a->path) + 3)) == NULL) return;
+    sprintf(old, "%s.1", a->path);
+    rename(a->path, old);
+    free(old);
+}
+
+static void
+write_all(int fd, struct iovec *iov, int n) {
+    ssize_t len;
+
+    while (n > 0) {
+        if ((len = writev(fd, iov, n)) < 0) {
+            if (errno == EINTR) continue;
+            return; // nowhere to report, so lost
+        }
+        while (n > 0 && (size_t)len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+}
+
+//
+// Write all slots filled so far. Returns number of slots written.
+//
+static size_t
+flush(ac_audit *a) {
+    struct iovec iov[BATCH_MAX];
+    size_t head = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+    size_t tail = a->tail, total = 0;
+    int n;
+
+    while (tail != head) {
+        reopen(a);
+        for (n = 0; n < BATCH_MAX && tail + n != head; n++) {
+            slot *s = &a->ring[(tail + n) & (RING_SIZE - 1)];
+            iov[n].iov_base = s->line;
+            iov[n].iov_len  = s->len;
+        }
+        if (a->fd >= 0) write_all(a->fd, iov, n);
+        tail += n;
+        total += n;
+        __atomic_store_n(&a->tail, tail, __ATOMIC_RELEASE);
+        rotate(a);
+    }
+    return total;
+}
+
+static void *
+writer(void *arg) {
+    ac_audit *a = arg;
+
+    while (! __atomic_load_n(&a->stop, __ATOMIC_ACQUIRE)) {
+        if (! flush(a)) usleep(IDLE_USEC);
+    }
+    flush(a);
+    return NULL;
+}
+
+ac_audit *
+ac_audit_open(const char *path, size_t rotate_size) {
+    ac_audit *a = calloc(1, sizeof(*a));
+
+    if (! a) return NULL;
+    if ((a->path = strdup(path)) == NULL) {
+        free(a);
+        return NULL;
+    }
+    a->rotate_size = rotate_size;
+    a->fd = -1;
+
+    // fail early if the file cannot be written at all
+    reopen(a);
+    if (a->fd < 0) {
+        ac_audit_close(a);
+        return NULL;
+    }
+    return a;
+}
+
+void
+ac_audit_close(ac_audit *a) {
+    if (! a) return;
+
+    if (a->running) {
+        __atomic_store_n(&a->stop, 1, __ATOMIC_RELEASE);
+        pthread_join(a->thread, NULL);
+    } else {
+        flush(a);
+    }
+    if (a->fd >= 0) close(a->fd);
+    free(a->path);
+    free(a);
+}
+
+//
+// Queue an event. Must be called from a single thread (event loop).
+// Returns -1 if the event is dropped.
+//
+int
+ac_audit_log(ac_audit *a, time_t now, const char *event,
+             ac_slice user, ac_slice addr, ac_slice detail) {
+    size_t head = a->head, tail = __atomic_load_n(&a->tail, __ATOMIC_ACQUIRE);
+    unsigned long dropped;
+    slot *s;
+
+    if (! a->started) {
+        a->started = 1;
+        a->running = pthread_create(&a->thread, NULL, writer, a) == 0;
+    }
+
+    // report events lost earlier, once there's room again
+    if (a->dropped && head - tail < RING_SIZE - 1) {
+        char buf[32];
+
+        dropped = a->dropped;
+        a->dropped = 0;
+        snprintf(buf, sizeof(buf), "%lu", dropped);
+        s = &a->ring[head & (RING_SIZE - 1)];
+        s->len = format(s->line, now, "dropped", AC_SLICE("", 0),
+                        AC_SLICE("", 0), AC_STR(buf));
+        __atomic_store_n(&a->head, ++head, __ATOMIC_RELEASE);
+    }
+
+    if (head - tail >= RING_SIZE) {
+        a->dropped++;
+        return -1;
+    }
+    s = &a->ring[head & (RING_SIZE - 1)];
+    if ((s->len = format(s->line, now, event, user, addr, detail)) == 0) {
+        return -1;
+    }
+    __atomic_store_n(&a->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
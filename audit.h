@@ -0,0 +1,18 @@
+#ifndef _AUTH_COOKIE_AUDIT_H_
+#define _AUTH_COOKIE_AUDIT_H_
+
+#include <stddef.h>
+#include <time.h>
+
+#include "authcore.h"
+
+// audit stream of auth events, written by background thread
+typedef struct ac_audit ac_audit;
+
+ac_audit *ac_audit_open(const char *path, size_t rotate_size);
+void ac_audit_close(ac_audit *a);
+
+int ac_audit_log(ac_audit *a, time_t now, const char *event,
+                 ac_slice user, ac_slice addr, ac_slice detail);
+
+#endif
@@ -0,0 +1,358 @@
+//
+// Cookie parsing and verification, without lighttpd types.
+//
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "authcore.h"
+#include "base64.h"
+#include "md5.h"
+
+#ifdef USE_OPENSSL
+#include <openssl/hmac.h>
+#include <openssl/pem.h>
+#endif
+
+static int
+hexval(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 0;
+}
+
+//
+// Find value of named cookie in Cookie: header.
+//
+// Cookie: header is a list of "name=value" separated by ";",
+// with optional whitespace around each of them.
+//
+int
+ac_cookie_find(ac_slice header, ac_slice name, ac_slice *value) {
+    const char *p = header.ptr, *end = header.ptr + header.len;
+
+    while (p < end) {
+        const char *eon, *eov;
+
+        while (p < end && (isspace((unsigned char)*p) || *p == ';')) p++;
+
+        // find end of this entry
+        for (eov = p; eov < end && *eov != ';'; eov++);
+
+        // split into name and value
+        for (eon = p; eon < eov && *eon != '='; eon++);
+        if (eon < eov) {
+            const char *n = eon, *v = eon + 1;
+
+            while (n > p && isspace((unsigned char)n[-1])) n--;
+            if ((size_t)(n - p) == name.len &&
+                memcmp(p, name.ptr, name.len) == 0) {
+                while (v < eov && isspace((unsigned char)*v)) v++;
+                value->ptr = v;
+                value->len = eov - v;
+                return AC_OK;
+            }
+        }
+        p = eov;
+    }
+    return AC_EFORMAT;
+}
+
+//
+// Decode %-escapes. dst needs src.len bytes, and may be same as src.
+//
+size_t
+ac_urldecode(char *dst, ac_slice src) {
+    const char *s = src.ptr, *end = src.ptr + src.len;
+    char *d = dst;
+
+    while (s < end) {
+        if (*s == '%' && end - s >= 3 &&
+            isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+            *d++ = hexval(s[1]) << 4 | hexval(s[2]);
+            s += 3;
+        } else {
+            *d++ = *s++;
+        }
+    }
+    return d - dst;
+}
+
+size_t
+ac_hex_encode(char *dst, const unsigned char *src, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        dst[i * 2]     = hex[src[i] >> 4];
+        dst[i * 2 + 1] = hex[src[i] & 0x0f];
+    }
+    dst[len * 2] = '\0';
+    return len * 2;
+}
+
+static int
+is_hex(ac_slice s) {
+    size_t i;
+
+    for (i = 0; i < s.len; i++) {
+        if (! isxdigit((unsigned char)s.ptr[i])) return 0;
+    }
+    return 1;
+}
+
+// trailing odd digit, if any, is ignored
+size_t
+ac_hex_decode(unsigned char *dst, ac_slice src) {
+    size_t i;
+
+    for (i = 0; i < src.len / 2; i++) {
+        dst[i] = hexval(src.ptr[i * 2]) << 4 | hexval(src.ptr[i * 2 + 1]);
+    }
+    return i;
+}
+
+// XOR-based decryption
+static int
+decrypt(unsigned char *buf, size_t len, const uint8_t *key, size_t keylen) {
+    size_t i;
+
+    for (i = len; i-- > 0; ) {
+        buf[i] ^= (i > 0 ? buf[i - 1] : 0) ^ key[i % keylen];
+
+        // sanity check - result should be base64-encoded authinfo
+        if (! isprint(buf[i])) return -1;
+    }
+    return 0;
+}
+
+//
+// Verify and decrypt "crypt:" cookie.
+//
+// Expected Format (after "crypt:" prefix):
+//   <hash>:<data>
+//
+//   hash    = hex(MD5(key + timesegment + data))
+//   data    = hex(encrypt(MD5(timesegment + key), payload))
+//   payload = base64(username + ":" + password)
+//
+// On success, authinfo (payload) is written into given buffer,
+// which must have room for AC_AUTHINFO_MAX bytes.
+//
+int
+ac_crypt_verify(ac_slice key, ac_slice line, time_t now,
+                char *authinfo, size_t *authinfo_len) {
+    MD5_CTX ctx;
+    uint8_t hash[AC_MD5_LEN];
+    char    hex[AC_MD5_LEN * 2 + 1], tmp[32];
+    time_t  t1;
+
+    // Check for existence of data part
+    const char *data = memchr(line.ptr, ':', line.len);
+    if (! data || data - line.ptr != AC_MD5_LEN * 2) return AC_EFORMAT;
+
+    ac_slice enc = AC_SLICE(data + 1, line.ptr + line.len - data - 1);
+    if (enc.len / 2 >= AC_AUTHINFO_MAX) return AC_EFORMAT;
+
+    // anything but even-length hex is garbage - don't spend MD5 on it
+    if (enc.len % 2 || ! is_hex(enc) ||
+        ! is_hex(AC_SLICE(line.ptr, AC_MD5_LEN * 2))) {
+        return AC_EFORMAT;
+    }
+
+    // Verify signature.
+    // Also, find time segment when this auth request was encrypted.
+    for (t1 = now - (now % 5); now - t1 < 10; t1 -= 5) {
+        snprintf(tmp, sizeof(tmp), "%lu", (unsigned long)t1);
+        MD5_Init(&ctx);
+        MD5_Update(&ctx, key.ptr, key.len);
+        MD5_Update(&ctx, tmp, strlen(tmp));
+        MD5_Update(&ctx, enc.ptr, enc.len);
+        MD5_Final(hash, &ctx);
+        ac_hex_encode(hex, hash, sizeof(hash));
+
+        // verify by comparing hash
+        if (strncasecmp(hex, line.ptr, AC_MD5_LEN * 2) == 0) break;
+    }
+    if (! (now - t1 < 10)) return AC_EEXPIRED;
+
+    // compute temporal encryption key (= MD5(t1, key))
+    snprintf(tmp, sizeof(tmp), "%lu", (unsigned long)t1);
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, tmp, strlen(tmp));
+    MD5_Update(&ctx, key.ptr, key.len);
+    MD5_Final(hash, &ctx);
+
+    // decrypt
+    *authinfo_len = ac_hex_decode((unsigned char *)authinfo, enc);
+    authinfo[*authinfo_len] = '\0';
+    if (decrypt((unsigned char *)authinfo, *authinfo_len,
+                hash, sizeof(hash)) != 0) {
+        return AC_EDECRYPT;
+    }
+    return AC_OK;
+}
+
+//
+// Extract username from authinfo (= base64(username + ":" + password)).
+// Given buffer must have room for AC_USER_MAX bytes.
+//
+int
+ac_authinfo_user(ac_slice authinfo, char *user, size_t *user_len) {
+    unsigned char tmp[BASE64_DECODED_MAX(AC_AUTHINFO_MAX)];
+    int len;
+
+    if (authinfo.len > AC_AUTHINFO_MAX) return AC_EFORMAT;
+    if ((len = base64_decode(tmp, authinfo.ptr, authinfo.len)) < 0) {
+        return AC_EFORMAT;
+    }
+
+    char *pw = memchr(tmp, ':', len);
+    if (pw) len = pw - (char *)tmp;
+    if (len >= AC_USER_MAX) return AC_EFORMAT;
+
+    memcpy(user, tmp, len);
+    user[len] = '\0';
+    *user_len = len;
+    return AC_OK;
+}
+
+//
+// Build authinfo (= base64(username + ":")) for user verified by
+// other means. Given buffer must have room for AC_AUTHINFO_MAX bytes.
+//
+// Username comes from whatever ticket the scheme verified, so it is
+// checked here for all of them: ":" would be taken as the password
+// separator, and control characters have no place in headers or logs.
+//
+int
+ac_user_authinfo(ac_slice user, char *authinfo, size_t *authinfo_len) {
+    unsigned char tmp[AC_USER_MAX + 1];
+    size_t i;
+
+    if (user.len == 0 || user.len >= AC_USER_MAX) return AC_EFORMAT;
+    for (i = 0; i < user.len; i++) {
+        unsigned char c = user.ptr[i];
+
+        if (c == ':' || c < 0x20 || c == 0x7f) return AC_EFORMAT;
+    }
+
+    memcpy(tmp, user.ptr, user.len);
+    tmp[user.len] = ':';
+    *authinfo_len = base64_encode(authinfo, tmp, user.len + 1);
+    return AC_OK;
+}
+
+static int random_fd = -1;
+
+//
+// Open random source for tokens. Must be called at startup, before
+// chroot or dropping privileges may make /dev/urandom unreachable.
+// Returns -1 (with errno set) if it cannot be opened.
+//
+int
+ac_random_init(void) {
+    if (random_fd < 0) random_fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    return random_fd < 0 ? -1 : 0;
+}
+
+//
+// Generate hex-encoded random token of given (even) length.
+// Token buffer must have room for len + 1 bytes. Returns -1 if no
+// randomness is available, as guessable token is worse than none.
+//
+int
+ac_token_gen(char *token, size_t len) {
+    unsigned char rnd[64];
+    size_t n = len / 2;
+
+    if (n > sizeof(rnd)) n = sizeof(rnd);
+
+    if (random_fd < 0 || read(random_fd, rnd, n) != (ssize_t)n) return -1;
+    ac_hex_encode(token, rnd, n);
+    return 0;
+}
+
+//
+// Turn realm name into fixed-size ID to keep along with tokens and
+// tickets, so one issued in a realm is not taken in another. Empty
+// name (no tenant) is all zero.
+//
+const unsigned char ac_no_realm[AC_REALM_LEN];
+
+void
+ac_realm_id(ac_slice realm, unsigned char *id) {
+    MD5_CTX ctx;
+
+    if (! realm.len) {
+        memset(id, 0, AC_REALM_LEN);
+        return;
+    }
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, realm.ptr, realm.len);
+    MD5_Final(id, &ctx);
+}
+
+int
+ac_realm_equal(const unsigned char *a, const unsigned char *b) {
+    return memcmp(a, b, AC_REALM_LEN) == 0;
+}
+
+#ifdef USE_OPENSSL
+
+//
+// Load PEM-encoded public key to verify signed tickets.
+//
+EVP_PKEY *
+ac_pubkey_load(const char *path) {
+    EVP_PKEY *key;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) return NULL;
+    key = PEM_read_PUBKEY(fp, NULL, NULL, NULL);
+    fclose(fp);
+    return key;
+}
+
+//
+// Build identity assertion for backends, signed with shared key.
+// Given buffer must have room for AC_ASSERTION_MAX bytes.
+//
+// Assertion Format:
+//   <expires>.<sid>.<user>.<mac>
+//
+//   sid  = hex(first 8 bytes of session hash)
+//   user = base64url(username)
+//   mac  = base64url(HMAC-SHA256(key, everything before ".<mac>"))
+//
+int
+ac_assertion_make(ac_slice key, ac_slice user, time_t expires,
+                  const unsigned char *sid, char *out, size_t *len) {
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int maclen;
+    char hex[8 * 2 + 1];
+    int n;
+
+    if (user.len >= AC_USER_MAX) return AC_EFORMAT;
+
+    ac_hex_encode(hex, sid, 8);
+    n = snprintf(out, AC_ASSERTION_MAX, "%ld.%s.", (long)expires, hex);
+    n += base64url_encode(out + n, (const unsigned char *)user.ptr, user.len);
+
+    if (! HMAC(EVP_sha256(), key.ptr, key.len,
+               (unsigned char *)out, n, mac, &maclen)) {
+        return AC_EVERIFY;
+    }
+    out[n++] = '.';
+    n += base64url_encode(out + n, mac, maclen);
+    *len = n;
+    return AC_OK;
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef _AUTH_COOKIE_AUTHCORE_H_
+#define _AUTH_COOKIE_AUTHCORE_H_
+
+//
+// Server-independent part of mod_auth_cookie.
+//
+// Everything here works on plain byte slices, so it can be shared
+// by lighttpd module, authverifyd and anything else that needs to
+// verify the same cookies.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef USE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#define AC_MD5_LEN      16
+#define AC_REALM_LEN    AC_MD5_LEN // realm ID, all zero if no tenant
+#define AC_AUTHINFO_MAX 1024 // max length of decrypted authinfo
+#define AC_USER_MAX     256  // max length of username
+#define AC_COOKIE_MAX   4096 // max length of cookie value
+#define AC_ASSERTION_MAX 512 // max length of signed identity assertion
+#define AC_TIME_DIGITS  12   // max digits of time in seconds (no overflow)
+
+#define AC_OK        0
+#define AC_EFORMAT  -1 // malformed cookie
+#define AC_EEXPIRED -2 // signature matches no recent time segment
+#define AC_EDECRYPT -3 // decrypted payload is not a valid authinfo
+#define AC_EVERIFY  -4 // signature does not match
+
+typedef struct {
+    const char *ptr;
+    size_t      len;
+} ac_slice;
+
+#define AC_SLICE(p, l) ((ac_slice){ (p), (l) })
+#define AC_STR(s)      AC_SLICE((s), strlen(s))
+
+// things derived from authinfo, kept along with a session so each is
+// built only once per session
+typedef struct {
+    char        *assertion;     // signed identity assertion for backends
+    size_t       assertion_len;
+    const void  *assertion_key; // identifies the key it was signed with
+    unsigned int attrs_gen;     // directory generation attrs was found in
+    ac_slice     attrs;         // user record in directory, or empty
+    uint64_t     groups;        // groups in attrs, as bitset of group IDs
+    struct ac_user_stats *stats; // counters of the user, once found
+} ac_session_cache;
+
+int ac_cookie_find(ac_slice header, ac_slice name, ac_slice *value);
+size_t ac_urldecode(char *dst, ac_slice src);
+
+size_t ac_hex_encode(char *dst, const unsigned char *src, size_t len);
+size_t ac_hex_decode(unsigned char *dst, ac_slice src);
+
+int ac_crypt_verify(ac_slice key, ac_slice line, time_t now,
+                    char *authinfo, size_t *authinfo_len);
+int ac_authinfo_user(ac_slice authinfo, char *user, size_t *user_len);
+int ac_user_authinfo(ac_slice user, char *authinfo, size_t *authinfo_len);
+int ac_random_init(void);
+int ac_token_gen(char *token, size_t len);
+extern const unsigned char ac_no_realm[AC_REALM_LEN];
+
+void ac_realm_id(ac_slice realm, unsigned char *id);
+int ac_realm_equal(const unsigned char *a, const unsigned char *b);
+
+#ifdef USE_OPENSSL
+EVP_PKEY *ac_pubkey_load(const char *path);
+int ac_assertion_make(ac_slice key, ac_slice user, time_t expires,
+                      const unsigned char *sid, char *out, size_t *len);
+#endif
+
+#endif
@@ -0,0 +1,254 @@
+//
+// authtokend - token store daemon for mod_auth_cookie
+//
+// Keeps tokens issued by mod_auth_cookie in its own process, so
+// sessions survive lighttpd restarts and several lighttpd instances
+// on the same host can share one store. See tokend_proto.h for the
+// wire protocol.
+//
+// Usage:
+//   authtokend [-t timeout] /path/to/socket
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "store.h"
+#include "tokend_proto.h"
+
+#define MAX_CLIENTS 256
+
+typedef struct {
+    int    fd;
+    char   in[TOKEND_FRAME_MAX * 2]; // partially received frames
+    size_t inlen;
+    char  *out;                      // replies not yet written
+    size_t outlen, outsize;
+} client;
+
+static token_store *store;
+static client *clients[MAX_CLIENTS];
+static struct pollfd pfd[MAX_CLIENTS + 1];
+
+static void
+client_close(int i) {
+    close(clients[i]->fd);
+    free(clients[i]->out);
+    free(clients[i]);
+    clients[i] = NULL;
+}
+
+static void
+reply(client *c, const char *id, char code, const char *body, size_t len) {
+    char *p;
+
+    if (c->outlen + TOKEND_HEADER_LEN + len > c->outsize) {
+        size_t size = (c->outsize + TOKEND_HEADER_LEN + len) * 2;
+        if ((p = realloc(c->out, size)) == NULL) return;
+        c->out     = p;
+        c->outsize = size;
+    }
+    p = c->out + c->outlen;
+    TOKEND_PUT16(p, len + TOKEND_HEADER_LEN - 2);
+    memcpy(p + 2, id, 4);
+    p[6] = code;
+    memcpy(p + TOKEND_HEADER_LEN, body, len);
+    c->outlen += TOKEND_HEADER_LEN + len;
+}
+
+static void
+process(client *c, const char *f, size_t len) {
+    const char *id = f + 2, *body = f + TOKEND_HEADER_LEN;
+    size_t blen = len - TOKEND_HEADER_LEN;
+    char tmp[TOKEND_FRAME_MAX];
+    token_entry *te;
+
+    switch (f[6]) {
+    case TOKEND_GET:
+        if ((te = token_store_get(store, body, blen)) == NULL ||
+            TOKEND_HEADER_LEN + TOKEND_FOUND_HEAD + te->authinfo_len >
+            sizeof(tmp)) {
+            reply(c, id, TOKEND_NOTFOUND, NULL, 0);
+            break;
+        }
+        TOKEND_PUT32(tmp, (uint32_t)te->issued);
+        memcpy(tmp + 4, te->realm, AC_REALM_LEN);
+        memcpy(tmp + TOKEND_FOUND_HEAD, te->authinfo, te->authinfo_len);
+        reply(c, id, TOKEND_FOUND, tmp,
+              TOKEND_FOUND_HEAD + te->authinfo_len);
+        break;
+
+    case TOKEND_PUT:
+        if (blen >= TOKEND_PUT_HEAD) {
+            size_t toklen = (uint8_t)body[TOKEND_PUT_HEAD - 1];
+            const char *token = body + TOKEND_PUT_HEAD;
+
+            if (blen >= TOKEND_PUT_HEAD + toklen) {
+                token_store_put(store, token, toklen, TOKEND_GET32(body),
+                                (const unsigned char *)body + 4,
+                                token + toklen,
+                                blen - TOKEND_PUT_HEAD - toklen);
+            }
+        }
+        reply(c, id, TOKEND_OK, NULL, 0);
+        break;
+
+    case TOKEND_REMOVE:
+        token_store_remove(store, body, blen);
+        reply(c, id, TOKEND_OK, NULL, 0);
+        break;
+    }
+}
+
+// returns -1 if client should be closed
+static int
+client_read(client *c) {
+    ssize_t n;
+    size_t off = 0;
+
+    n = read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+    if (n == 0) return -1;
+    if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    c->inlen += n;
+
+    // handle all complete frames received so far
+    while (c->inlen - off >= 2) {
+        size_t len = TOKEND_GET16(c->in + off) + 2;
+        if (len < TOKEND_HEADER_LEN || len > TOKEND_FRAME_MAX) return -1;
+        if (c->inlen - off < len) break;
+        process(c, c->in + off, len);
+        off += len;
+    }
+    memmove(c->in, c->in + off, c->inlen - off);
+    c->inlen -= off;
+    return 0;
+}
+
+static int
+client_write(client *c) {
+    ssize_t n = write(c->fd, c->out, c->outlen);
+
+    if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    memmove(c->out, c->out + n, c->outlen - n);
+    c->outlen -= n;
+    return 0;
+}
+
+//
+// Protocol has no authentication of its own, so socket is made only
+// accessible to user and group of the daemon (mode 0660). Run it as
+// the user lighttpd runs as, or with lighttpd in its group.
+//
+static int
+listen_on(const char *path) {
+    struct sockaddr_un sun;
+    mode_t mask;
+    int fd, rc;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) return -1;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+    unlink(path);
+    mask = umask(S_IXUSR | S_IXGRP | S_IRWXO);
+    rc = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+    umask(mask);
+    if (rc != 0 || chmod(path, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) != 0 ||
+        listen(fd, 128) != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+int
+main(int argc, char **argv) {
+    int i, opt, lfd, timeout = 86400;
+    time_t last_expire = time(NULL);
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+        case 't': timeout = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-t timeout] socket\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-t timeout] socket\n", argv[0]);
+        return 1;
+    }
+
+    if ((lfd = listen_on(argv[optind])) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    store = token_store_init();
+
+    for (;;) {
+        int n = 0;
+
+        pfd[n].fd = lfd;
+        pfd[n++].events = POLLIN;
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            pfd[n].fd = clients[i] ? clients[i]->fd : -1;
+            pfd[n++].events = POLLIN |
+                (clients[i] && clients[i]->outlen ? POLLOUT : 0);
+        }
+
+        if (poll(pfd, n, 1000) < 0 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            int fd = accept(lfd, NULL, NULL);
+            for (i = 0; fd >= 0 && i < MAX_CLIENTS && clients[i]; i++);
+            if (fd >= 0 && i == MAX_CLIENTS) {
+                close(fd);
+            } else if (fd >= 0) {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                clients[i] = calloc(1, sizeof(client));
+                clients[i]->fd = fd;
+            }
+        }
+
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            short ev = pfd[i + 1].revents;
+
+            if (! clients[i] || pfd[i + 1].fd != clients[i]->fd) continue;
+            if ((ev & (POLLIN | POLLHUP | POLLERR)) &&
+                client_read(clients[i]) != 0) {
+                client_close(i);
+                continue;
+            }
+            if (clients[i]->outlen && client_write(clients[i]) != 0) {
+                client_close(i);
+            }
+        }
+
+        if (time(NULL) - last_expire >= 10) {
+            last_expire = time(NULL);
+            token_store_expire(store, last_expire - timeout, NULL, NULL);
+            token_store_compact(store);
+        }
+        token_store_rehash(store, TOKEN_REHASH_TICK);
+    }
+    return 0;
+}
@@ -0,0 +1,383 @@
+//
+// authverifyd - standalone cookie verifier
+//
+// Answers "is this cookie valid, and who is it" subrequests, as
+// issued by nginx auth_request or haproxy, using the same cookie
+// format as mod_auth_cookie. For each request, it replies with
+//
+//   200 + X-Auth-User/X-Auth-Authorization  if cookie is valid
+//   401                                     otherwise
+//
+// When "crypt:" cookie is verified, new token is issued and given
+// back in Set-Cookie: header, which the frontend should pass on to UA.
+//
+// Usage:
+//   authverifyd -l host:port -n name -K keyfile [-t timeout] [-o options]
+//
+// Key is read from keyfile (first line), as command line can be read
+// by any local user. "-k key" is still taken, but wiped from argv.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "authcore.h"
+#include "store.h"
+
+#define REQUEST_MAX 8192
+#define MAX_EVENTS  256
+
+typedef struct {
+    int    fd;
+    int    want_out;
+    int    closing;     // close once all replies are written
+    char   in[REQUEST_MAX + 1];
+    size_t inlen;
+    char  *out;
+    size_t outlen, outsize;
+} client;
+
+static struct {
+    ac_slice name;
+    ac_slice key;
+    const char *options;
+    int timeout;
+} conf = { { NULL, 0 }, { NULL, 0 }, "path=/;", 86400 };
+
+static token_store *store;
+static int epfd;
+
+static int
+listen_on(const char *addr) {
+    struct addrinfo hints, *res;
+    char buf[256], *port;
+    int fd, on = 1;
+
+    if (strlen(addr) >= sizeof(buf)) return -1;
+    strcpy(buf, addr);
+    if ((port = strrchr(buf, ':')) == NULL) return -1;
+    *port++ = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    if (getaddrinfo(*buf ? buf : NULL, port, &hints, &res) != 0) return -1;
+
+    if ((fd = socket(res->ai_family, SOCK_STREAM, 0)) >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    if (fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen) != 0 ||
+        listen(fd, 1024) != 0) {
+        if (fd >= 0) close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+static void
+out_append(client *c, const char *s, size_t len) {
+    if (c->outlen + len > c->outsize) {
+        size_t size = (c->outsize + len) * 2;
+        char *p = realloc(c->out, size);
+        if (! p) return;
+        c->out     = p;
+        c->outsize = size;
+    }
+    memcpy(c->out + c->outlen, s, len);
+    c->outlen += len;
+}
+
+#define OUT_STR(c, s) out_append((c), (s), strlen(s))
+
+//
+// Find value of given header within request head.
+//
+static int
+find_header(ac_slice head, const char *name, ac_slice *value) {
+    size_t nlen = strlen(name);
+    const char *p = head.ptr, *end = head.ptr + head.len;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (! eol) eol = end;
+
+        if ((size_t)(eol - p) > nlen && p[nlen] == ':' &&
+            strncasecmp(p, name, nlen) == 0) {
+            const char *v = p + nlen + 1, *e = eol;
+            while (v < e && (*v == ' ' || *v == '\t')) v++;
+            while (e > v && (e[-1] == '\r' || e[-1] == ' ')) e--;
+            value->ptr = v;
+            value->len = e - v;
+            return 0;
+        }
+        p = eol + 1;
+    }
+    return -1;
+}
+
+static void
+respond_ok(client *c, ac_slice authinfo, const char *token) {
+    char user[AC_USER_MAX];
+    size_t ulen;
+
+    if (ac_authinfo_user(authinfo, user, &ulen) != AC_OK) user[0] = '\0';
+
+    OUT_STR(c, "HTTP/1.1 200 OK\r\nX-Auth-User: ");
+    OUT_STR(c, user);
+    OUT_STR(c, "\r\nX-Auth-Authorization: Basic ");
+    out_append(c, authinfo.ptr, authinfo.len);
+    if (token) {
+        OUT_STR(c, "\r\nSet-Cookie: ");
+        out_append(c, conf.name.ptr, conf.name.len);
+        OUT_STR(c, "=token:");
+        OUT_STR(c, token);
+        OUT_STR(c, "; ");
+        OUT_STR(c, conf.options);
+    }
+    OUT_STR(c, "\r\nContent-Length: 0\r\n\r\n");
+}
+
+static void
+respond_deny(client *c) {
+    OUT_STR(c, "HTTP/1.1 401 Unauthorized\r\nContent-Length: 0\r\n\r\n");
+}
+
+static void
+verify(client *c, ac_slice head) {
+    char buf[AC_COOKIE_MAX], authinfo[AC_AUTHINFO_MAX];
+    size_t authinfo_len;
+    ac_slice hdr, cv;
+    time_t now = time(NULL);
+
+    if (find_header(head, "Cookie", &hdr) != 0 ||
+        ac_cookie_find(hdr, conf.name, &cv) != AC_OK ||
+        cv.len >= sizeof(buf)) {
+        respond_deny(c);
+        return;
+    }
+    cv.len = ac_urldecode(buf, cv);
+    buf[cv.len] = '\0';
+
+    if (strncmp(buf, "token:", 6) == 0) {
+        token_entry *te = token_store_get(store, buf + 6, cv.len - 6);
+        if (! te || ! ac_realm_equal(te->realm, ac_no_realm) ||
+            now - te->issued > conf.timeout) {
+            respond_deny(c);
+            return;
+        }
+        respond_ok(c, AC_SLICE(te->authinfo, te->authinfo_len), NULL);
+        return;
+    }
+
+    if (strncmp(buf, "crypt:", 6) == 0 &&
+        ac_crypt_verify(conf.key, AC_SLICE(buf + 6, cv.len - 6), now,
+                        authinfo, &authinfo_len) == AC_OK) {
+        char token[TOKEN_LEN + 1];
+
+        if (ac_token_gen(token, TOKEN_LEN) != 0) {
+            fprintf(stderr, "cannot read /dev/urandom, no token issued\n");
+            respond_deny(c);
+            return;
+        }
+        token_store_put(store, token, TOKEN_LEN, now, ac_no_realm,
+                        authinfo, authinfo_len);
+        respond_ok(c, AC_SLICE(authinfo, authinfo_len), token);
+        return;
+    }
+    respond_deny(c);
+}
+
+static void
+client_close(client *c) {
+    close(c->fd); // also removes it from epoll set
+    free(c->out);
+    free(c);
+}
+
+static int
+client_flush(client *c) {
+    while (c->outlen) {
+        ssize_t n = write(c->fd, c->out, c->outlen);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) return -1;
+            break;
+        }
+        memmove(c->out, c->out + n, c->outlen - n);
+        c->outlen -= n;
+    }
+
+    // only wait for writability while there's something to write
+    if (!! c->outlen != c->want_out) {
+        struct epoll_event ev;
+        ev.events   = EPOLLIN | (c->outlen ? EPOLLOUT : 0);
+        ev.data.ptr = c;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_out = !! c->outlen;
+    }
+    return 0;
+}
+
+// returns -1 if client should be closed
+static int
+client_read(client *c) {
+    for (;;) {
+        ssize_t n = read(c->fd, c->in + c->inlen, REQUEST_MAX - c->inlen);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            return -1;
+        }
+        c->inlen += n;
+
+        // answer all (pipelined) requests received so far
+        for (;;) {
+            char *eoh;
+            ac_slice conn;
+            size_t len;
+
+            c->in[c->inlen] = '\0';
+            if ((eoh = strstr(c->in, "\r\n\r\n")) == NULL) break;
+            len = eoh + 4 - c->in;
+
+            verify(c, AC_SLICE(c->in, len));
+
+            if (find_header(AC_SLICE(c->in, len), "Connection", &conn) == 0) {
+                c->closing = conn.len == 5 &&
+                    strncasecmp(conn.ptr, "close", 5) == 0;
+            }
+            memmove(c->in, c->in + len, c->inlen - len);
+            c->inlen -= len;
+        }
+        if (c->inlen == REQUEST_MAX) return -1; // request too large
+    }
+    if (client_flush(c) != 0) return -1;
+    return c->closing && ! c->outlen ? -1 : 0;
+}
+
+static void
+usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -l host:port -n name -K keyfile "
+            "[-t timeout] [-o options]\n", prog);
+    exit(1);
+}
+
+//
+// Read key from first line of given file.
+//
+static ac_slice
+read_key(const char *path) {
+    char line[1024], *key;
+    FILE *fp;
+    size_t len = 0;
+
+    if ((fp = fopen(path, "re")) == NULL) {
+        perror(path);
+        exit(1);
+    }
+    if (fgets(line, sizeof(line), fp)) len = strcspn(line, "\r\n");
+    fclose(fp);
+
+    key = malloc(len + 1);
+    memcpy(key, line, len);
+    key[len] = '\0';
+    memset(line, 0, sizeof(line));
+    return AC_SLICE(key, len);
+}
+
+int
+main(int argc, char **argv) {
+    struct epoll_event ev, events[MAX_EVENTS];
+    const char *addr = NULL;
+    time_t last_expire = time(NULL);
+    int i, opt, lfd;
+
+    while ((opt = getopt(argc, argv, "l:n:k:K:t:o:")) != -1) {
+        switch (opt) {
+        case 'l': addr = optarg; break;
+        case 'n': conf.name = AC_STR(optarg); break;
+        case 'k': // keep a copy, and hide it from ps
+            conf.key = AC_STR(strdup(optarg));
+            memset(optarg, 0, conf.key.len);
+            break;
+        case 'K': conf.key = read_key(optarg); break;
+        case 't': conf.timeout = atoi(optarg); break;
+        case 'o': conf.options = optarg; break;
+        default:  usage(argv[0]);
+        }
+    }
+    if (! addr || ! conf.name.len || ! conf.key.len) usage(argv[0]);
+    if (ac_random_init() != 0) {
+        perror("/dev/urandom");
+        return 1;
+    }
+
+    if ((lfd = listen_on(addr)) < 0) {
+        perror(addr);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    store = token_store_init();
+
+    epfd = epoll_create(MAX_EVENTS);
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+    for (;;) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+
+        for (i = 0; i < n; i++) {
+            client *c = events[i].data.ptr;
+
+            // accept as many as possible
+            if (! c) {
+                int fd, on = 1;
+                while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+                    fcntl(fd, F_SETFL, O_NONBLOCK);
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                    c = calloc(1, sizeof(*c));
+                    c->fd = fd;
+                    ev.events   = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+                }
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) &&
+                (client_flush(c) != 0 || (c->closing && ! c->outlen))) {
+                client_close(c);
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                client_read(c) != 0) {
+                client_close(c);
+            }
+        }
+
+        if (time(NULL) - last_expire >= 10) {
+            last_expire = time(NULL);
+            token_store_expire(store, last_expire - conf.timeout, NULL, NULL);
+            token_store_compact(store);
+        }
+        token_store_rehash(store, TOKEN_REHASH_TICK);
+    }
+    return 0;
+}
@@ -27,30 +27,30 @@ static const short base64_reverse_table[256] = {
 	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, /* 0xF0 - 0xFF */
 };
 
-unsigned char * base64_decode(buffer *out, const char *in) {
-	unsigned char *result;
-	int ch, j = 0, k;
-	size_t i;
-
-	size_t in_len = strlen(in);
-
-	buffer_prepare_copy(out, in_len);
+static int decode(unsigned char *out, const char *in, size_t in_len, int url) {
+	unsigned char *result = out;
+	int c = 0, ch, j = 0, k;
+	size_t i, n = 0;
 
-	result = (unsigned char *)out->ptr;
-
-	ch = in[0];
 	/* run through the whole string, converting as we go */
 	for (i = 0; i < in_len; i++) {
-		ch = in[i];
+		c = (unsigned char)in[i];
+
+		if (c == '\0') break;
 
-		if (ch == '\0') break;
+		if (c == base64_pad) break;
 
-		if (ch == base64_pad) break;
+		/* base64url uses "-_" in place of "+/" */
+		if (url) {
+			if (c == '+' || c == '/') continue;
+			if (c == '-') c = '+';
+			else if (c == '_') c = '/';
+		}
 
-		ch = base64_reverse_table[ch];
+		ch = base64_reverse_table[c];
 		if (ch < 0) continue;
 
-		switch(i % 4) {
+		switch(n++ % 4) {
 		case 0:
 			result[j] = ch << 2;
 			break;
@@ -69,11 +69,11 @@ unsigned char * base64_decode(buffer *out, const char *in) {
 	}
 	k = j;
 	/* mop things up if we ended on a boundary */
-	if (ch == base64_pad) {
-		switch(i % 4) {
+	if (c == base64_pad) {
+		switch(n % 4) {
 		case 0:
 		case 1:
-			return NULL;
+			return -1;
 		case 2:
 			k++;
 		case 3:
@@ -82,7 +82,69 @@ unsigned char * base64_decode(buffer *out, const char *in) {
 	}
 	result[k] = '\0';
 
-	out->used = k;
+	return j;
+}
+
+/*
+ * Decodes in_len bytes of base64 text into out, which must have room
+ * for BASE64_DECODED_MAX(in_len) bytes. Result is NUL-terminated.
+ * Returns length of decoded data, or -1 on bad padding.
+ */
+int base64_decode(unsigned char *out, const char *in, size_t in_len) {
+	return decode(out, in, in_len, 0);
+}
+
+/*
+ * Same as base64_decode(), but for URL-safe alphabet, where padding
+ * is usually omitted.
+ */
+int base64url_decode(unsigned char *out, const char *in, size_t in_len) {
+	return decode(out, in, in_len, 1);
+}
+
+static const char base64_table[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+ * Encodes in_len bytes into out, which must have room for
+ * BASE64_ENCODED_LEN(in_len) + 1 bytes. Returns length of result.
+ */
+int base64_encode(char *out, const unsigned char *in, size_t in_len) {
+	char *p = out;
+	size_t i;
 
-	return result;
+	for (i = 0; i + 2 < in_len; i += 3) {
+		*p++ = base64_table[in[i] >> 2];
+		*p++ = base64_table[((in[i] & 0x03) << 4) | (in[i + 1] >> 4)];
+		*p++ = base64_table[((in[i + 1] & 0x0f) << 2) | (in[i + 2] >> 6)];
+		*p++ = base64_table[in[i + 2] & 0x3f];
+	}
+	if (i < in_len) {
+		*p++ = base64_table[in[i] >> 2];
+		if (i + 1 < in_len) {
+			*p++ = base64_table[((in[i] & 0x03) << 4) | (in[i + 1] >> 4)];
+			*p++ = base64_table[(in[i + 1] & 0x0f) << 2];
+		} else {
+			*p++ = base64_table[(in[i] & 0x03) << 4];
+			*p++ = base64_pad;
+		}
+		*p++ = base64_pad;
+	}
+	*p = '\0';
+
+	return p - out;
+}
+
+/*
+ * Same as base64_encode(), but with URL-safe alphabet and no padding.
+ */
+int base64url_encode(char *out, const unsigned char *in, size_t in_len) {
+	int i, len = base64_encode(out, in, in_len);
+
+	while (len > 0 && out[len - 1] == base64_pad) out[--len] = '\0';
+	for (i = 0; i < len; i++) {
+		if (out[i] == '+') out[i] = '-';
+		else if (out[i] == '/') out[i] = '_';
+	}
+	return len;
 }
@@ -1,3 +1,9 @@
-#include "buffer.h"
+#include <stddef.h>
 
-unsigned char * base64_decode(buffer *out, const char *in);
+#define BASE64_DECODED_MAX(len) ((len) / 4 * 3 + 4)
+#define BASE64_ENCODED_LEN(len) (((len) + 2) / 3 * 4)
+
+int base64_decode(unsigned char *out, const char *in, size_t in_len);
+int base64url_decode(unsigned char *out, const char *in, size_t in_len);
+int base64_encode(char *out, const unsigned char *in, size_t in_len);
+int base64url_encode(char *out, const unsigned char *in, size_t in_len);
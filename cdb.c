@@ -0,0 +1,149 @@
+//
+// Reader for constant database (CDB) files.
+//
+// File Format (all numbers are 32-bit little-endian):
+//   header  = 256 * (position + slots) of hash tables
+//   records = (klen + dlen + key + data)*
+//   tables  = (hash + position of record)* for each table
+//
+//   hash = h * 33 ^ c for each byte c, starting with h = 5381
+//
+// File is rebuilt offline (cdbmake, or any compatible tool) and put
+// in place with rename(2), so a reader never sees a partial file.
+// It is mapped whole, so lookup needs no allocation nor copy, and
+// results are slices into the mapping.
+//
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cdb.h"
+
+#define HEADER_LEN 2048
+
+static uint32_t
+u32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t
+cdb_hash(ac_slice key) {
+    uint32_t h = 5381;
+    size_t i;
+
+    for (i = 0; i < key.len; i++) {
+        h = ((h << 5) + h) ^ (unsigned char)key.ptr[i];
+    }
+    return h;
+}
+
+//
+// (Re)load database if the file has been replaced since last load.
+// Returns 1 if loaded, 0 if unchanged, or -1 on error, in which
+// case previous mapping is kept as is.
+//
+int
+ac_cdb_reload(ac_cdb *db, const char *path) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (stat(path, &st) != 0) return -1;
+    if (db->map && st.st_ino == db->ino && st.st_mtime == db->mtime &&
+        (size_t)st.st_size == db->size) {
+        return 0;
+    }
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return -1;
+    if (fstat(fd, &st) != 0 || st.st_size < HEADER_LEN) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    ac_cdb_close(db);
+    db->map   = map;
+    db->size  = st.st_size;
+    db->ino   = st.st_ino;
+    db->mtime = st.st_mtime;
+    if (++db->gen == 0) db->gen = 1;
+    return 1;
+}
+
+void
+ac_cdb_close(ac_cdb *db) {
+    if (db->map) munmap((void *)db->map, db->size);
+    db->map  = NULL;
+    db->size = 0;
+}
+
+//
+// Find data for given key. Every offset is checked against file size,
+// as the file comes from outside.
+//
+int
+ac_cdb_find(const ac_cdb *db, ac_slice key, ac_slice *data) {
+    uint32_t h = cdb_hash(key);
+    const unsigned char *hp;
+    uint64_t hpos, hslots, kpos, n;
+
+    if (! db->map) return AC_EFORMAT;
+
+    hp     = db->map + (h & 255) * 8;
+    hpos   = u32(hp);
+    hslots = u32(hp + 4);
+    if (hslots == 0) return AC_EFORMAT;
+    if (hpos > db->size || hslots > (db->size - hpos) / 8) return AC_EFORMAT;
+
+    kpos = (h >> 8) % hslots;
+    for (n = 0; n < hslots; n++) {
+        const unsigned char *slot = db->map + hpos + kpos * 8;
+        uint64_t pos = u32(slot + 4), klen, dlen;
+
+        if (pos == 0) break; // empty slot - not found
+
+        if (u32(slot) == h && pos + 8 <= db->size) {
+            klen = u32(db->map + pos);
+            dlen = u32(db->map + pos + 4);
+            if (klen == key.len && pos + 8 + klen + dlen <= db->size &&
+                memcmp(db->map + pos + 8, key.ptr, klen) == 0) {
+                data->ptr = (const char *)db->map + pos + 8 + klen;
+                data->len = dlen;
+                return AC_OK;
+            }
+        }
+        if (++kpos == hslots) kpos = 0;
+    }
+    return AC_EFORMAT;
+}
+
+//
+// Find named attribute in a record of "name=value" lines.
+//
+int
+ac_cdb_attr(ac_slice record, ac_slice name, ac_slice *value) {
+    const char *p = record.ptr, *end = record.ptr + record.len;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (! eol) eol = end;
+
+        if ((size_t)(eol - p) > name.len && p[name.len] == '=' &&
+            memcmp(p, name.ptr, name.len) == 0) {
+            const char *v = p + name.len + 1;
+            const char *ev = eol;
+
+            if (ev > v && ev[-1] == '\r') ev--;
+            value->ptr = v;
+            value->len = ev - v;
+            return AC_OK;
+        }
+        p = eol + 1;
+    }
+    return AC_EFORMAT;
+}
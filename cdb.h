@@ -0,0 +1,22 @@
+#ifndef _AUTH_COOKIE_CDB_H_
+#define _AUTH_COOKIE_CDB_H_
+
+#include <sys/types.h>
+
+#include "authcore.h"
+
+// constant database, mapped into memory
+typedef struct {
+    const unsigned char *map;
+    size_t       size;
+    unsigned int gen;   // incremented on each (re)load, never 0 once loaded
+    ino_t        ino;   // to tell if file has been replaced
+    time_t       mtime;
+} ac_cdb;
+
+int ac_cdb_reload(ac_cdb *db, const char *path);
+void ac_cdb_close(ac_cdb *db);
+int ac_cdb_find(const ac_cdb *db, ac_slice key, ac_slice *data);
+int ac_cdb_attr(ac_slice record, ac_slice name, ac_slice *value);
+
+#endif
@@ -0,0 +1,673 @@
+//
+// Token replication over UDP.
+//
+// Each node sends mint, revoke and expiry of its tokens to all
+// configured peers, and applies whatever it receives from them
+// to its local store. This way, token minted on one node is also
+// accepted by others, so load balancer no longer needs sticky
+// sessions.
+//
+// Datagram Format:
+//   "ACG3" + stamp(8) + iv(16) + AES-256-CTR(records) + mac(32)
+//
+//   stamp  = sender time in seconds << 20 + counter, always increasing
+//   mac    = HMAC-SHA256 of everything else in the datagram
+//
+//   record = op(1) + issued(4) + realm(16) + toklen(1) + token
+//            + ailen(2) + authinfo
+//   op     = 'M'int | 'R'evoke | 'E'xpire | 'S'ync request | 'D'one
+//
+// Records carry authinfo, which is plain Basic credentials, so they
+// are encrypted, and both encryption and MAC keys are derived from
+// the shared key. Datagrams are only taken from configured peers,
+// and only if stamp is recent and not seen from that peer before.
+//
+// Realm is ID of the tenant token was minted for, so every node takes
+// a token only in the realm it was minted for.
+//
+// On startup, node asks its peers for their whole store with 'S',
+// and each peer replies with a series of 'M' records ending with 'D'.
+// The store may hold millions of tokens, so the reply goes out a few
+// datagrams at a time whenever the socket is writable, walking slots
+// down from the top, and 'D' is only sent once everything else has
+// been handed to the kernel.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#ifdef USE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#endif
+
+#include "gossip.h"
+#include "log.h"
+#include "fdevent.h"
+
+#define MAGIC      "ACG3"
+#define MAGIC_LEN  4
+#define STAMP_LEN  8
+#define IV_LEN     16
+#define MAC_LEN    32
+#define KEY_LEN    32
+#define HEADER_LEN (MAGIC_LEN + STAMP_LEN + IV_LEN)
+#define IV_OFF     (MAGIC_LEN + STAMP_LEN)
+#define BATCH_MAX  1400 // keep datagram within ethernet MTU
+#define SYNC_TRIES 10
+#define DUMP_BATCHES 32 // datagrams of store dump per writable event
+
+#define STAMP_SHIFT  20
+#define STAMP_WINDOW 30 // seconds of clock skew or delay tolerated
+#define REPLAY_BITS  64 // stamps remembered below the highest seen
+
+#define TOKEN_OFF  (6 + AC_REALM_LEN) // token in record
+#define RECORD_LEN(toklen, ailen) (TOKEN_OFF + 2 + (toklen) + (ailen))
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    uint64_t  top;  // highest stamp accepted from this peer
+    uint64_t  seen; // stamps accepted, as bits below top
+    int       dumping;   // sending our store to it
+    size_t    dump_next; // ...slots below this still to go
+} peer;
+
+struct gossip {
+    int fd;
+    int fde_ndx;
+    int registered;
+
+    token_store *store;
+    unsigned char mac_key[KEY_LEN];
+    unsigned char enc_key[KEY_LEN];
+    uint64_t stamp; // last stamp sent
+
+    peer  *peers;
+    size_t npeers;
+
+    char   batch[BATCH_MAX]; // records waiting to be sent
+    size_t batch_len;
+
+    int synced;
+    int sync_tries;
+    int ndumps;  // peers being sent our store
+    int writing; // ...so waiting for socket to be writable
+};
+
+//
+// parse "host:port" (or "[v6addr]:port") into socket address.
+//
+static int
+parse_addr(const char *s, struct sockaddr_storage *ss, socklen_t *sslen) {
+    struct addrinfo hints, *res;
+    char buf[256], *host = buf, *port;
+
+    if (strlen(s) >= sizeof(buf)) return -1;
+    strcpy(buf, s);
+
+    if ((port = strrchr(buf, ':')) == NULL) return -1;
+    *port++ = '\0';
+    if (*host == '[' && port - buf >= 3 && port[-2] == ']') {
+        host++;
+        port[-2] = '\0';
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+
+    memcpy(ss, res->ai_addr, res->ai_addrlen);
+    *sslen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static size_t
+encode(char *p, char op, time_t issued, const unsigned char *realm,
+       const char *token, size_t toklen, const char *ai, size_t ailen) {
+    uint32_t t = issued;
+
+    p[0] = op;
+    p[1] = t >> 24;
+    p[2] = t >> 16;
+    p[3] = t >> 8;
+    p[4] = t;
+    memcpy(p + 5, realm, AC_REALM_LEN);
+    p[TOKEN_OFF - 1] = toklen;
+    memcpy(p + TOKEN_OFF, token, toklen);
+    p[TOKEN_OFF + toklen] = ailen >> 8;
+    p[TOKEN_OFF + 1 + toklen] = ailen;
+    memcpy(p + TOKEN_OFF + 2 + toklen, ai, ailen);
+
+    return RECORD_LEN(toklen, ailen);
+}
+
+static uint64_t
+get64(const unsigned char *p) {
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) v = v << 8 | p[i];
+    return v;
+}
+
+static void
+put64(unsigned char *p, uint64_t v) {
+    int i;
+
+    for (i = 7; i >= 0; i--, v >>= 8) p[i] = v;
+}
+
+#ifdef USE_OPENSSL
+
+//
+// derive a separate key for each purpose from the shared key.
+//
+static int
+derive(const buffer *key, const char *purpose, unsigned char *out) {
+    unsigned int len;
+
+    return HMAC(EVP_sha256(), key->ptr, key->used - 1,
+                (const unsigned char *)purpose, strlen(purpose),
+                out, &len) && len == KEY_LEN ? 0 : -1;
+}
+
+// sign len bytes of datagram, putting MAC right after them
+static int
+sign(const gossip *g, unsigned char *dgram, size_t len) {
+    unsigned int maclen = 0;
+
+    return HMAC(EVP_sha256(), g->mac_key, KEY_LEN, dgram, len,
+                dgram + len, &maclen) && maclen == MAC_LEN ? 0 : -1;
+}
+
+static int
+verify(const gossip *g, const unsigned char *dgram, size_t len) {
+    unsigned char sig[EVP_MAX_MD_SIZE];
+    unsigned int maclen = 0;
+
+    if (len < MAC_LEN ||
+        ! HMAC(EVP_sha256(), g->mac_key, KEY_LEN, dgram, len - MAC_LEN,
+               sig, &maclen) || maclen != MAC_LEN) {
+        return 0;
+    }
+    return CRYPTO_memcmp(sig, dgram + len - MAC_LEN, MAC_LEN) == 0;
+}
+
+// AES-CTR is its own inverse, so this both encrypts and decrypts
+static int
+cipher(const gossip *g, const unsigned char *iv,
+       const unsigned char *in, size_t len, unsigned char *out) {
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int n, ok;
+
+    ok = ctx &&
+        EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, g->enc_key, iv) &&
+        EVP_EncryptUpdate(ctx, out, &n, in, len);
+    EVP_CIPHER_CTX_free(ctx);
+    return ok ? 0 : -1;
+}
+
+static int
+random_iv(unsigned char *iv) {
+    return RAND_bytes(iv, IV_LEN) == 1 ? 0 : -1;
+}
+
+#else
+
+static int
+sign(const gossip *g, unsigned char *dgram, size_t len) {
+    UNUSED(g); UNUSED(dgram); UNUSED(len);
+    return -1;
+}
+
+static int
+verify(const gossip *g, const unsigned char *dgram, size_t len) {
+    UNUSED(g); UNUSED(dgram); UNUSED(len);
+    return 0;
+}
+
+static int
+cipher(const gossip *g, const unsigned char *iv,
+       const unsigned char *in, size_t len, unsigned char *out) {
+    UNUSED(g); UNUSED(iv); UNUSED(in); UNUSED(len); UNUSED(out);
+    return -1;
+}
+
+static int
+random_iv(unsigned char *iv) {
+    UNUSED(iv);
+    return -1;
+}
+
+#endif
+
+//
+// Returns -1 if datagram could not be sent (e.g. socket buffer full).
+//
+static int
+send_to(server *srv, gossip *g, const char *body, size_t len,
+        const peer *to) {
+    unsigned char dgram[HEADER_LEN + BATCH_MAX + MAC_LEN];
+    uint64_t now = (uint64_t)time(NULL) << STAMP_SHIFT;
+
+    g->stamp = g->stamp + 1 > now ? g->stamp + 1 : now;
+
+    memcpy(dgram, MAGIC, MAGIC_LEN);
+    put64(dgram + MAGIC_LEN, g->stamp);
+    if (random_iv(dgram + IV_OFF) != 0 ||
+        cipher(g, dgram + IV_OFF, (const unsigned char *)body, len,
+               dgram + HEADER_LEN) != 0 ||
+        sign(g, dgram, HEADER_LEN + len) != 0) {
+        log_error_write(srv, __FILE__, __LINE__, "s",
+                        "gossip: cannot seal datagram");
+        return -1;
+    }
+
+    if (sendto(g->fd, dgram, HEADER_LEN + len + MAC_LEN, 0,
+               (const struct sockaddr *)&to->addr, to->addrlen) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_error_write(srv, __FILE__, __LINE__, "ss",
+                            "gossip: sendto failed:", strerror(errno));
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static void
+flush(server *srv, gossip *g) {
+    size_t i;
+
+    if (g->batch_len == 0) return;
+
+    for (i = 0; i < g->npeers; i++) {
+        send_to(srv, g, g->batch, g->batch_len, &g->peers[i]);
+    }
+    g->batch_len = 0;
+}
+
+static void
+queue(server *srv, gossip *g, char op, time_t issued,
+      const unsigned char *realm,
+      const char *token, size_t toklen, const char *ai, size_t ailen) {
+    size_t len = RECORD_LEN(toklen, ailen);
+
+    if (len > BATCH_MAX) {
+        log_error_write(srv, __FILE__, __LINE__, "s",
+                        "gossip: authinfo too long to replicate");
+        return;
+    }
+    if (g->batch_len + len > BATCH_MAX) flush(srv, g);
+    g->batch_len += encode(g->batch + g->batch_len,
+                           op, issued, realm, token, toklen, ai, ailen);
+}
+
+//
+// Watch for socket to become writable only while some dump is going.
+//
+static void
+want_write(server *srv, gossip *g, int on) {
+    if (g->writing == on) return;
+
+    fdevent_event_add(srv->ev, &g->fde_ndx, g->fd,
+                      on ? FDEVENT_IN | FDEVENT_OUT : FDEVENT_IN);
+    g->writing = on;
+}
+
+//
+// anti-entropy - send whole store to the node just (re)started.
+// Only starts it; dump_some() sends it as the socket takes it.
+//
+static void
+dump(server *srv, gossip *g, peer *to) {
+    if (! to->dumping) g->ndumps++;
+    to->dumping   = 1;
+    to->dump_next = g->store->used;
+    want_write(srv, g, 1);
+}
+
+//
+// Send next few datagrams of the store to given peer. Each one is
+// built from the cursor again until it has actually been sent, so
+// nothing is lost when socket buffer is full.
+//
+static void
+dump_some(server *srv, gossip *g, peer *to) {
+    char body[BATCH_MAX];
+    int n;
+
+    for (n = 0; n < DUMP_BATCHES; n++) {
+        size_t slot = to->dump_next, len = 0;
+        token_entry *te;
+        int done = 0;
+
+        if (slot > g->store->used) slot = g->store->used;
+        for (; slot > 0; slot--) {
+            size_t toklen, rlen;
+
+            te = token_store_at(g->store, slot - 1);
+            toklen = strlen(te->token);
+            rlen = RECORD_LEN(toklen, te->authinfo_len);
+            if (rlen > BATCH_MAX) continue;
+            if (len + rlen > BATCH_MAX) break;
+            len += encode(body + len, 'M', te->issued, te->realm,
+                          te->token, toklen, te->authinfo, te->authinfo_len);
+        }
+        if (slot == 0 && len + RECORD_LEN(0, 0) <= BATCH_MAX) {
+            len += encode(body + len, 'D', 0, ac_no_realm, NULL, 0, NULL, 0);
+            done = 1;
+        }
+        if (send_to(srv, g, body, len, to) != 0) return; // retry later
+
+        to->dump_next = slot;
+        if (done) {
+            to->dumping = 0;
+            g->ndumps--;
+            return;
+        }
+    }
+}
+
+static int
+same_addr(const struct sockaddr_storage *a, const struct sockaddr *b) {
+    if (a->ss_family != b->sa_family) return 0;
+
+    if (b->sa_family == AF_INET) {
+        const struct sockaddr_in *x = (const struct sockaddr_in *)a;
+        const struct sockaddr_in *y = (const struct sockaddr_in *)b;
+
+        return x->sin_port == y->sin_port &&
+            x->sin_addr.s_addr == y->sin_addr.s_addr;
+    }
+    if (b->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a;
+        const struct sockaddr_in6 *y = (const struct sockaddr_in6 *)b;
+
+        return x->sin6_port == y->sin6_port &&
+            memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr)) == 0;
+    }
+    return 0;
+}
+
+static peer *
+find_peer(gossip *g, const struct sockaddr *from) {
+    size_t i;
+
+    for (i = 0; i < g->npeers; i++) {
+        if (same_addr(&g->peers[i].addr, from)) return &g->peers[i];
+    }
+    return NULL;
+}
+
+//
+// Accept stamp only once per peer, and only if sent recently.
+// Stamps a little out of order are still taken, as UDP may reorder.
+//
+static int
+fresh(peer *pr, uint64_t stamp) {
+    uint64_t sent = stamp >> STAMP_SHIFT, now = time(NULL), d;
+
+    if (sent + STAMP_WINDOW < now || sent > now + STAMP_WINDOW) return 0;
+
+    if (stamp > pr->top) {
+        d = stamp - pr->top;
+        pr->seen = d >= REPLAY_BITS ? 1 : pr->seen << d | 1;
+        pr->top  = stamp;
+        return 1;
+    }
+    d = pr->top - stamp;
+    if (d >= REPLAY_BITS || (pr->seen >> d & 1)) return 0;
+    pr->seen |= (uint64_t)1 << d;
+    return 1;
+}
+
+static void
+receive(server *srv, gossip *g, const unsigned char *dgram, size_t n,
+        const struct sockaddr *from) {
+    static unsigned char body[65536];
+    const char *p = (const char *)body, *end;
+    peer *pr;
+
+    if (n < HEADER_LEN + MAC_LEN || memcmp(dgram, MAGIC, MAGIC_LEN) != 0) {
+        return;
+    }
+
+    if ((pr = find_peer(g, from)) == NULL) {
+        log_error_write(srv, __FILE__, __LINE__, "s",
+                        "gossip: dropping datagram from unknown peer");
+        return;
+    }
+    if (! verify(g, dgram, n)) {
+        log_error_write(srv, __FILE__, __LINE__, "s",
+                        "gossip: dropping datagram with bad signature");
+        return;
+    }
+    if (! fresh(pr, get64(dgram + MAGIC_LEN))) {
+        log_error_write(srv, __FILE__, __LINE__, "s",
+                        "gossip: dropping stale or replayed datagram");
+        return;
+    }
+    n -= HEADER_LEN + MAC_LEN;
+    if (cipher(g, dgram + IV_OFF, dgram + HEADER_LEN, n, body) != 0) return;
+
+    for (end = p + n;
+         (size_t)(end - p) >= RECORD_LEN(0, 0); ) {
+        const uint8_t *u = (const uint8_t *)p;
+        size_t toklen, ailen;
+        time_t issued;
+
+        toklen = u[TOKEN_OFF - 1];
+        if ((size_t)(end - p) < RECORD_LEN(toklen, 0)) break;
+        ailen = u[TOKEN_OFF + toklen] << 8 | u[TOKEN_OFF + 1 + toklen];
+        if ((size_t)(end - p) < RECORD_LEN(toklen, ailen)) break;
+
+        issued = (uint32_t)u[1] << 24 | u[2] << 16 | u[3] << 8 | u[4];
+
+        switch (p[0]) {
+        case 'M':
+            token_store_put(g->store, p + TOKEN_OFF, toklen, issued, u + 5,
+                            p + TOKEN_OFF + 2 + toklen, ailen);
+            break;
+        case 'R':
+        case 'E':
+            token_store_remove(g->store, p + TOKEN_OFF, toklen);
+            break;
+        case 'S':
+            // answer configured address, never where it came from
+            dump(srv, g, pr);
+            break;
+        case 'D':
+            g->synced = 1;
+            break;
+        }
+        p += RECORD_LEN(toklen, ailen);
+    }
+}
+
+static handler_t
+gossip_handle_fdevent(server *srv, void *ctx, int revents) {
+    static unsigned char dgram[65536];
+    gossip *g = ctx;
+    size_t i;
+
+    if (revents & FDEVENT_OUT) {
+        for (i = 0; i < g->npeers; i++) {
+            if (g->peers[i].dumping) dump_some(srv, g, &g->peers[i]);
+        }
+        if (g->ndumps == 0) want_write(srv, g, 0);
+    }
+    if (! (revents & FDEVENT_IN)) return HANDLER_GO_ON;
+
+    for (;;) {
+        struct sockaddr_storage from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t n = recvfrom(g->fd, dgram, sizeof(dgram), 0,
+                             (struct sockaddr *)&from, &fromlen);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break; // EAGAIN - drained
+        }
+        receive(srv, g, dgram, n, (struct sockaddr *)&from);
+    }
+    return HANDLER_GO_ON;
+}
+
+/**********************************************************************
+ * interface
+ **********************************************************************/
+
+#ifndef USE_OPENSSL
+
+gossip *
+gossip_init(server *srv, token_store *ts,
+            buffer *listen, array *peers, buffer *key) {
+    UNUSED(ts); UNUSED(peers); UNUSED(key);
+
+    log_error_write(srv, __FILE__, __LINE__, "sb",
+                    "gossip: built without OpenSSL, cannot listen on", listen);
+    return NULL;
+}
+
+#else
+
+gossip *
+gossip_init(server *srv, token_store *ts,
+            buffer *listen, array *peers, buffer *key) {
+    struct sockaddr_storage ss;
+    socklen_t sslen;
+    gossip *g;
+    size_t i;
+
+    if (parse_addr(listen->ptr, &ss, &sslen) != 0) {
+        log_error_write(srv, __FILE__, __LINE__, "sb",
+                        "gossip: invalid listen address:", listen);
+        return NULL;
+    }
+    if (buffer_is_empty(key)) {
+        log_error_write(srv, __FILE__, __LINE__, "s",
+                        "gossip: auth-cookie.gossip-key must be set");
+        return NULL;
+    }
+
+    g = calloc(1, sizeof(*g));
+    g->fd      = -1;
+    g->fde_ndx = -1;
+    g->store   = ts;
+    g->peers   = calloc(peers->used + 1, sizeof(peer));
+
+    if (derive(key, "auth-cookie gossip mac", g->mac_key) != 0 ||
+        derive(key, "auth-cookie gossip enc", g->enc_key) != 0) {
+        log_error_write(srv, __FILE__, __LINE__, "s",
+                        "gossip: cannot derive keys");
+        gossip_free(srv, g);
+        return NULL;
+    }
+
+    for (i = 0; i < peers->used; i++) {
+        data_string *ds = (data_string *)peers->data[i];
+        peer *pr = &g->peers[g->npeers];
+
+        if (ds->type != TYPE_STRING ||
+            parse_addr(ds->value->ptr, &pr->addr, &pr->addrlen) != 0) {
+            log_error_write(srv, __FILE__, __LINE__, "sb",
+                            "gossip: invalid peer address:", ds->value);
+            gossip_free(srv, g);
+            return NULL;
+        }
+        g->npeers++;
+    }
+
+    g->fd = socket(ss.ss_family, SOCK_DGRAM, 0);
+    if (g->fd < 0 || bind(g->fd, (struct sockaddr *)&ss, sslen) != 0) {
+        log_error_write(srv, __FILE__, __LINE__, "sbss",
+                        "gossip: cannot listen on", listen, ":",
+                        strerror(errno));
+        gossip_free(srv, g);
+        return NULL;
+    }
+    fcntl(g->fd, F_SETFD, FD_CLOEXEC);
+    fcntl(g->fd, F_SETFL, O_NONBLOCK | O_RDWR);
+
+    return g;
+}
+
+#endif
+
+void
+gossip_free(server *srv, gossip *g) {
+    if (! g) return;
+
+    if (g->registered) {
+        fdevent_event_del(srv->ev, &g->fde_ndx, g->fd);
+        fdevent_unregister(srv->ev, g->fd);
+    }
+    if (g->fd >= 0) close(g->fd);
+
+    free(g->peers);
+    free(g);
+}
+
+//
+// Newly minted token must reach peers before UA comes back
+// with it, so it is sent out right away.
+//
+void
+gossip_mint(server *srv, gossip *g, const char *token, size_t len,
+            time_t issued, const unsigned char *realm,
+            const char *authinfo, size_t authinfo_len) {
+    if (! g) return;
+
+    queue(srv, g, 'M', issued, realm, token, len, authinfo, authinfo_len);
+    flush(srv, g);
+}
+
+//
+// Revocations come in bulk (when revoked users are reloaded), so
+// they are queued, and sent in batch by gossip_trigger() right after.
+//
+void
+gossip_revoke(server *srv, gossip *g, const char *token) {
+    if (! g) return;
+
+    queue(srv, g, 'R', 0, ac_no_realm, token, strlen(token), NULL, 0);
+}
+
+//
+// Expiry is not urgent as every node expires tokens by itself,
+// so it is only queued and sent in batch on next trigger.
+//
+void
+gossip_expire(server *srv, gossip *g, const char *token) {
+    if (! g) return;
+
+    queue(srv, g, 'E', 0, ac_no_realm, token, strlen(token), NULL, 0);
+}
+
+void
+gossip_trigger(server *srv, gossip *g) {
+    if (! g) return;
+
+    // fdevent is not ready at set_defaults stage, so register here
+    if (! g->registered) {
+        fdevent_register(srv->ev, g->fd, gossip_handle_fdevent, g);
+        fdevent_event_add(srv->ev, &g->fde_ndx, g->fd, FDEVENT_IN);
+        g->registered = 1;
+    }
+
+    // keep asking peers for their store until someone answers
+    if (! g->synced && g->npeers > 0 && g->sync_tries < SYNC_TRIES) {
+        queue(srv, g, 'S', 0, ac_no_realm, NULL, 0, NULL, 0);
+        g->sync_tries++;
+    }
+
+    flush(srv, g);
+
+    // in case socket never reported writable (e.g. event got lost)
+    if (g->ndumps > 0) gossip_handle_fdevent(srv, g, FDEVENT_OUT);
+}
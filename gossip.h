@@ -0,0 +1,21 @@
+#ifndef _AUTH_COOKIE_GOSSIP_H_
+#define _AUTH_COOKIE_GOSSIP_H_
+
+#include "base.h"
+#include "store.h"
+
+// replication channel to other nodes sharing the same cookie realm
+typedef struct gossip gossip;
+
+gossip *gossip_init(server *srv, token_store *ts,
+                    buffer *listen, array *peers, buffer *key);
+void gossip_free(server *srv, gossip *g);
+
+void gossip_mint(server *srv, gossip *g, const char *token, size_t len,
+                 time_t issued, const unsigned char *realm,
+                 const char *authinfo, size_t authinfo_len);
+void gossip_revoke(server *srv, gossip *g, const char *token);
+void gossip_expire(server *srv, gossip *g, const char *token);
+void gossip_trigger(server *srv, gossip *g);
+
+#endif
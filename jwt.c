@@ -0,0 +1,291 @@
+//
+// JSON Web Token (RFC 7519) in compact serialization.
+//
+// Token Format:
+//   <header>.<payload>.<signature>
+//
+// where each part is base64url-encoded. Only the claims needed for
+// authentication (sub, exp, nbf) are extracted, with a small JSON
+// scanner that looks at top-level members only. Signature is made
+// with HS256, RS256 or EdDSA (Ed25519).
+//
+
+#include <ctype.h>
+#include <stdlib.h>
+
+#include "jwt.h"
+#include "base64.h"
+
+#ifdef USE_OPENSSL
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#endif
+
+#define SIG_MAX 1024 // enough for 4096-bit RSA signature in base64url
+
+#define WS(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+static const char *
+skip_ws(const char *p, const char *end) {
+    while (p < end && WS(*p)) p++;
+    return p;
+}
+
+// skip string at p (pointing '"'), and return pointer after it
+static const char *
+skip_string(const char *p, const char *end) {
+    for (p++; p < end; p++) {
+        if (*p == '\\') p++;
+        else if (*p == '"') return p + 1;
+    }
+    return NULL;
+}
+
+// skip any value at p, and return pointer after it
+static const char *
+skip_value(const char *p, const char *end) {
+    int depth = 0;
+
+    while (p < end) {
+        if (*p == '"') {
+            if ((p = skip_string(p, end)) == NULL) return NULL;
+            if (depth == 0) return p;
+            continue;
+        }
+        if (*p == '{' || *p == '[') {
+            depth++;
+        } else if (*p == '}' || *p == ']') {
+            if (depth == 0) return p;
+            if (--depth == 0) return p + 1;
+        } else if (depth == 0 && (*p == ',' || WS(*p))) {
+            return p;
+        }
+        p++;
+    }
+    return depth == 0 ? p : NULL;
+}
+
+//
+// Find named member of top-level JSON object, and return its raw value.
+//
+static int
+json_member(ac_slice obj, const char *name, ac_slice *val) {
+    const char *p = obj.ptr, *end = obj.ptr + obj.len;
+    size_t nlen = strlen(name);
+
+    p = skip_ws(p, end);
+    if (p >= end || *p++ != '{') return AC_EFORMAT;
+
+    for (;;) {
+        const char *k, *v;
+        size_t klen;
+
+        p = skip_ws(p, end);
+        if (p >= end || *p != '"') return AC_EFORMAT;
+        k = p + 1;
+        if ((p = skip_string(p, end)) == NULL) return AC_EFORMAT;
+        klen = p - 1 - k;
+
+        p = skip_ws(p, end);
+        if (p >= end || *p++ != ':') return AC_EFORMAT;
+        v = p = skip_ws(p, end);
+        if ((p = skip_value(p, end)) == NULL || p == v) return AC_EFORMAT;
+
+        if (klen == nlen && memcmp(k, name, nlen) == 0) {
+            *val = AC_SLICE(v, p - v);
+            return AC_OK;
+        }
+
+        p = skip_ws(p, end);
+        if (p >= end || *p++ != ',') return AC_EFORMAT; // not found
+    }
+}
+
+//
+// Unescape JSON string value into NUL-terminated buffer of given size.
+// Control characters (which never appear in valid username) and
+// surrogate pairs are rejected.
+//
+static int
+json_string(ac_slice val, char *out, size_t max, size_t *len) {
+    const char *p = val.ptr + 1, *end = val.ptr + val.len - 1;
+    size_t n = 0;
+
+    if (val.len < 2 || val.ptr[0] != '"' || *end != '"') return AC_EFORMAT;
+
+    while (p < end) {
+        unsigned int c = (unsigned char)*p++;
+        int escaped = (c == '\\');
+
+        if (escaped) {
+            if (p >= end) return AC_EFORMAT;
+            switch (c = (unsigned char)*p++) {
+            case '"': case '\\': case '/': break;
+            case 'u': {
+                unsigned char hex[2];
+
+                if (end - p < 4) return AC_EFORMAT;
+                if (! isxdigit((unsigned char)p[0]) ||
+                    ! isxdigit((unsigned char)p[1]) ||
+                    ! isxdigit((unsigned char)p[2]) ||
+                    ! isxdigit((unsigned char)p[3])) return AC_EFORMAT;
+                ac_hex_decode(hex, AC_SLICE(p, 4));
+                c = hex[0] << 8 | hex[1];
+                p += 4;
+                break;
+            }
+            default:
+                return AC_EFORMAT; // \b, \f, \n, \r, \t or invalid
+            }
+        }
+        if (c < 0x20 || (c >= 0xd800 && c < 0xe000)) return AC_EFORMAT;
+
+        // encode as UTF-8 (raw input is UTF-8 already)
+        if (c < 0x80 || ! escaped) {
+            if (n + 1 >= max) return AC_EFORMAT;
+            out[n++] = c;
+        } else if (c < 0x800) {
+            if (n + 2 >= max) return AC_EFORMAT;
+            out[n++] = 0xc0 | c >> 6;
+            out[n++] = 0x80 | (c & 0x3f);
+        } else {
+            if (n + 3 >= max) return AC_EFORMAT;
+            out[n++] = 0xe0 | c >> 12;
+            out[n++] = 0x80 | ((c >> 6) & 0x3f);
+            out[n++] = 0x80 | (c & 0x3f);
+        }
+    }
+    out[n] = '\0';
+    *len = n;
+    return AC_OK;
+}
+
+//
+// Parse NumericDate value. Fraction of a second is ignored.
+//
+static int
+json_time(ac_slice val, time_t *t) {
+    const char *p = val.ptr, *end = val.ptr + val.len;
+
+    for (*t = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (p - val.ptr == AC_TIME_DIGITS) return AC_EFORMAT;
+        *t = *t * 10 + (*p - '0');
+    }
+    if (p == val.ptr) return AC_EFORMAT;
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++);
+    }
+    return p == end ? AC_OK : AC_EFORMAT;
+}
+
+int
+ac_jwt_parse(ac_slice token, ac_jwt *t) {
+    unsigned char buf[BASE64_DECODED_MAX(AC_COOKIE_MAX)];
+    const char *dot1, *dot2, *end = token.ptr + token.len;
+    char alg[8];
+    ac_slice v;
+    size_t len;
+    int n;
+
+    memset(t, 0, sizeof(*t));
+
+    if (token.len > AC_COOKIE_MAX) return AC_EFORMAT;
+    if ((dot1 = memchr(token.ptr, '.', token.len)) == NULL) return AC_EFORMAT;
+    if ((dot2 = memchr(dot1 + 1, '.', end - dot1 - 1)) == NULL) {
+        return AC_EFORMAT;
+    }
+    t->data = AC_SLICE(token.ptr, dot2 - token.ptr);
+    t->sig  = AC_SLICE(dot2 + 1, end - dot2 - 1);
+
+    // unsigned ("alg": "none") token is never accepted
+    if (! t->sig.len) return AC_EFORMAT;
+
+    // header - only algorithm matters, but reject unknown extensions
+    if ((n = base64url_decode(buf, token.ptr, dot1 - token.ptr)) < 0 ||
+        json_member(AC_SLICE((char *)buf, n), "alg", &v) != AC_OK ||
+        json_string(v, alg, sizeof(alg), &len) != AC_OK) {
+        return AC_EFORMAT;
+    }
+    if (strcmp(alg, "HS256") == 0) t->alg = AC_JWT_HS256;
+    else if (strcmp(alg, "RS256") == 0) t->alg = AC_JWT_RS256;
+    else if (strcmp(alg, "EdDSA") == 0) t->alg = AC_JWT_EDDSA;
+    else return AC_EFORMAT;
+
+    if (json_member(AC_SLICE((char *)buf, n), "crit", &v) == AC_OK) {
+        return AC_EFORMAT;
+    }
+
+    // payload
+    if ((n = base64url_decode(buf, dot1 + 1, dot2 - dot1 - 1)) < 0 ||
+        json_member(AC_SLICE((char *)buf, n), "sub", &v) != AC_OK ||
+        json_string(v, t->sub, sizeof(t->sub), &t->sub_len) != AC_OK) {
+        return AC_EFORMAT;
+    }
+
+    if (json_member(AC_SLICE((char *)buf, n), "exp", &v) == AC_OK &&
+        json_time(v, &t->exp) != AC_OK) {
+        return AC_EFORMAT;
+    }
+    if (json_member(AC_SLICE((char *)buf, n), "nbf", &v) == AC_OK &&
+        json_time(v, &t->nbf) != AC_OK) {
+        return AC_EFORMAT;
+    }
+    return AC_OK;
+}
+
+#ifdef USE_OPENSSL
+
+static int
+digest_verify(EVP_PKEY *key, const EVP_MD *md, const ac_jwt *t,
+              const unsigned char *sig, size_t siglen) {
+    EVP_MD_CTX *ctx;
+    int ok;
+
+    if ((ctx = EVP_MD_CTX_new()) == NULL) return 0;
+    ok = EVP_DigestVerifyInit(ctx, NULL, md, NULL, key) == 1 &&
+        EVP_DigestVerify(ctx, sig, siglen,
+                         (const unsigned char *)t->data.ptr,
+                         t->data.len) == 1;
+    EVP_MD_CTX_free(ctx);
+    return ok;
+}
+
+//
+// Verify signature with shared secret (HS256) or public key (RS256,
+// EdDSA). Algorithm must match the kind of key, so public key can
+// never be abused as HMAC secret.
+//
+int
+ac_jwt_verify(const ac_jwt *t, ac_slice secret, EVP_PKEY *key) {
+    unsigned char sig[BASE64_DECODED_MAX(SIG_MAX)];
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int maclen;
+    int siglen, ok = 0;
+
+    if (t->sig.len > SIG_MAX) return AC_EFORMAT;
+    if ((siglen = base64url_decode(sig, t->sig.ptr, t->sig.len)) <= 0) {
+        return AC_EFORMAT;
+    }
+
+    switch (t->alg) {
+    case AC_JWT_HS256:
+        ok = secret.len &&
+            HMAC(EVP_sha256(), secret.ptr, secret.len,
+                 (const unsigned char *)t->data.ptr, t->data.len,
+                 mac, &maclen) &&
+            (unsigned int)siglen == maclen &&
+            CRYPTO_memcmp(sig, mac, maclen) == 0;
+        break;
+    case AC_JWT_RS256:
+        ok = key && EVP_PKEY_id(key) == EVP_PKEY_RSA &&
+            digest_verify(key, EVP_sha256(), t, sig, siglen);
+        break;
+    case AC_JWT_EDDSA:
+        ok = key && EVP_PKEY_id(key) == EVP_PKEY_ED25519 &&
+            digest_verify(key, NULL, t, sig, siglen);
+        break;
+    }
+    return ok ? AC_OK : AC_EVERIFY;
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef _AUTH_COOKIE_JWT_H_
+#define _AUTH_COOKIE_JWT_H_
+
+#include "authcore.h"
+
+#define AC_JWT_HS256 1
+#define AC_JWT_RS256 2
+#define AC_JWT_EDDSA 3
+
+// JSON Web Token, with claims needed for authentication
+typedef struct {
+    ac_slice data;              // signed part, "<header>.<payload>"
+    ac_slice sig;               // base64url-encoded signature
+    int      alg;               // AC_JWT_*
+    char     sub[AC_USER_MAX];  // subject, unescaped
+    size_t   sub_len;
+    time_t   exp;               // expiry, or 0 if not given
+    time_t   nbf;               // not-before, or 0 if not given
+} ac_jwt;
+
+int ac_jwt_parse(ac_slice token, ac_jwt *t);
+
+#ifdef USE_OPENSSL
+int ac_jwt_verify(const ac_jwt *t, ac_slice secret, EVP_PKEY *key);
+#endif
+
+#endif
@@ -0,0 +1,112 @@
+//
+// Per-process cache in front of external token store (authtokend).
+//
+// Asking authtokend costs a round-trip per request, and whatever is
+// built for a session (assertion, directory lookup) would be thrown
+// away each time. Recently seen tokens are kept here, direct-mapped
+// by hash of token, so a busy session is served without leaving the
+// process. Slot is simply taken over on collision.
+//
+// Entries are trusted for a few seconds only, in case token is gone
+// from the store meanwhile. All of them are dropped at once (by
+// generation number, without touching each) when revocations change.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "l1cache.h"
+
+static size_t
+hash(ac_slice s) {
+    size_t h = 2166136261u; // FNV-1a, as tokens are random anyway
+    size_t i;
+
+    for (i = 0; i < s.len; i++) {
+        h ^= (unsigned char)s.ptr[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void
+entry_clear(ac_l1_entry *e) {
+    free(e->authinfo);
+    free(e->cache.assertion);
+    memset(e, 0, sizeof(*e));
+}
+
+ac_l1cache *
+ac_l1cache_init(int ttl) {
+    ac_l1cache *l1 = calloc(1, sizeof(*l1));
+
+    if (! l1) return NULL;
+    l1->ttl = ttl;
+    return l1;
+}
+
+void
+ac_l1cache_free(ac_l1cache *l1) {
+    size_t i;
+
+    if (! l1) return;
+
+    for (i = 0; i < AC_L1_SLOTS; i++) entry_clear(&l1->slot[i]);
+    free(l1);
+}
+
+ac_l1_entry *
+ac_l1cache_get(ac_l1cache *l1, ac_slice token,
+               const unsigned char *realm, time_t now) {
+    ac_l1_entry *e;
+
+    if (! l1 || token.len == 0 || token.len > TOKEN_LEN) return NULL;
+
+    e = &l1->slot[hash(token) & (AC_L1_SLOTS - 1)];
+    if (memcmp(e->token, token.ptr, token.len) != 0 ||
+        e->token[token.len] != '\0') return NULL;
+    if (! ac_realm_equal(e->realm, realm)) return NULL;
+
+    if (e->gen != l1->gen || now - e->fetched >= l1->ttl) {
+        entry_clear(e);
+        return NULL;
+    }
+    return e;
+}
+
+//
+// Remember token found in external store. Returns NULL if it cannot
+// be cached.
+//
+ac_l1_entry *
+ac_l1cache_put(ac_l1cache *l1, ac_slice token, time_t now,
+               time_t issued, const unsigned char *realm,
+               ac_slice authinfo) {
+    ac_l1_entry *e;
+    char *ai;
+
+    if (! l1 || token.len == 0 || token.len > TOKEN_LEN) return NULL;
+
+    if ((ai = malloc(authinfo.len + 1)) == NULL) return NULL;
+    memcpy(ai, authinfo.ptr, authinfo.len);
+    ai[authinfo.len] = '\0';
+
+    e = &l1->slot[hash(token) & (AC_L1_SLOTS - 1)];
+    entry_clear(e);
+    memcpy(e->token, token.ptr, token.len);
+    e->gen          = l1->gen;
+    e->fetched      = now;
+    e->issued       = issued;
+    memcpy(e->realm, realm, AC_REALM_LEN);
+    e->authinfo     = ai;
+    e->authinfo_len = authinfo.len;
+    return e;
+}
+
+//
+// Drop all entries, e.g. when some users have been revoked.
+//
+void
+ac_l1cache_invalidate(ac_l1cache *l1) {
+    if (l1) l1->gen++;
+}
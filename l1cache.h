@@ -0,0 +1,41 @@
+#ifndef _AUTH_COOKIE_L1CACHE_H_
+#define _AUTH_COOKIE_L1CACHE_H_
+
+#include <stddef.h>
+#include <time.h>
+
+#include "authcore.h"
+#include "store.h"
+
+#define AC_L1_SLOTS 1024 // must be power of 2
+
+// token found in external store, along with things built for it
+typedef struct {
+    char         token[TOKEN_LEN + 1]; // empty if slot is free
+    unsigned char realm[AC_REALM_LEN]; // tenant it was minted for
+    unsigned int gen;     // generation of cache it was filled in
+    time_t       fetched; // when it was filled from external store
+    time_t       issued;
+    char        *authinfo;
+    size_t       authinfo_len;
+    ac_session_cache cache;
+} ac_l1_entry;
+
+// per-process cache in front of external token store, with fixed size
+typedef struct {
+    unsigned int gen; // bumped to drop all entries at once
+    int          ttl; // seconds to trust an entry for
+    ac_l1_entry  slot[AC_L1_SLOTS];
+} ac_l1cache;
+
+ac_l1cache *ac_l1cache_init(int ttl);
+void ac_l1cache_free(ac_l1cache *l1);
+
+ac_l1_entry *ac_l1cache_get(ac_l1cache *l1, ac_slice token,
+                            const unsigned char *realm, time_t now);
+ac_l1_entry *ac_l1cache_put(ac_l1cache *l1, ac_slice token, time_t now,
+                            time_t issued, const unsigned char *realm,
+                            ac_slice authinfo);
+void ac_l1cache_invalidate(ac_l1cache *l1);
+
+#endif
@@ -0,0 +1,77 @@
+//
+// Redirect loop breaker.
+//
+// Client that keeps coming back with a cookie we reject (lost token
+// store, broken clock or cookie handling) bounces between us and the
+// login page forever. Such redirects are counted per client address
+// in a fixed table, indexed by hash of the address. Slot is simply
+// taken over by another address on collision, which at worst lets a
+// looping client through a few more times - nothing is allocated per
+// client, and no client can grow the table.
+//
+// Redirects without a cookie (first visit) are not counted, and the
+// count is dropped once the address gets a session through, so users
+// sharing a NAT address do not add up to a loop by logging in.
+//
+
+#include <stdlib.h>
+
+#include "loopguard.h"
+
+static uint32_t
+hash(ac_slice s) {
+    uint32_t h = 2166136261u; // FNV-1a
+    size_t i;
+
+    for (i = 0; i < s.len; i++) {
+        h ^= (unsigned char)s.ptr[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+ac_loopguard *
+ac_loopguard_init(unsigned int limit, int window) {
+    ac_loopguard *lg = calloc(1, sizeof(*lg));
+
+    if (! lg) return NULL;
+    lg->limit  = limit;
+    lg->window = window;
+    return lg;
+}
+
+void
+ac_loopguard_free(ac_loopguard *lg) {
+    free(lg);
+}
+
+//
+// Count a redirect to given client. Returns 1 if it has been
+// redirected too many times in current window, or 0 otherwise.
+//
+int
+ac_loopguard_hit(ac_loopguard *lg, ac_slice addr, time_t now) {
+    uint32_t h = hash(addr);
+    ac_loopguard_slot *s = &lg->slot[h & (AC_LOOPGUARD_SLOTS - 1)];
+
+    if (s->key != h || now - s->start >= lg->window) {
+        s->key   = h;
+        s->count = 0;
+        s->start = now;
+    }
+    if (s->count >= lg->limit) return 1;
+
+    s->count++;
+    return 0;
+}
+
+//
+// Forget redirects to given client, as it has got a valid session.
+//
+void
+ac_loopguard_reset(ac_loopguard *lg, ac_slice addr) {
+    uint32_t h = hash(addr);
+    ac_loopguard_slot *s = &lg->slot[h & (AC_LOOPGUARD_SLOTS - 1)];
+
+    if (s->key == h) s->count = 0;
+}
@@ -0,0 +1,31 @@
+#ifndef _AUTH_COOKIE_LOOPGUARD_H_
+#define _AUTH_COOKIE_LOOPGUARD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "authcore.h"
+
+#define AC_LOOPGUARD_SLOTS 4096 // must be power of 2
+
+// redirects sent to a client address in current window
+typedef struct {
+    uint32_t key;   // hash of the address, to tell it from others
+    uint32_t count;
+    time_t   start; // start of current window
+} ac_loopguard_slot;
+
+// redirect counter per client address, with fixed size
+typedef struct {
+    unsigned int limit;  // max redirects per window
+    int          window; // in seconds
+    ac_loopguard_slot slot[AC_LOOPGUARD_SLOTS];
+} ac_loopguard;
+
+ac_loopguard *ac_loopguard_init(unsigned int limit, int window);
+void ac_loopguard_free(ac_loopguard *lg);
+int ac_loopguard_hit(ac_loopguard *lg, ac_slice addr, time_t now);
+void ac_loopguard_reset(ac_loopguard *lg, ac_slice addr);
+
+#endif
@@ -14,14 +14,35 @@
 // ticket for authenticated access.
 //
 
-#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "plugin.h"
 #include "log.h"
 #include "response.h"
-#include "md5.h"
-
+#include "status_counter.h"
+
+#include "authcore.h"
+#include "store.h"
+#include "tcache.h"
+#include "cdb.h"
+#include "ptrie.h"
+#include "revoke.h"
+#include "audit.h"
+#include "ustats.h"
+#include "loopguard.h"
+#include "l1cache.h"
+#include "pubtkt.h"
+#include "tkt.h"
+#include "jwt.h"
 #include "base64.h"
+#include "gossip.h"
+#include "vpool.h"
+#include "tokend.h"
+#include "joblist.h"
+#include "md5.h"
 
 #define LOG(level, ...)                                           \
     if (pc->loglevel >= level) {                                  \
@@ -37,7 +58,26 @@
 #define HEADER(con, key)                                                \
     (data_string *)array_get_element((con)->request.headers, (key))
 
-#define MD5_LEN 16
+#define BUF_SLICE(b) AC_SLICE((b)->ptr, (b)->used ? (b)->used - 1 : 0)
+
+#define EXPIRE_INTERVAL 10 // interval to sweep expired tokens
+#define TICKET_CACHE_MAX 1000000 // max number of verified tickets to cache
+#define GROUP_MAX 64 // max number of groups in require-group rules
+#define USER_STATS_MAX 100000 // max number of users to count requests of
+#define USER_STATS_INTERVAL 60 // interval to publish per-user counters
+#define REDIRECT_WINDOW 60 // window to count redirects to a client in
+#define RECENT_TTL 5 // seconds to trust token cached from authtokend
+
+// page sent instead of redirect once a client is caught in a loop
+#define LOOP_PAGE                                                       \
+    "<!DOCTYPE html>\n"                                                 \
+    "<html><head><title>429 Too Many Requests</title></head>\n"         \
+    "<body><h1>Too Many Requests</h1>\n"                                \
+    "<p>You have been sent to the login page too many times in a "      \
+    "short while. This usually means the login cookie your browser "    \
+    "sends is no longer accepted: please delete cookies of this site, " \
+    "check that your clock is right, and try again in a minute.</p>"    \
+    "</body></html>\n"
 
 /**********************************************************************
  * data strutures
@@ -52,6 +92,63 @@ typedef struct {
     buffer *key;     // key for cookie verification
     int timeout;     // life duration of last-stage auth token
     buffer *options; // options for last-stage auth token cookie
+    buffer *pubtkt_key;    // public key file for mod_auth_pubtkt ticket
+    buffer *pubtkt_digest; // digest used to sign the ticket
+
+#ifdef USE_OPENSSL
+    EVP_PKEY     *pubtkt_pkey;
+    const EVP_MD *pubtkt_md;
+#endif
+
+    buffer *jwt_secret; // shared secret for HS256 JWT
+    buffer *jwt_key;    // public key file for RS256/EdDSA JWT
+
+#ifdef USE_OPENSSL
+    EVP_PKEY *jwt_pkey;
+#endif
+
+    buffer *tkt_secret;           // shared secret for mod_auth_tkt ticket
+    buffer *tkt_digest;           // digest type of the ticket
+    int     tkt_type;             // ...as AC_TKT_* value
+    unsigned short tkt_ignore_ip; // do not bind ticket to client address
+
+    // server-wide settings for token replication
+    buffer *gossip_listen; // address to receive replicated tokens
+    array  *gossip_peers;  // addresses of other nodes
+    buffer *gossip_key;    // key for datagram verification
+
+    buffer *tokend;        // socket path of external token store
+    int verify_threads;    // threads to verify signatures, or 0
+
+    buffer *assertion_header; // header to pass signed identity assertion
+    buffer *assertion_key;    // key to sign identity assertion
+
+    buffer *directory;         // CDB file of user attributes
+    array  *directory_headers; // attribute to request header mapping
+    array  *require_group;     // groups allowed to access, any of them
+    uint64_t require_groups;   // ...compiled into bitset of group IDs
+
+    array    *exclude;      // paths not to protect
+    ac_ptrie *exclude_trie; // ...compiled into trie
+
+    array       *schemes;      // cookie schemes to accept
+    unsigned int scheme_mask;  // ...as bitset of index in schemes[]
+
+    buffer *revoked_users; // file of users whose sessions are revoked
+    buffer *service_tokens; // CDB file of pre-provisioned tokens
+    buffer *tenants;        // CDB file of realms by virtual host
+
+    buffer   *audit_log;      // file to record auth events in
+    int       audit_log_size; // size (in MB) to rotate the file at, or 0
+    ac_audit *audit;          // ...opened in global context
+
+    buffer *user_stats; // file to dump per-user counters to
+
+    int           redirect_limit; // max redirects to a client per window
+    ac_loopguard *loops;          // ...counted in global context
+    int           loop_mode;      // con->mode to send LOOP_PAGE as
+
+    unsigned char realm[AC_REALM_LEN]; // tenant of the request, or zeros
 } plugin_config;
 
 // top-level module structure
@@ -61,9 +158,95 @@ typedef struct {
     plugin_config **config;
     plugin_config   conf;
 
-    array *users;
+    token_store *users;
+    gossip      *gossip;
+    tokend      *tokend;
+    ac_l1cache  *recent;  // tokens recently found in authtokend
+    buffer      *early_name; // cookie to look up early, if only one name
+    tcache      *tickets; // verified public-key tickets
+    vpool       *verifier; // threads to verify signatures
+    struct verify_job *jobs; // signatures being verified
+    ac_cdb       dir;      // user attributes, reloaded when replaced
+    int          dir_failed; // last reload has failed
+    ac_cdb       services;   // service tokens, reloaded when replaced
+    int          services_failed; // last reload has failed
+    ac_cdb       tenants;    // realms by virtual host, ditto
+    int          tenants_failed; // last reload has failed
+    buffer      *tenant_name;    // realm of current request's tenant
+    buffer      *tenant_key;
+    buffer      *tenant_authurl;
+    char        *groups[GROUP_MAX]; // group names, indexed by group ID
+    int          ngroups;
+    ac_revoked  *revoked;  // revoked users, replaced on reload
+    int          revoked_failed; // last reload has failed
+    unsigned char first[256];   // scheme (+1) by first byte of prefix
+    unsigned char next[32];     // other scheme (+1) with same first byte
+    unsigned char fallback;     // scheme (+1) without prefix
+    ac_ustats   *ustats;     // per-user counters, if enabled
+    time_t       last_stats; // last time per-user counters were published
+    int          max_timeout; // longest timeout among all contexts
+    time_t       last_expire; // last time expired tokens were swept
 } plugin_data;
 
+// per-connection state while waiting for authtokend or verifier
+typedef struct handler_ctx {
+    connection *con;
+    int     done;     // reply has arrived
+    int     found;
+    time_t  issued;
+    unsigned char realm[AC_REALM_LEN];
+    buffer *authinfo;
+    int     early;    // looked up before context was known...
+    char    token[TOKEN_LEN + 1]; // ...for this token
+
+    struct handler_ctx *next; // other connections waiting for same job
+    struct verify_job  *job;  // signature being verified
+} handler_ctx;
+
+// signature verification in thread pool, shared by all connections
+// presenting the same ticket
+typedef struct verify_job {
+    struct verify_job *next;
+    plugin_data  *pd;
+    unsigned char hash[AC_MD5_LEN];
+    int           kind;    // VERIFY_PUBTKT or VERIFY_JWT
+    char         *ticket;
+    size_t        ticket_len;
+    ac_slice      secret;  // for HS256 JWT
+#ifdef USE_OPENSSL
+    EVP_PKEY     *pkey;
+    const EVP_MD *md;
+#endif
+    int           result;  // AC_OK or error, set in worker thread
+    handler_ctx  *waiters;
+} verify_job;
+
+#define VERIFY_PUBTKT 1
+#define VERIFY_JWT    2
+
+// verifier of a cookie scheme, given cookie value without the prefix,
+// and (for CACHE_TICKET scheme) hash identifying the ticket
+typedef handler_t (*scheme_verify)(server *srv, connection *con,
+                                   plugin_data *pd, plugin_config *pc,
+                                   const char *line, size_t len,
+                                   const unsigned char *hash);
+
+// cookie scheme, recognized by leading bytes of cookie value
+typedef struct {
+    const char   *name;   // as in auth-cookie.schemes
+    const char   *prefix; // leading bytes, or NULL to try if none matched
+    size_t        skip;   // bytes to drop before passing to verifier
+    int           cache;  // CACHE_* policy
+    scheme_verify verify;
+} scheme;
+
+#define CACHE_NONE   0 // verified every time, as it is cheap enough
+#define CACHE_ONCE   1 // used only once, to mint a token
+#define CACHE_TOKEN  2 // verifier looks it up in token store
+#define CACHE_TICKET 3 // verified once, then found in ticket cache
+
+#define VERIFY_PENDING 1 // result of check_signature(), besides AC_*
+
 /**********************************************************************
  * supporting functions
  **********************************************************************/
@@ -88,6 +271,28 @@ merge_config(server *srv, connection *con, plugin_data *pd) {
     PATCH(key);
     PATCH(timeout);
     PATCH(options);
+    PATCH(pubtkt_key);
+#ifdef USE_OPENSSL
+    PATCH(pubtkt_pkey);
+    PATCH(pubtkt_md);
+#endif
+    PATCH(jwt_secret);
+    PATCH(jwt_key);
+#ifdef USE_OPENSSL
+    PATCH(jwt_pkey);
+#endif
+    PATCH(tkt_secret);
+    PATCH(tkt_type);
+    PATCH(tkt_ignore_ip);
+    PATCH(assertion_header);
+    PATCH(assertion_key);
+    PATCH(directory_headers);
+    PATCH(require_groups);
+    PATCH(exclude_trie);
+    PATCH(scheme_mask);
+    PATCH(audit);
+    PATCH(loops);
+    PATCH(loop_mode);
 
     // merge config from sub-contexts
     for (i = 1; i < srv->config_context->used; i++) {
@@ -109,6 +314,30 @@ merge_config(server *srv, connection *con, plugin_data *pd) {
             MERGE("auth-cookie.key", key);
             MERGE("auth-cookie.timeout", timeout);
             MERGE("auth-cookie.options", options);
+            // digest is loaded along with the key in the same context
+            MATCH("auth-cookie.pubtkt-key") {
+                PATCH(pubtkt_key);
+#ifdef USE_OPENSSL
+                PATCH(pubtkt_pkey);
+                PATCH(pubtkt_md);
+#endif
+            }
+            MERGE("auth-cookie.jwt-secret", jwt_secret);
+            MATCH("auth-cookie.jwt-key") {
+                PATCH(jwt_key);
+#ifdef USE_OPENSSL
+                PATCH(jwt_pkey);
+#endif
+            }
+            MERGE("auth-cookie.tkt-secret", tkt_secret);
+            MERGE("auth-cookie.tkt-digest", tkt_type);
+            MERGE("auth-cookie.tkt-ignore-ip", tkt_ignore_ip);
+            MERGE("auth-cookie.assertion-header", assertion_header);
+            MERGE("auth-cookie.assertion-key", assertion_key);
+            MERGE("auth-cookie.directory-headers", directory_headers);
+            MERGE("auth-cookie.require-group", require_groups);
+            MERGE("auth-cookie.exclude", exclude_trie);
+            MERGE("auth-cookie.schemes", scheme_mask);
         }
     }
     return &(pd->conf);
@@ -129,17 +358,121 @@ self_url(connection *con, buffer *url, buffer_encoding_t enc) {
     return url;
 }
 
+//
+// Find counters of the user of given session, if accounting is enabled.
+// Once found, it is kept in given cache (if any) for the session.
+//
+static ac_user_stats *
+user_stats(plugin_data *pd, ac_session_cache *cache,
+           const char *authinfo, size_t authinfo_len) {
+    char user[AC_USER_MAX];
+    ac_user_stats *st;
+    size_t len;
+
+    if (! pd->ustats) return NULL;
+    if (cache && cache->stats) return cache->stats;
+
+    if (ac_authinfo_user(AC_SLICE(authinfo, authinfo_len),
+                         user, &len) != AC_OK) {
+        return NULL;
+    }
+    st = ac_ustats_get(pd->ustats, AC_SLICE(user, len));
+    if (cache) cache->stats = st;
+    return st;
+}
+
+//
+// Record auth event of the client, if audit log is enabled.
+//
+static void
+audit(server *srv, connection *con, plugin_config *pc,
+      const char *event, ac_slice user, const char *detail) {
+    if (! pc->audit) return;
+
+    ac_audit_log(pc->audit, srv->cur_ts, event, user,
+                 BUF_SLICE(con->dst_addr_buf), AC_STR(detail));
+}
+
+//
+// Record event on a session given by authinfo, of the client (if any).
+//
+static void
+audit_authinfo(ac_audit *a, time_t now, connection *con, const char *event,
+               const char *authinfo, size_t authinfo_len, const char *detail) {
+    char user[AC_USER_MAX];
+    size_t len;
+
+    if (! a) return;
+    if (ac_authinfo_user(AC_SLICE(authinfo, authinfo_len),
+                         user, &len) != AC_OK) {
+        len = 0;
+    }
+    ac_audit_log(a, now, event, AC_SLICE(user, len),
+                 con ? BUF_SLICE(con->dst_addr_buf) : AC_SLICE("", 0),
+                 AC_STR(detail));
+}
+
+//
+// Check if request carries <AuthName> cookie (which is being rejected,
+// when asked by endauth).
+//
+static int
+has_cookie(connection *con, plugin_config *pc) {
+    data_string *ds = HEADER(con, "Cookie");
+    ac_slice cv;
+
+    return ds && ac_cookie_find(BUF_SLICE(ds->value),
+                                BUF_SLICE(pc->name), &cv) == AC_OK;
+}
+
 //
 // Generates appropriate response depending on policy.
 //
 static handler_t
 endauth(server *srv, connection *con, plugin_config *pc) {
-    // pass through if no redirect target is specified
+    // pass through if no redirect target is specified, unless only
+    // members of some group may pass, which anonymous user is not
     if (buffer_is_empty(pc->authurl)) {
+        if (pc->require_groups) {
+            INFO("s", "no session for require-group - denying");
+            audit(srv, con, pc, "deny", AC_SLICE("", 0), "require-group");
+            con->http_status = 403;
+            con->mode = DIRECT;
+            con->file_finished = 1;
+            return HANDLER_FINISHED;
+        }
         DEBUG("s", "endauth - continuing");
         return HANDLER_GO_ON;
     }
+
+    // client keeps coming back with cookie we reject - stop bouncing it
+    if (pc->loops && has_cookie(con, pc) &&
+        ac_loopguard_hit(pc->loops, BUF_SLICE(con->dst_addr_buf),
+                         srv->cur_ts)) {
+        char retry[16];
+
+        INFO("sb", "redirect loop detected:", con->dst_addr_buf);
+        audit(srv, con, pc, "loop", BUF_SLICE(con->authed_user),
+              con->uri.path->ptr);
+
+        // tell why, rather than leave browser with blank page
+        snprintf(retry, sizeof(retry), "%d", REDIRECT_WINDOW);
+        response_header_overwrite(srv, con, CONST_STR_LEN("Content-Type"),
+                                  CONST_STR_LEN("text/html; charset=utf-8"));
+        response_header_overwrite(srv, con, CONST_STR_LEN("Retry-After"),
+                                  retry, strlen(retry));
+        response_header_overwrite(srv, con, CONST_STR_LEN("Cache-Control"),
+                                  CONST_STR_LEN("no-store"));
+        buffer_copy_string_len(chunkqueue_get_append_buffer(con->write_queue),
+                               CONST_STR_LEN(LOOP_PAGE));
+        con->http_status = 429;
+        con->mode = pc->loop_mode;
+        con->file_finished = 1;
+        return HANDLER_FINISHED;
+    }
     DEBUG("sb", "endauth - redirecting:", pc->authurl);
+    audit(srv, con, pc, "redirect", BUF_SLICE(con->authed_user),
+          con->uri.path->ptr);
 
     // prepare redirection header
     buffer *url = buffer_init_buffer(pc->authurl);
@@ -157,154 +490,544 @@ endauth(server *srv, connection *con, plugin_config *pc) {
     return HANDLER_FINISHED;
 }
 
-inline int
-min(int a, int b) {
-    return a > b ? b : a;
-}
-
-// generate hex-encoded random string
-int
-gen_random(buffer *b, int len) {
-    buffer_prepare_append(b, len);
-    while (len--) {
-        char c = int2hex(rand() >> 24);
-        buffer_append_memory(b, &c, 1);
+//
+// update REMOTE_USER field using (verified) authinfo.
+//
+static void
+set_user(server *srv, connection *con, plugin_config *pc,
+         const char *authinfo, size_t authinfo_len) {
+    char user[AC_USER_MAX];
+    size_t len;
+
+    if (ac_authinfo_user(AC_SLICE(authinfo, authinfo_len),
+                         user, &len) != AC_OK) {
+        WARN("s", "cannot find username in authinfo");
+        return;
     }
-    return 0;
+    DEBUG("ss", "identified user:", user);
+    buffer_copy_string_len(con->authed_user, user, len);
 }
 
-// encode bytes into hexstring
-int
-hex_encode(buffer *b, const uint8_t *s, int len) {
-    return buffer_copy_string_hex(b, (const char *)s, len);
-}
+//
+// Pass signed identity assertion to backends, if configured.
+// Once built, it is kept in given cache (if any) for the session,
+// so it is signed only once.
+//
+static void
+add_assertion(server *srv, connection *con, plugin_config *pc,
+              const char *authinfo, size_t authinfo_len,
+              time_t expires, ac_slice session, ac_session_cache *cache) {
+#ifdef USE_OPENSSL
+    char buf[AC_ASSERTION_MAX], user[AC_USER_MAX];
+    unsigned char sid[AC_MD5_LEN];
+    const char *assertion = buf;
+    size_t len, user_len;
+    MD5_CTX ctx;
 
-// decode hexstring into bytes
-int
-hex_decode(buffer *b, const char *s) {
-    char c0, c1;
-        
-    buffer_prepare_append(b, strlen(s) >> 1);
-    while ((c0 = *s++) && (c1 = *s++)) {
-        char v = (hex2int(c0) << 4) | hex2int(c1);
-        buffer_append_memory(b, &v, 1);
+    if (buffer_is_empty(pc->assertion_header)) return;
+    if (buffer_is_empty(pc->assertion_key)) {
+        WARN("s", "auth-cookie.assertion-key is not set");
+        return;
     }
-    return 0;
+
+    if (cache && cache->assertion &&
+        cache->assertion_key == pc->assertion_key) {
+        assertion = cache->assertion;
+        len = cache->assertion_len;
+    } else {
+        // session ID must not reveal the session credential itself
+        MD5_Init(&ctx);
+        MD5_Update(&ctx, session.ptr, session.len);
+        MD5_Final(sid, &ctx);
+
+        if (ac_authinfo_user(AC_SLICE(authinfo, authinfo_len),
+                             user, &user_len) != AC_OK ||
+            ac_assertion_make(BUF_SLICE(pc->assertion_key),
+                              AC_SLICE(user, user_len),
+                              expires, sid, buf, &len) != AC_OK) {
+            WARN("s", "cannot build identity assertion");
+            return;
+        }
+        DEBUG("ss", "signed identity assertion:", buf);
+
+        char *copy = cache ? malloc(len) : NULL;
+        if (copy) {
+            memcpy(copy, buf, len);
+            free(cache->assertion);
+            cache->assertion     = copy;
+            cache->assertion_len = len;
+            cache->assertion_key = pc->assertion_key;
+        }
+    }
+    array_set_key_value(con->request.headers,
+                        CONST_BUF_LEN(pc->assertion_header), assertion, len);
+#else
+    UNUSED(srv);
+    UNUSED(con);
+    UNUSED(pc);
+    UNUSED(authinfo);
+    UNUSED(authinfo_len);
+    UNUSED(expires);
+    UNUSED(session);
+    UNUSED(cache);
+#endif
 }
 
-// XOR-based decryption
-int
-encrypt(buffer *buf, uint8_t *key, int keylen) {
-    unsigned int i;
+//
+// Turn "groups" attribute of user record (comma-separated group names)
+// into bitset of group IDs. Groups not used in any rule are ignored.
+//
+static uint64_t
+user_groups(plugin_data *pd, ac_slice rec) {
+    const char *p, *end, *next;
+    uint64_t groups = 0;
+    ac_slice val;
+    int i;
+
+    if (ac_cdb_attr(rec, AC_STR("groups"), &val) != AC_OK) return 0;
+
+    for (p = val.ptr, end = val.ptr + val.len; p < end; p = next + 1) {
+        const char *e;
+
+        if ((next = memchr(p, ',', end - p)) == NULL) next = end;
+        for (e = next; e > p && e[-1] == ' '; e--);
+        while (p < e && *p == ' ') p++;
 
-    for (i = 0; i < buf->used; i++) {
-        buf->ptr[i] ^= (i > 0 ? buf->ptr[i - 1] : 0) ^ key[i % keylen];
+        for (i = 0; i < pd->ngroups; i++) {
+            if (strlen(pd->groups[i]) == (size_t)(e - p) &&
+                memcmp(pd->groups[i], p, e - p) == 0) {
+                groups |= (uint64_t)1 << i;
+                break;
+            }
+        }
     }
-    return 0;
+    return groups;
 }
 
-// XOR-based encryption
-int
-decrypt(buffer *buf, uint8_t *key, int keylen) {
-    int i;
+//
+// Look up authenticated user in directory, pass attributes found as
+// request headers, and check group membership. Record found (or not)
+// is kept in given cache (if any) until directory is replaced, so the
+// lookup is done only once per session and each request only costs
+// a bitwise AND.
+//
+static handler_t
+apply_directory(server *srv, connection *con, plugin_data *pd,
+                plugin_config *pc, ac_session_cache *cache) {
+    ac_session_cache tmp;
+    ac_slice val;
+    size_t i;
 
-    for (i = buf->used - 1; i >= 0; i--) {
-        buf->ptr[i] ^= (i > 0 ? buf->ptr[i - 1] : 0) ^ key[i % keylen];
+    if (! cache) {
+        memset(&tmp, 0, sizeof(tmp));
+        cache = &tmp;
+    }
+    if (cache->attrs_gen != pd->dir.gen) {
+        cache->attrs_gen = pd->dir.gen;
+        if (ac_cdb_find(&pd->dir, BUF_SLICE(con->authed_user),
+                        &cache->attrs) != AC_OK) {
+            DEBUG("sb", "user not found in directory:", con->authed_user);
+            cache->attrs = AC_SLICE(NULL, 0);
+        }
+        cache->groups = user_groups(pd, cache->attrs);
+    }
 
-        // sanity check - result should be base64-encoded authinfo
-        if (! isprint(buf->ptr[i])) {
-            return -1;
+    for (i = 0; i < pc->directory_headers->used; i++) {
+        data_string *ds = (data_string *)pc->directory_headers->data[i];
+
+        if (ac_cdb_attr(cache->attrs, BUF_SLICE(ds->key), &val) == AC_OK) {
+            array_set_key_value(con->request.headers, CONST_BUF_LEN(ds->value),
+                                val.ptr, val.len);
         }
     }
-    return 0;
+
+    if (pc->require_groups && ! (cache->groups & pc->require_groups)) {
+        INFO("sb", "user not in required group:", con->authed_user);
+        audit(srv, con, pc, "deny", BUF_SLICE(con->authed_user),
+              "require-group");
+        con->http_status = 403;
+        con->mode = DIRECT;
+        con->file_finished = 1;
+        return HANDLER_FINISHED;
+    }
+    return HANDLER_GO_ON;
 }
 
 //
-// update header using (verified) authentication info.
+// Check if authinfo belongs to revoked user.
+//
+static int
+authinfo_revoked(plugin_data *pd, const char *authinfo, size_t authinfo_len) {
+    char user[AC_USER_MAX];
+    size_t len;
+
+    if (! pd->revoked) return 0;
+    if (ac_authinfo_user(AC_SLICE(authinfo, authinfo_len),
+                         user, &len) != AC_OK) {
+        return 0;
+    }
+    return ac_revoked_has(pd->revoked, AC_SLICE(user, len));
+}
+
 //
-void
-update_header(server *srv, connection *con,
-              plugin_data *pd, plugin_config *pc, buffer *authinfo) {
-    buffer *field, *token;
+// Keep token authtokend never took (connection lost before it said
+// so) in local store, so the cookie just issued for it still works.
+//
+static void
+put_lost(server *srv, void *ctx, const char *token, size_t len,
+         time_t issued, const unsigned char *realm,
+         const char *authinfo, size_t authinfo_len) {
+    plugin_data *pd = ctx;
+
+    log_error_write(srv, __FILE__, __LINE__, "s",
+                    "token store daemon lost token - keeping it locally");
+    token_store_put(pd->users, token, len, issued, realm,
+                    authinfo, authinfo_len);
+}
 
-    //DEBUG("sb", "decrypted authinfo:", authinfo);
+//
+// update header using (verified) authentication info.
+//
+static handler_t
+update_header(server *srv, connection *con, plugin_data *pd,
+              plugin_config *pc, const char *authinfo, size_t authinfo_len) {
+    buffer *field;
+    char token[TOKEN_LEN + 1];
+    ac_user_stats *st;
+
+    // generate random token (to relate with authinfo below)
+    if (ac_token_gen(token, TOKEN_LEN) != 0) {
+        log_error_write(srv, __FILE__, __LINE__, "s",
+                        "cannot read /dev/urandom, no token issued");
+        con->http_status = 500;
+        con->mode = DIRECT;
+        con->file_finished = 1;
+        return HANDLER_FINISHED;
+    }
 
     // insert auth header
     field = buffer_init_string("Basic ");
-    buffer_append_string_buffer(field, authinfo);
+    buffer_append_string_len(field, authinfo, authinfo_len);
     array_set_key_value(con->request.headers,
                         CONST_STR_LEN("Authorization"), CONST_BUF_LEN(field));
 
-    // generate random token and relate it with authinfo
-    gen_random(token = buffer_init(), MD5_LEN * 2); // length in hex string
-    DEBUG("sb", "pairing authinfo with token:", token);
-    buffer_copy_long(field, time(NULL));
-    buffer_append_string(field, ":");
-    buffer_append_string_buffer(field, authinfo);
-    array_set_key_value(pd->users, CONST_BUF_LEN(token), CONST_BUF_LEN(field));
+    DEBUG("ss", "pairing authinfo with token:", token);
+
+    // keep it locally only when external store is not available
+    time_t now = time(NULL);
+    token_entry *te = NULL;
+    ac_l1_entry *le = NULL;
+    if (! pd->tokend ||
+        tokend_put(srv, pd->tokend, token, TOKEN_LEN,
+                   now, pc->realm, authinfo, authinfo_len) != 0) {
+        te = token_store_put(pd->users, token, TOKEN_LEN,
+                             now, pc->realm, authinfo, authinfo_len);
+    } else {
+        le = ac_l1cache_put(pd->recent, AC_SLICE(token, TOKEN_LEN), now,
+                            now, pc->realm, AC_SLICE(authinfo, authinfo_len));
+    }
+    ac_session_cache *cache = te ? &te->cache : le ? &le->cache : NULL;
+    add_assertion(srv, con, pc, authinfo, authinfo_len, now + pc->timeout,
+                  AC_SLICE(token, TOKEN_LEN), cache);
+    gossip_mint(srv, pd->gossip, token, TOKEN_LEN,
+                now, pc->realm, authinfo, authinfo_len);
 
     // insert opaque auth token
     buffer_copy_string_buffer(field, pc->name);
     buffer_append_string(field, "=token:");
-    buffer_append_string_buffer(field, token);
+    buffer_append_string(field, token);
     buffer_append_string(field, "; ");
     buffer_append_string_buffer(field, pc->options);
     DEBUG("sb", "generating token cookie:", field);
     response_header_append(srv, con,
                            CONST_STR_LEN("Set-Cookie"), CONST_BUF_LEN(field));
-
-    // update REMOTE_USER field
-    base64_decode(field, authinfo->ptr);
-    char *pw = strchr(field->ptr, ':'); *pw = '\0';
-    DEBUG("ss", "identified username:", field->ptr);
-    buffer_copy_string_len(con->authed_user, field->ptr, strlen(field->ptr));
-    
     buffer_free(field);
-    buffer_free(token);
+
+    set_user(srv, con, pc, authinfo, authinfo_len);
+    audit(srv, con, pc, "login", BUF_SLICE(con->authed_user), "crypt");
+    audit(srv, con, pc, "mint", BUF_SLICE(con->authed_user), "token");
+    if ((st = user_stats(pd, cache, authinfo, authinfo_len)) != NULL) {
+        st->requests++;
+        st->mints++;
+        st->last_seen = srv->cur_ts;
+    }
+    if (pc->loops) {
+        ac_loopguard_reset(pc->loops, BUF_SLICE(con->dst_addr_buf));
+    }
+    return apply_directory(srv, con, pd, pc, cache);
+}
+
+static handler_ctx *
+handler_ctx_init(connection *con) {
+    handler_ctx *hctx = calloc(1, sizeof(*hctx));
+
+    hctx->con      = con;
+    hctx->authinfo = buffer_init();
+    return hctx;
+}
+
+static void
+handler_ctx_free(handler_ctx *hctx) {
+    buffer_free(hctx->authinfo);
+    free(hctx);
 }
 
 //
-// Handle token given in cookie.
+// Drop early lookup, as this context wants something else.
+//
+static void
+drop_early(plugin_data *pd, connection *con) {
+    handler_ctx *hctx = con->plugin_ctx[pd->id];
+
+    if (! hctx || ! hctx->early) return;
+
+    tokend_cancel(pd->tokend, hctx);
+    handler_ctx_free(hctx);
+    con->plugin_ctx[pd->id] = NULL;
+}
+
+//
+// called by tokend client once lookup result is available.
+//
+static void
+lookup_done(server *srv, void *ctx, int found, time_t issued,
+            const unsigned char *realm,
+            const char *authinfo, size_t authinfo_len) {
+    handler_ctx *hctx = ctx;
+
+    hctx->done   = 1;
+    hctx->found  = found;
+    hctx->issued = issued;
+    if (found) {
+        memcpy(hctx->realm, realm, AC_REALM_LEN);
+        buffer_copy_string_len(hctx->authinfo, authinfo, authinfo_len);
+    }
+
+    // wake up connection waiting for this result
+    joblist_append(srv, hctx->con);
+}
+
+//
+// Inject verified authinfo as BasicAuth header, along with assertion
+// and directory attributes
+// for the session identified by given (secret) session credential.
 //
-// Expected Cookie Format:
-//   <name>=token:<random-token-to-be-verified>
-// 
 static handler_t
-handle_token(server *srv, connection *con,
-             plugin_data *pd, plugin_config *pc, char *token) {
-    data_string *entry =
-        (data_string *)array_get_element(pd->users, token);
+accept_authinfo(server *srv, connection *con,
+                plugin_data *pd, plugin_config *pc,
+                const char *authinfo, size_t authinfo_len,
+                time_t expires, ac_slice session, ac_session_cache *cache) {
+    char field[sizeof("Basic ") - 1 + AC_AUTHINFO_MAX];
+    ac_user_stats *st;
+
+    if (authinfo_len > AC_AUTHINFO_MAX) {
+        WARN("s", "authinfo too long");
+        return endauth(srv, con, pc);
+    }
+    st = user_stats(pd, cache, authinfo, authinfo_len);
+    set_user(srv, con, pc, authinfo, authinfo_len);
+    if (ac_revoked_has(pd->revoked, BUF_SLICE(con->authed_user))) {
+        INFO("sb", "session of revoked user:", con->authed_user);
+        audit(srv, con, pc, "reject", BUF_SLICE(con->authed_user), "revoked");
+        buffer_reset(con->authed_user);
+        if (st) st->redirects++;
+        return endauth(srv, con, pc);
+    }
+    if (st) {
+        st->requests++;
+        st->last_seen = srv->cur_ts;
+    }
+
+    memcpy(field, "Basic ", sizeof("Basic ") - 1);
+    memcpy(field + sizeof("Basic ") - 1, authinfo, authinfo_len);
+    array_set_key_value(con->request.headers, CONST_STR_LEN("Authorization"),
+                        field, sizeof("Basic ") - 1 + authinfo_len);
+
+    add_assertion(srv, con, pc, authinfo, authinfo_len,
+                  expires, session, cache);
+
+    // session got through, so earlier redirects were no loop
+    if (pc->loops) {
+        ac_loopguard_reset(pc->loops, BUF_SLICE(con->dst_addr_buf));
+    }
 
-    // Check for existence
-    if (! entry) return endauth(srv, con, pc);
+    DEBUG("s", "all check passed");
+    return apply_directory(srv, con, pd, pc, cache);
+}
 
-    DEBUG("sb", "found token entry:", entry->value);
+//
+// Accept token paired with given authinfo, unless it has expired.
+//
+static handler_t
+accept_token(server *srv, connection *con,
+             plugin_data *pd, plugin_config *pc,
+             const char *token, time_t issued,
+             const char *authinfo, size_t authinfo_len, ac_session_cache *cache) {
+    DEBUG("ss", "found token entry:", authinfo);
 
     // Check for timeout
     time_t t0 = time(NULL);
-    time_t t1 = strtol(entry->value->ptr, NULL, 10);
+    time_t t1 = issued;
     DEBUG("sdsdsd", "t0:", t0, ", t1:", t1, ", timeout:", pc->timeout);
-    if (t0 - t1 > pc->timeout) return endauth(srv, con, pc);
-
-    // Check for existence of actual authinfo
-    char *authinfo = strchr(entry->value->ptr, ':');
-    if (! authinfo) return endauth(srv, con, pc);
+    if (t0 - t1 > pc->timeout) {
+        ac_user_stats *st = user_stats(pd, cache, authinfo, authinfo_len);
+        if (st) st->redirects++;
+        return endauth(srv, con, pc);
+    }
 
     // All passed. Inject as BasicAuth header
-    buffer *field = buffer_init_string("Basic ");
-    buffer_append_string(field, authinfo + 1);
-    array_set_key_value(con->request.headers,
-                        CONST_STR_LEN("Authorization"), CONST_BUF_LEN(field));
+    return accept_authinfo(srv, con, pd, pc, authinfo, authinfo_len,
+                           issued + pc->timeout, AC_STR(token), cache);
+}
 
-    // update REMOTE_USER field
-    base64_decode(field, authinfo + 1);
-    char *pw = strchr(field->ptr, ':'); *pw = '\0';
-    DEBUG("ss", "identified user:", field->ptr);
-    buffer_copy_string_len(con->authed_user, field->ptr, strlen(field->ptr));
-    buffer_free(field);
+//
+// Ask authtokend for the token, and wait until it answers.
+// This is called again once the answer has arrived.
+//
+static handler_t
+lookup_token(server *srv, connection *con,
+             plugin_data *pd, plugin_config *pc, const char *token) {
+    handler_ctx *hctx = con->plugin_ctx[pd->id];
+    ac_l1_entry *le = NULL;
+    handler_t rc;
+
+    if (hctx && hctx->early && strcmp(hctx->token, token) != 0) {
+        drop_early(pd, con);
+        hctx = NULL;
+    }
+    if (hctx) {
+        if (! hctx->done) return HANDLER_WAIT_FOR_EVENT;
 
-    DEBUG("s", "all check passed");
-    return HANDLER_GO_ON;
+        // token minted for another tenant is no good here
+        if (hctx->found && ! ac_realm_equal(hctx->realm, pc->realm)) {
+            DEBUG("s", "token belongs to another realm");
+            hctx->found = 0;
+        }
+
+        // remember it, so next request of this session stays here
+        if (hctx->found) {
+            le = ac_l1cache_put(pd->recent, AC_STR(token), srv->cur_ts,
+                                hctx->issued, hctx->realm,
+                                BUF_SLICE(hctx->authinfo));
+        }
+        con->plugin_ctx[pd->id] = NULL;
+        rc = hctx->found
+            ? accept_token(srv, con, pd, pc, token, hctx->issued,
+                           CONST_BUF_LEN(hctx->authinfo),
+                           le ? &le->cache : NULL)
+            : endauth(srv, con, pc);
+        handler_ctx_free(hctx);
+        return rc;
+    }
+
+    hctx = handler_ctx_init(con);
+    if (tokend_get(srv, pd->tokend, token, strlen(token),
+                   lookup_done, hctx) != 0) {
+        WARN("s", "token store daemon not available");
+        handler_ctx_free(hctx);
+        return endauth(srv, con, pc);
+    }
+    DEBUG("ss", "asking token store daemon for:", token);
+    con->plugin_ctx[pd->id] = hctx;
+    return HANDLER_WAIT_FOR_EVENT;
+}
+
+//
+// Accept pre-provisioned service token, found in service token table
+// with a record of "name=value" lines:
+//
+//   user=<user>
+//   expires=<time>  (optional)
+//   realm=<realm name>  (required with tenant table)
+//
+// Token is only taken in its realm, named as in tenant table.
+// Nothing is kept per token, so assertion (if any) is signed each time.
+//
+static handler_t
+accept_service(server *srv, connection *con,
+               plugin_data *pd, plugin_config *pc,
+               const char *token, size_t len, ac_slice rec) {
+    char authinfo[AC_AUTHINFO_MAX];
+    size_t authinfo_len, i;
+    time_t now = time(NULL), expires = now + pc->timeout;
+    unsigned char realm[AC_REALM_LEN];
+    ac_slice user, val;
+
+    if (ac_cdb_attr(rec, AC_STR("user"), &user) != AC_OK ||
+        ac_user_authinfo(user, authinfo, &authinfo_len) != AC_OK) {
+        WARN("s", "malformed service token record");
+        return endauth(srv, con, pc);
+    }
+    if (ac_cdb_attr(rec, AC_STR("realm"), &val) != AC_OK) {
+        if (! buffer_is_empty(pd->config[0]->tenants)) {
+            WARN("s", "service token without realm - rejecting");
+            return endauth(srv, con, pc);
+        }
+        val = AC_SLICE("", 0);
+    }
+    ac_realm_id(val, realm);
+    if (! ac_realm_equal(realm, pc->realm)) {
+        DEBUG("s", "service token belongs to another realm");
+        return endauth(srv, con, pc);
+    }
+    if (ac_cdb_attr(rec, AC_STR("expires"), &val) == AC_OK) {
+        for (expires = 0, i = 0; i < val.len; i++) {
+            if (val.ptr[i] < '0' || val.ptr[i] > '9') break;
+            expires = expires * 10 + (val.ptr[i] - '0');
+        }
+        if (expires < now) {
+            DEBUG("s", "service token expired");
+            return endauth(srv, con, pc);
+        }
+    }
+    DEBUG("s", "found service token");
+
+    return accept_authinfo(srv, con, pd, pc, authinfo, authinfo_len,
+                           expires, AC_SLICE(token, len), NULL);
+}
+
+//
+// Handle token given in cookie.
+//
+// Expected Cookie Format:
+//   <name>=token:<random-token-to-be-verified>
+// 
+static handler_t
+handle_token(server *srv, connection *con, plugin_data *pd,
+             plugin_config *pc, const char *token, size_t len,
+             const unsigned char *hash) {
+    token_entry *entry;
+    ac_slice rec;
+
+    UNUSED(hash);
+
+    // Check pre-provisioned service tokens first
+    if (pd->services.map &&
+        ac_cdb_find(&pd->services, AC_SLICE(token, len), &rec) == AC_OK) {
+        return accept_service(srv, con, pd, pc, token, len, rec);
+    }
+
+    // Then local (or replicated) store, for this realm only
+    if ((entry = token_store_get(pd->users, token, len)) != NULL) {
+        if (! ac_realm_equal(entry->realm, pc->realm)) {
+            DEBUG("s", "token belongs to another realm");
+            return endauth(srv, con, pc);
+        }
+        return accept_token(srv, con, pd, pc, token, entry->issued,
+                            entry->authinfo, entry->authinfo_len,
+                            &entry->cache);
+    }
+    if (pd->tokend) {
+        ac_l1_entry *le = ac_l1cache_get(pd->recent, AC_SLICE(token, len),
+                                         pc->realm, srv->cur_ts);
+        if (le) {
+            return accept_token(srv, con, pd, pc, token, le->issued,
+                                le->authinfo, le->authinfo_len, &le->cache);
+        }
+        return lookup_token(srv, con, pd, pc, token);
+    }
+
+    return endauth(srv, con, pc);
 }
 
 //
@@ -313,138 +1036,787 @@ handle_token(server *srv, connection *con,
 // Expected Cookie Format:
 //   <name>=crypt:<hash>:<data>
 //
-//   hash    = hex(MD5(key + timesegment + data))
-//   data    = hex(encrypt(MD5(timesegment + key), payload))
-//   payload = base64(username + ":" + password)
+// See ac_crypt_verify() for details.
 //
 static handler_t
-handle_crypt(server *srv, connection *con,
-             plugin_data *pd, plugin_config *pc, char *line) {
-    MD5_CTX ctx;
-    uint8_t hash[MD5_LEN];
-    char    tmp[256];
+handle_crypt(server *srv, connection *con, plugin_data *pd,
+             plugin_config *pc, const char *line, size_t len,
+             const unsigned char *hash) {
+    char authinfo[AC_AUTHINFO_MAX];
+    size_t authinfo_len;
 
-    // Check for existence of data part
-    char *data = strchr(line, ':');
-    if (! data) return endauth(srv, con, pc);
+    UNUSED(hash);
 
     DEBUG("s", "verifying crypt cookie...");
-    
-    // Verify signature.
-    // Also, find time segment when this auth request was encrypted.
-    time_t t1, t0 = time(NULL);
-    buffer *buf = buffer_init();
-    for (t1 = t0 - (t0 % 5); t0 - t1 < 10; t1 -= 5) {
-        DEBUG("sdsd", "t0:", t0, ", t1:", t1);
-        
-        // compute hash for this time segment
-        sprintf(tmp, "%lu", t1);
-        MD5_Init(&ctx);
-        MD5_Update(&ctx, CONST_BUF_LEN(pc->key));
-        MD5_Update(&ctx, tmp, strlen(tmp));
-        MD5_Update(&ctx, data + 1, strlen(data + 1));
-        MD5_Final(hash, &ctx);
-        hex_encode(buf, hash, sizeof(hash));
 
-        DEBUG("sb", "computed hash:", buf);
-
-        // verify by comparing hash
-        if (strncasecmp(buf->ptr, line, data - line) == 0) {
-            break; // hash verified and time segment found
-        }
-    }
-    buffer_free(buf);
-
-    // Has this found time segment expired?
-    if (! (t0 - t1 < 10)) {
+    switch (ac_crypt_verify(BUF_SLICE(pc->key),
+                            AC_SLICE(line, len), time(NULL),
+                            authinfo, &authinfo_len)) {
+    case AC_OK:
+        break;
+    case AC_EEXPIRED:
         DEBUG("s", "timeout detected");
         return endauth(srv, con, pc);
+    case AC_EDECRYPT:
+        WARN("s", "decryption error");
+        return endauth(srv, con, pc);
+    default:
+        DEBUG("s", "malformed crypt cookie");
+        return endauth(srv, con, pc);
     }
     DEBUG("s", "timeout check passed");
-    
-    // compute temporal encryption key (= MD5(t1, key))
-    sprintf(tmp, "%lu", t1);
-    MD5_Init(&ctx);
-    MD5_Update(&ctx, tmp, strlen(tmp));
-    MD5_Update(&ctx, CONST_BUF_LEN(pc->key));
-    MD5_Final(hash, &ctx);
-
-    // decrypt
-    hex_decode(buf = buffer_init(), data + 1);
-    if (decrypt(buf, hash, sizeof(hash)) != 0) {
-        WARN("s", "decryption error");
 
-        buffer_free(buf);
+    // never mint token for revoked user
+    if (authinfo_revoked(pd, authinfo, authinfo_len)) {
+        INFO("s", "crypt cookie of revoked user");
+        audit_authinfo(pc->audit, srv->cur_ts, con, "reject",
+                       authinfo, authinfo_len, "revoked");
         return endauth(srv, con, pc);
     }
 
     // update header using decrypted authinfo
-    update_header(srv, con, pd, pc, buf);
-    
-    buffer_free(buf);
-    return HANDLER_GO_ON;
-}
-
-/**********************************************************************
- * module interface
- **********************************************************************/
-
-INIT_FUNC(module_init) {
-    plugin_data *pd;
-
-    pd = calloc(1, sizeof(*pd));
-    pd->users = array_init();
-    return pd;
+    return update_header(srv, con, pd, pc, authinfo, authinfo_len);
 }
 
-FREE_FUNC(module_free) {
-    plugin_data *pd = p_d;
+#ifdef USE_OPENSSL
 
-    if (! pd) return HANDLER_GO_ON;
+//
+// called in worker thread (or inline, without thread pool).
+//
+static void
+verify_run(void *ctx) {
+    verify_job *job = ctx;
+    ac_slice ticket = AC_SLICE(job->ticket, job->ticket_len);
 
-    // Free plugin data
-    array_free(pd->users);
-    
-    // Free configuration data.
-    // This must be done for each context.
-    if (pd->config) {
-        size_t i;
-        for (i = 0; i < srv->config_context->used; i++) {
-            plugin_config *pc = pd->config[i];
-            if (! pc) continue;
+    if (job->kind == VERIFY_PUBTKT) {
+        ac_pubtkt t;
 
-            // free configuration
-            buffer_free(pc->name);
-            buffer_free(pc->authurl);
-            buffer_free(pc->key);
+        job->result = ac_pubtkt_parse(ticket, &t);
+        if (job->result == AC_OK) {
+            job->result = ac_pubtkt_verify(&t, job->pkey, job->md);
+        }
+    } else {
+        ac_jwt t;
 
-            free(pc);
+        job->result = ac_jwt_parse(ticket, &t);
+        if (job->result == AC_OK) {
+            job->result = ac_jwt_verify(&t, job->secret, job->pkey);
         }
-        free(pd->config);
     }
-    free(pd);
-
-    return HANDLER_GO_ON;
 }
 
 //
-// authorization handler
+// called by thread pool once verification has finished.
 //
-URIHANDLER_FUNC(module_uri_handler) {
-    plugin_data   *pd = p_d;
-    plugin_config *pc = merge_config(srv, con, pd);
-    data_string *ds;
-    char buf[1024]; // cookie content
-    char key[32];   // <AuthName> key
-    char *cs;       // pointer to (some part of) <AuthName> key
+static void
+verify_done(server *srv, void *ctx) {
+    verify_job *job = ctx, **pp;
+    handler_ctx *hctx;
+
+    for (pp = &job->pd->jobs; *pp != job; pp = &(*pp)->next);
+    *pp = job->next;
+
+    for (hctx = job->waiters; hctx; hctx = hctx->next) {
+        hctx->job   = NULL;
+        hctx->done  = 1;
+        hctx->found = job->result == AC_OK;
+        joblist_append(srv, hctx->con);
+    }
+    free(job->ticket);
+    free(job);
+}
+
+//
+// Check signature of the ticket, in thread pool if available.
+// Returns VERIFY_PENDING if connection has to wait for the result,
+// and this is called again once it is available.
+//
+static int
+check_signature(server *srv, connection *con,
+                plugin_data *pd, verify_job *req) {
+    handler_ctx *hctx;
+    verify_job *job;
+    int rc;
+
+    drop_early(pd, con);
+    if ((hctx = con->plugin_ctx[pd->id]) != NULL) {
+        if (! hctx->done) return VERIFY_PENDING;
+
+        con->plugin_ctx[pd->id] = NULL;
+        rc = hctx->found ? AC_OK : AC_EVERIFY;
+        handler_ctx_free(hctx);
+        return rc;
+    }
+
+    // join the job for the same ticket, if any
+    for (job = pd->jobs; job; job = job->next) {
+        if (memcmp(job->hash, req->hash, AC_MD5_LEN) == 0) break;
+    }
+
+    if (! job) {
+        if (! pd->verifier ||
+            (job = malloc(sizeof(*job))) == NULL) {
+            verify_run(req);
+            return req->result;
+        }
+        *job = *req;
+        job->pd     = pd;
+        job->ticket = malloc(req->ticket_len);
+        memcpy(job->ticket, req->ticket, req->ticket_len);
+
+        if (vpool_submit(srv, pd->verifier, job,
+                         verify_run, verify_done) != 0) {
+            free(job->ticket);
+            free(job);
+            verify_run(req);
+            return req->result;
+        }
+        job->next = pd->jobs;
+        pd->jobs  = job;
+    }
+
+    hctx = handler_ctx_init(con);
+    hctx->job    = job;
+    hctx->next   = job->waiters;
+    job->waiters = hctx;
+    con->plugin_ctx[pd->id] = hctx;
+    return VERIFY_PENDING;
+}
+
+//
+// stop waiting for signature verification.
+//
+static void
+verify_cancel(handler_ctx *hctx) {
+    handler_ctx **pp;
+
+    if (! hctx->job) return;
+
+    for (pp = &hctx->job->waiters; *pp != hctx; pp = &(*pp)->next);
+    *pp = hctx->next;
+    hctx->job = NULL;
+}
+
+#endif
+
+//
+// Accept ticket found in (or just put into) ticket cache, unless it is
+// bound to other client address.
+//
+static handler_t
+accept_ticket(server *srv, connection *con, plugin_data *pd,
+              plugin_config *pc, tcache_entry *e, const unsigned char *hash) {
+    if (e->bind[0] && strcmp(e->bind, con->dst_addr_buf->ptr) != 0) {
+        ac_user_stats *st = user_stats(pd, &e->cache,
+                                       e->authinfo, e->authinfo_len);
+        DEBUG("ss", "ticket is bound to other address:", e->bind);
+        if (st) st->redirects++;
+        return endauth(srv, con, pc);
+    }
+    return accept_authinfo(srv, con, pd, pc, e->authinfo, e->authinfo_len,
+                           e->expires, AC_SLICE((const char *)hash, AC_MD5_LEN),
+                           &e->cache);
+}
+
+//
+// Check for mod_auth_pubtkt compatible ticket in cookie.
+//
+// Expected Cookie Format:
+//   <name>=uid=<user>;...;validuntil=<time>;...;sig=<signature>
+//
+// This is called only when the ticket is not found in ticket cache.
+// Once verified, it is cached until the ticket expires. See pubtkt.c
+// for details.
+//
+static handler_t
+handle_pubtkt(server *srv, connection *con, plugin_data *pd,
+              plugin_config *pc, const char *line, size_t len,
+              const unsigned char *hash) {
+#ifdef USE_OPENSSL
+    char authinfo[AC_AUTHINFO_MAX];
+    size_t authinfo_len;
+    time_t now = time(NULL);
+    tcache_entry *e;
+    ac_pubtkt t;
+
+    if (! pc->pubtkt_pkey) {
+        DEBUG("s", "pubtkt ticket given, but no key to verify it");
+        return endauth(srv, con, pc);
+    }
+    DEBUG("s", "verifying pubtkt ticket...");
+
+    if (ac_pubtkt_parse(AC_SLICE(line, len), &t) != AC_OK ||
+        ac_user_authinfo(t.uid, authinfo, &authinfo_len) != AC_OK) {
+        DEBUG("s", "malformed pubtkt ticket");
+        return endauth(srv, con, pc);
+    }
+    if (t.validuntil < now) {
+        DEBUG("s", "timeout detected");
+        return endauth(srv, con, pc);
+    }
+    verify_job req = {
+        .kind = VERIFY_PUBTKT, .ticket = (char *)line, .ticket_len = len,
+        .pkey = pc->pubtkt_pkey, .md = pc->pubtkt_md,
+    };
+    memcpy(req.hash, hash, AC_MD5_LEN);
+
+    switch (check_signature(srv, con, pd, &req)) {
+    case AC_OK:
+        break;
+    case VERIFY_PENDING:
+        return HANDLER_WAIT_FOR_EVENT;
+    default:
+        WARN("s", "pubtkt signature mismatch");
+        return endauth(srv, con, pc);
+    }
+    audit(srv, con, pc, "login", t.uid, "pubtkt");
+
+    e = tcache_put(pd->tickets, hash, pc->realm, t.validuntil,
+                   AC_SLICE(authinfo, authinfo_len), t.cip);
+    if (! e) {
+        // cache is full - accept without remembering it
+        if (t.cip.len && ! buffer_is_equal_string(con->dst_addr_buf,
+                                                  t.cip.ptr, t.cip.len)) {
+            return endauth(srv, con, pc);
+        }
+        return accept_authinfo(srv, con, pd, pc, authinfo, authinfo_len,
+                               t.validuntil, AC_SLICE((const char *)hash,
+                                                      AC_MD5_LEN), NULL);
+    }
+    return accept_ticket(srv, con, pd, pc, e, hash);
+#else
+    UNUSED(pd);
+    UNUSED(line);
+    UNUSED(len);
+    UNUSED(hash);
+
+    DEBUG("s", "pubtkt ticket given, but built without OpenSSL");
+    return endauth(srv, con, pc);
+#endif
+}
+
+//
+// Check for JSON Web Token in cookie.
+//
+// Expected Cookie Format:
+//   <name>=<header>.<payload>.<signature>
+//
+// As with pubtkt ticket, this is called only when the token is not
+// found in ticket cache, and the subject is cached until the token
+// expires. See jwt.c for details.
+//
+static handler_t
+handle_jwt(server *srv, connection *con, plugin_data *pd,
+           plugin_config *pc, const char *line, size_t len,
+           const unsigned char *hash) {
+#ifdef USE_OPENSSL
+    char authinfo[AC_AUTHINFO_MAX];
+    size_t authinfo_len;
+    time_t now = time(NULL);
+    tcache_entry *e;
+    ac_jwt t;
+
+    if (buffer_is_empty(pc->jwt_secret) && ! pc->jwt_pkey) {
+        DEBUG("s", "JWT given, but no key to verify it");
+        return endauth(srv, con, pc);
+    }
+    DEBUG("s", "verifying JWT...");
+
+    if (ac_jwt_parse(AC_SLICE(line, len), &t) != AC_OK ||
+        ac_user_authinfo(AC_SLICE(t.sub, t.sub_len),
+                         authinfo, &authinfo_len) != AC_OK) {
+        DEBUG("s", "malformed JWT");
+        return endauth(srv, con, pc);
+    }
+    if ((t.exp && t.exp < now) || t.nbf > now) {
+        DEBUG("s", "timeout detected");
+        return endauth(srv, con, pc);
+    }
+    verify_job req = {
+        .kind = VERIFY_JWT, .ticket = (char *)line, .ticket_len = len,
+        .secret = BUF_SLICE(pc->jwt_secret), .pkey = pc->jwt_pkey,
+    };
+    memcpy(req.hash, hash, AC_MD5_LEN);
+
+    switch (check_signature(srv, con, pd, &req)) {
+    case AC_OK:
+        break;
+    case VERIFY_PENDING:
+        return HANDLER_WAIT_FOR_EVENT;
+    default:
+        WARN("s", "JWT signature mismatch");
+        return endauth(srv, con, pc);
+    }
+    audit(srv, con, pc, "login", AC_SLICE(t.sub, t.sub_len), "jwt");
+
+    // token without expiry is trusted as long as our own token
+    time_t expires = t.exp ? t.exp : now + pc->timeout;
+    e = tcache_put(pd->tickets, hash, pc->realm, expires,
+                   AC_SLICE(authinfo, authinfo_len), AC_SLICE("", 0));
+    if (! e) {
+        // cache is full - accept without remembering it
+        return accept_authinfo(srv, con, pd, pc, authinfo, authinfo_len,
+                               expires, AC_SLICE((const char *)hash,
+                                                 AC_MD5_LEN), NULL);
+    }
+    return accept_ticket(srv, con, pd, pc, e, hash);
+#else
+    UNUSED(pd);
+    UNUSED(line);
+    UNUSED(len);
+    UNUSED(hash);
+
+    DEBUG("s", "JWT given, but built without OpenSSL");
+    return endauth(srv, con, pc);
+#endif
+}
+
+//
+// Check for mod_auth_tkt compatible ticket in cookie.
+//
+// Expected Cookie Format:
+//   <name>=<digest><ts><uid>!<tokens>!<udata>
+//
+// Ticket may also be base64-encoded, as most ticket generators do.
+// See tkt.c for details.
+//
+static handler_t
+handle_tkt(server *srv, connection *con, plugin_data *pd,
+           plugin_config *pc, const char *line, size_t len,
+           const unsigned char *hash) {
+    unsigned char buf[BASE64_DECODED_MAX(AC_COOKIE_MAX)];
+    unsigned char ip[4] = { 0, 0, 0, 0 };
+    char authinfo[AC_AUTHINFO_MAX];
+    size_t authinfo_len;
+    ac_tkt t;
+    int rc;
+
+    UNUSED(hash);
+
+    if (buffer_is_empty(pc->tkt_secret)) {
+        DEBUG("ss", "unrecognied cookie auth format:", line);
+        return endauth(srv, con, pc);
+    }
+
+    // raw ticket always has "!" after uid
+    if (! memchr(line, '!', len)) {
+        int n;
+
+        if ((n = base64_decode(buf, line, len)) < 0) {
+            DEBUG("s", "malformed tkt ticket");
+            return endauth(srv, con, pc);
+        }
+        line = (const char *)buf;
+        len  = n;
+    }
+
+    // mod_auth_tkt only knows IPv4 address
+    if (! pc->tkt_ignore_ip && con->dst_addr.plain.sa_family == AF_INET) {
+        memcpy(ip, &con->dst_addr.ipv4.sin_addr.s_addr, sizeof(ip));
+    }
+
+    rc = ac_tkt_verify(BUF_SLICE(pc->tkt_secret), AC_SLICE(line, len),
+                       ip, pc->tkt_type, &t);
+    if (rc != AC_OK) {
+        DEBUG("sd", "tkt ticket verification failed:", rc);
+        return endauth(srv, con, pc);
+    }
+    if (time(NULL) - t.ts > pc->timeout) {
+        DEBUG("s", "timeout detected");
+        return endauth(srv, con, pc);
+    }
+
+    if (ac_user_authinfo(t.uid, authinfo, &authinfo_len) != AC_OK) {
+        DEBUG("s", "username too long");
+        return endauth(srv, con, pc);
+    }
+    return accept_authinfo(srv, con, pd, pc, authinfo, authinfo_len,
+                           t.ts + pc->timeout, AC_SLICE(line, len), NULL);
+}
+
+//
+// All cookie schemes known. Each is recognized by its prefix, and
+// handled by its verifier with given cache policy.
+//
+static const scheme schemes[] = {
+    { "token",  "token:", 6, CACHE_TOKEN,  handle_token },
+    { "crypt",  "crypt:", 6, CACHE_ONCE,   handle_crypt },
+    { "pubtkt", "uid=",   0, CACHE_TICKET, handle_pubtkt },
+    { "jwt",    "eyJ",    0, CACHE_TICKET, handle_jwt },
+    { "tkt",    NULL,     0, CACHE_NONE,   handle_tkt },
+};
+
+#define SCHEME_COUNT (sizeof(schemes) / sizeof(schemes[0]))
+#define SCHEME_ALL   ((1U << SCHEME_COUNT) - 1)
+
+//
+// Index schemes by first byte of their prefixes, so a cookie value is
+// dispatched by one table lookup (and one prefix comparison, unless
+// some prefixes share the same first byte).
+//
+static void
+index_schemes(plugin_data *pd) {
+    size_t i;
+
+    for (i = SCHEME_COUNT; i-- > 0;) {
+        if (schemes[i].prefix) {
+            unsigned char c = schemes[i].prefix[0];
+            pd->next[i]  = pd->first[c];
+            pd->first[c] = i + 1;
+        } else {
+            pd->fallback = i + 1;
+        }
+    }
+}
+
+static const scheme *
+find_scheme(plugin_data *pd, const char *cs, size_t len) {
+    unsigned char n;
+
+    for (n = pd->first[(unsigned char)cs[0]]; n; n = pd->next[n - 1]) {
+        const scheme *sc = &schemes[n - 1];
+        size_t plen = strlen(sc->prefix);
+
+        if (len >= plen && memcmp(cs, sc->prefix, plen) == 0) return sc;
+    }
+    return pd->fallback ? &schemes[pd->fallback - 1] : NULL;
+}
+
+//
+// Hash identifying a ticket verified with keys of current context
+// (as other context may use other keys) in realm of current tenant.
+//
+static void
+ticket_hash(plugin_config *pc, const scheme *sc,
+            const char *line, size_t len, unsigned char *hash) {
+    MD5_CTX ctx;
+
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, sc->name, strlen(sc->name) + 1);
+    MD5_Update(&ctx, CONST_BUF_LEN(pc->pubtkt_key));
+    MD5_Update(&ctx, "", 1);
+    MD5_Update(&ctx, CONST_BUF_LEN(pc->pubtkt_digest));
+    MD5_Update(&ctx, "", 1);
+    MD5_Update(&ctx, CONST_BUF_LEN(pc->jwt_key));
+    MD5_Update(&ctx, "", 1);
+    MD5_Update(&ctx, CONST_BUF_LEN(pc->jwt_secret));
+    MD5_Update(&ctx, "", 1);
+    MD5_Update(&ctx, pc->realm, AC_REALM_LEN);
+    MD5_Update(&ctx, line, len);
+    MD5_Final(hash, &ctx);
+}
+
+//
+// Pass cookie value to the verifier of its scheme, if enabled in
+// current context. Ticket already verified is accepted from ticket
+// cache, without calling the verifier.
+//
+static handler_t
+dispatch(server *srv, connection *con, plugin_data *pd,
+         plugin_config *pc, const char *cs, size_t len) {
+    const scheme *sc = find_scheme(pd, cs, len);
+    unsigned char hash[AC_MD5_LEN];
+    tcache_entry *e;
+
+    if (! sc || ! (pc->scheme_mask & 1U << (sc - schemes))) {
+        DEBUG("ss", "unrecognied cookie auth format:", cs);
+        return endauth(srv, con, pc);
+    }
+    cs  += sc->skip;
+    len -= sc->skip;
+
+    if (sc->cache != CACHE_TICKET) {
+        return sc->verify(srv, con, pd, pc, cs, len, NULL);
+    }
+
+    ticket_hash(pc, sc, cs, len, hash);
+    if ((e = tcache_get(pd->tickets, hash, pc->realm, time(NULL))) != NULL) {
+        return accept_ticket(srv, con, pd, pc, e, hash);
+    }
+    return sc->verify(srv, con, pd, pc, cs, len, hash);
+}
+
+//
+// Turn list of scheme names into bitset.
+//
+static int
+compile_schemes(server *srv, plugin_config *pc) {
+    size_t i, j;
+
+    pc->scheme_mask = 0;
+    for (i = 0; i < pc->schemes->used; i++) {
+        data_string *ds = (data_string *)pc->schemes->data[i];
+
+        for (j = 0; j < SCHEME_COUNT; j++) {
+            if (ds->type == TYPE_STRING &&
+                buffer_is_equal_string(ds->value, schemes[j].name,
+                                       strlen(schemes[j].name))) break;
+        }
+        if (j == SCHEME_COUNT) {
+            log_error_write(srv, __FILE__, __LINE__, "sb",
+                            "unknown scheme in auth-cookie.schemes:",
+                            ds->type == TYPE_STRING ? ds->value : ds->key);
+            return -1;
+        }
+        pc->scheme_mask |= 1U << j;
+    }
+    return 0;
+}
+
+/**********************************************************************
+ * module interface
+ **********************************************************************/
+
+INIT_FUNC(module_init) {
+    plugin_data *pd;
+
+    pd = calloc(1, sizeof(*pd));
+    pd->users = token_store_init();
+    pd->tickets = tcache_init(TICKET_CACHE_MAX);
+    pd->tenant_name    = buffer_init();
+    pd->tenant_key     = buffer_init();
+    pd->tenant_authurl = buffer_init();
+    index_schemes(pd);
+    return pd;
+}
+
+FREE_FUNC(module_free) {
+    plugin_data *pd = p_d;
+
+    if (! pd) return HANDLER_GO_ON;
+
+    // Free plugin data
+    tokend_free(srv, pd->tokend);
+    ac_l1cache_free(pd->recent);
+    gossip_free(srv, pd->gossip);
+    token_store_free(pd->users);
+    tcache_free(pd->tickets);
+    ac_cdb_close(&pd->dir);
+    ac_cdb_close(&pd->services);
+    ac_cdb_close(&pd->tenants);
+    buffer_free(pd->tenant_name);
+    buffer_free(pd->tenant_key);
+    buffer_free(pd->tenant_authurl);
+    ac_revoked_free(pd->revoked);
+    ac_ustats_free(pd->ustats);
+    while (pd->ngroups > 0) free(pd->groups[--pd->ngroups]);
+
+    // stop verifier first, as pending jobs are freed here
+    vpool_free(srv, pd->verifier);
+    while (pd->jobs) {
+        verify_job *job = pd->jobs;
+        pd->jobs = job->next;
+        free(job->ticket);
+        free(job);
+    }
+    
+    // Free configuration data.
+    // This must be done for each context.
+    if (pd->config) {
+        size_t i;
+        for (i = 0; i < srv->config_context->used; i++) {
+            plugin_config *pc = pd->config[i];
+            if (! pc) continue;
+
+            // free configuration
+            buffer_free(pc->name);
+            buffer_free(pc->authurl);
+            buffer_free(pc->key);
+            buffer_free(pc->options);
+            buffer_free(pc->pubtkt_key);
+            buffer_free(pc->pubtkt_digest);
+            buffer_free(pc->jwt_secret);
+            buffer_free(pc->jwt_key);
+#ifdef USE_OPENSSL
+            if (pc->jwt_pkey) EVP_PKEY_free(pc->jwt_pkey);
+#endif
+            buffer_free(pc->tkt_secret);
+            buffer_free(pc->assertion_header);
+            buffer_free(pc->assertion_key);
+            buffer_free(pc->tkt_digest);
+            buffer_free(pc->directory);
+            array_free(pc->directory_headers);
+            array_free(pc->require_group);
+            array_free(pc->exclude);
+            array_free(pc->schemes);
+            buffer_free(pc->revoked_users);
+            buffer_free(pc->service_tokens);
+            buffer_free(pc->tenants);
+            buffer_free(pc->audit_log);
+            ac_audit_close(pc->audit);
+            buffer_free(pc->user_stats);
+            ac_loopguard_free(pc->loops);
+            ac_ptrie_free(pc->exclude_trie);
+#ifdef USE_OPENSSL
+            if (pc->pubtkt_pkey) EVP_PKEY_free(pc->pubtkt_pkey);
+#endif
+            buffer_free(pc->gossip_listen);
+            array_free(pc->gossip_peers);
+            buffer_free(pc->gossip_key);
+            buffer_free(pc->tokend);
+
+            free(pc);
+        }
+        free(pd->config);
+    }
+    free(pd);
+
+    return HANDLER_GO_ON;
+}
+
+//
+// Find record of given virtual host in tenant table, along with ID
+// of its realm - "realm" attribute if given (for hosts sharing one),
+// or the host name. Realm is all zero for host not in the table.
+//
+static int
+find_tenant(plugin_data *pd, buffer *host, ac_slice *rec,
+            unsigned char *realm) {
+    ac_slice h = BUF_SLICE(host), v;
+    size_t i;
+
+    memset(realm, 0, AC_REALM_LEN);
+    if (! pd->tenants.map || ! h.len) return AC_EFORMAT;
+
+    // drop port, if any (but not a part of IPv6 address)
+    for (i = h.len; i-- > 0 && h.ptr[i] >= '0' && h.ptr[i] <= '9'; );
+    if (i < h.len && h.ptr[i] == ':' &&
+        (h.ptr[0] != '[' || (i > 0 && h.ptr[i - 1] == ']'))) {
+        h.len = i;
+    }
+    if (ac_cdb_find(&pd->tenants, h, rec) != AC_OK) return AC_EFORMAT;
+
+    if (ac_cdb_attr(*rec, AC_STR("realm"), &v) != AC_OK) v = h;
+    ac_realm_id(v, realm);
+    return AC_OK;
+}
+
+//
+// Take realm of the virtual host from tenant table, with a record of
+// "name=value" lines:
+//
+//   name=<cookie name>
+//   key=<key for cookie verification>
+//   authurl=<page to go when unauthorized>
+//   realm=<realm name>  (optional, defaults to host name)
+//
+// Each of the first three given overrides lighttpd.conf for this
+// request. Tokens and tickets are only taken in the realm they were
+// issued in.
+//
+static void
+apply_tenant(server *srv, connection *con,
+             plugin_data *pd, plugin_config *pc) {
+    ac_slice rec, v;
+
+    if (find_tenant(pd, con->uri.authority, &rec, pc->realm) != AC_OK) {
+        return;
+    }
+
+    if (ac_cdb_attr(rec, AC_STR("name"), &v) == AC_OK) {
+        buffer_copy_string_len(pd->tenant_name, v.ptr, v.len);
+        pc->name = pd->tenant_name;
+    }
+    if (ac_cdb_attr(rec, AC_STR("key"), &v) == AC_OK) {
+        buffer_copy_string_len(pd->tenant_key, v.ptr, v.len);
+        pc->key = pd->tenant_key;
+    }
+    if (ac_cdb_attr(rec, AC_STR("authurl"), &v) == AC_OK) {
+        buffer_copy_string_len(pd->tenant_authurl, v.ptr, v.len);
+        pc->authurl = pd->tenant_authurl;
+    }
+    DEBUG("sb", "realm of tenant:", con->uri.authority);
+}
+
+//
+// Ask authtokend for the token as soon as request headers are in,
+// before URI is cleaned up and conditionals are known, so the answer
+// is likely here by the time it's needed. Only done if cookie name
+// is known by then - from tenant table, or as all contexts agree.
+//
+URIHANDLER_FUNC(module_uri_early) {
+    plugin_data *pd = p_d;
+    handler_ctx *hctx;
+    data_string *ds;
+    ac_slice cv, name, rec;
+    unsigned char realm[AC_REALM_LEN];
+
+    if (! pd->tokend || con->plugin_ctx[pd->id]) return HANDLER_GO_ON;
+
+    if (find_tenant(pd, con->uri.authority, &rec, realm) != AC_OK ||
+        ac_cdb_attr(rec, AC_STR("name"), &name) != AC_OK) {
+        if (! pd->early_name) return HANDLER_GO_ON;
+        name = BUF_SLICE(pd->early_name);
+    }
+    if ((ds = HEADER(con, "Cookie")) == NULL ||
+        ac_cookie_find(BUF_SLICE(ds->value), name, &cv) != AC_OK) {
+        return HANDLER_GO_ON;
+    }
+    if (cv.len <= 6 || cv.len - 6 > TOKEN_LEN ||
+        memcmp(cv.ptr, "token:", 6) != 0) {
+        return HANDLER_GO_ON;
+    }
+    cv = AC_SLICE(cv.ptr + 6, cv.len - 6);
+
+    // nothing to wait for if found locally
+    if (token_store_get(pd->users, cv.ptr, cv.len) ||
+        ac_l1cache_get(pd->recent, cv, realm, srv->cur_ts)) {
+        return HANDLER_GO_ON;
+    }
+
+    hctx = handler_ctx_init(con);
+    hctx->early = 1;
+    memcpy(hctx->token, cv.ptr, cv.len);
+    if (tokend_get(srv, pd->tokend, cv.ptr, cv.len, lookup_done, hctx) != 0) {
+        handler_ctx_free(hctx);
+        return HANDLER_GO_ON;
+    }
+    con->plugin_ctx[pd->id] = hctx;
+    return HANDLER_GO_ON;
+}
+
+//
+// authorization handler
+//
+URIHANDLER_FUNC(module_uri_handler) {
+    plugin_data   *pd = p_d;
+    plugin_config *pc = merge_config(srv, con, pd);
+    data_string *ds;
+    char buf[AC_COOKIE_MAX]; // cookie content
+    ac_slice cv;    // <AuthName> entry in a cookie
+    size_t i;
+
+    apply_tenant(srv, con, pd, pc);
 
     // skip if not enabled
     if (buffer_is_empty(pc->name)) return HANDLER_GO_ON;
 
+    // never pass assertion made up by client
+    if (! buffer_is_empty(pc->assertion_header) &&
+        (ds = HEADER(con, pc->assertion_header->ptr)) != NULL) {
+        buffer_reset(ds->key);
+    }
+
+    // never pass attributes made up by client either
+    for (i = 0; i < pc->directory_headers->used; i++) {
+        data_string *dh = (data_string *)pc->directory_headers->data[i];
+
+        if ((ds = HEADER(con, dh->value->ptr)) != NULL) buffer_reset(ds->key);
+    }
+
+    // public paths in protected tree
+    if (pc->exclude_trie &&
+        ac_ptrie_match(pc->exclude_trie, BUF_SLICE(con->uri.path))) {
+        DEBUG("sb", "excluded path:", con->uri.path);
+        return HANDLER_GO_ON;
+    }
+
     // decide how to handle incoming Auth header
     if ((ds = HEADER(con, "Authorization")) != NULL) {
         switch (pc->override) {
-        case 0: return HANDLER_GO_ON;   // just use it if supplied
+        case 0:                         // just use it if supplied,
+            if (! pc->require_groups) return HANDLER_GO_ON;
+            break;                      // but groups need a session
         case 1: break;                  // use CookieAuth if exists
         case 2:
         default: buffer_reset(ds->key); // use CookieAuth only
@@ -455,56 +1827,89 @@ URIHANDLER_FUNC(module_uri_handler) {
     if ((ds = HEADER(con, "Cookie")) == NULL) return endauth(srv, con, pc);
     DEBUG("sb", "parsing cookie:", ds->value);
 
-    // prepare cstring for processing
-    memset(key, 0, sizeof(key));
-    memset(buf, 0, sizeof(buf));
-    strncpy(key, pc->name->ptr,  min(sizeof(key) - 1, pc->name->used));
-    strncpy(buf, ds->value->ptr, min(sizeof(buf) - 1, ds->value->used));
-    DEBUG("ss", "parsing for key:", key);
-    
     // check for "<AuthName>=" entry in a cookie
-    for (cs = buf; (cs = strstr(cs, key)) != NULL; ) {
-        DEBUG("ss", "checking cookie entry:", cs);
+    if (ac_cookie_find(BUF_SLICE(ds->value),
+                       BUF_SLICE(pc->name), &cv) != AC_OK) {
+        return endauth(srv, con, pc); // not found - rejecting
+    }
+    if (cv.len >= sizeof(buf)) {
+        DEBUG("s", "cookie too long");
+        return endauth(srv, con, pc);
+    }
+
+    // unescape payload
+    cv.len = ac_urldecode(buf, cv);
+    buf[cv.len] = '\0';
+
+    // hand it over to the verifier of its scheme
+    return dispatch(srv, con, pd, pc, buf, cv.len);
+}
 
-        // check if found entry matches exactly for "KEY=" part.
-        cs += pc->name->used - 1;  // jump to the end of "KEY" part
-        while (isspace(*cs)) cs++; // whitespace can be skipped
+//
+// Give each group in require-group rule an ID (shared by all contexts),
+// and turn the rule into bitset of them.
+//
+static int
+compile_groups(server *srv, plugin_data *pd, plugin_config *pc) {
+    size_t i;
+    int id;
 
-        // break forward if this was an exact match
-        if (*cs++ == '=') {
-            char *eot = strchr(cs, ';');
-            if (eot) *eot = '\0';
-            break;
+    for (i = 0; i < pc->require_group->used; i++) {
+        data_string *ds = (data_string *)pc->require_group->data[i];
+
+        if (ds->type != TYPE_STRING || buffer_is_empty(ds->value)) {
+            log_error_write(srv, __FILE__, __LINE__, "s",
+                            "auth-cookie.require-group must be list of names");
+            return -1;
+        }
+        for (id = 0; id < pd->ngroups; id++) {
+            if (strcmp(pd->groups[id], ds->value->ptr) == 0) break;
         }
+        if (id == pd->ngroups) {
+            if (pd->ngroups == GROUP_MAX) {
+                log_error_write(srv, __FILE__, __LINE__, "sd",
+                                "too many groups in require-group, max:",
+                                GROUP_MAX);
+                return -1;
+            }
+            pd->groups[pd->ngroups++] = strdup(ds->value->ptr);
+        }
+        pc->require_groups |= (uint64_t)1 << id;
     }
-    if (! cs) return endauth(srv, con, pc); // not found - rejecting
+    return 0;
+}
 
-    // unescape payload
-    buffer *tmp = buffer_init_string(cs);
-    buffer_urldecode_path(tmp);
-    memset(buf, 0, sizeof(buf));
-    strncpy(buf, tmp->ptr, min(sizeof(buf) - 1, tmp->used));
-    buffer_free(tmp);
-    cs = buf;
+//
+// Compile exclude list into a trie, so request path is matched
+// against all of them in one pass.
+//
+static int
+compile_exclude(server *srv, plugin_config *pc) {
+    size_t i;
 
-    // Allow access if client already has an "authorized" token.
-    if (strncmp(cs, "token:", 6) == 0) {
-        return handle_token(srv, con, pd, pc, cs + 6);
-    }
+    pc->exclude_trie = ac_ptrie_init();
+    for (i = 0; i < pc->exclude->used; i++) {
+        data_string *ds = (data_string *)pc->exclude->data[i];
 
-    // Verify "non-authorized" CookieAuth request in encrypted format.
-    // Once verified, give out authorized token ("token:..." cookie).
-    if (strncmp(cs, "crypt:", 6) == 0) {
-        return handle_crypt(srv, con, pd, pc, cs + 6);
+        if (ds->type != TYPE_STRING || buffer_is_empty(ds->value) ||
+            ds->value->ptr[0] != '/') {
+            log_error_write(srv, __FILE__, __LINE__, "s",
+                            "auth-cookie.exclude must be list of paths");
+            return -1;
+        }
+        if (ac_ptrie_add(pc->exclude_trie, BUF_SLICE(ds->value)) != 0) {
+            log_error_write(srv, __FILE__, __LINE__, "s",
+                            "out of memory compiling auth-cookie.exclude");
+            return -1;
+        }
     }
-
-    DEBUG("ss", "unrecognied cookie auth format:", cs);
-    return endauth(srv, con, pc);
+    return 0;
 }
 
 SETDEFAULTS_FUNC(module_set_defaults) {
     plugin_data *pd = p_d;
     size_t i;
+    int names_differ = 0;
 
     config_values_t cv[] = {
         { "auth-cookie.loglevel",
@@ -521,6 +1926,58 @@ SETDEFAULTS_FUNC(module_set_defaults) {
           NULL, T_CONFIG_INT,    T_CONFIG_SCOPE_CONNECTION },
         { "auth-cookie.options",
           NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.gossip-listen",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { "auth-cookie.gossip-peers",
+          NULL, T_CONFIG_ARRAY,  T_CONFIG_SCOPE_SERVER },
+        { "auth-cookie.gossip-key",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { "auth-cookie.tokend",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { "auth-cookie.pubtkt-key",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.pubtkt-digest",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.tkt-secret",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.tkt-digest",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.tkt-ignore-ip",
+          NULL, T_CONFIG_BOOLEAN, T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.jwt-secret",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.jwt-key",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.verify-threads",
+          NULL, T_CONFIG_INT,    T_CONFIG_SCOPE_SERVER },
+        { "auth-cookie.assertion-header",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.assertion-key",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.directory",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { "auth-cookie.directory-headers",
+          NULL, T_CONFIG_ARRAY,  T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.require-group",
+          NULL, T_CONFIG_ARRAY,  T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.exclude",
+          NULL, T_CONFIG_ARRAY,  T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.schemes",
+          NULL, T_CONFIG_ARRAY,  T_CONFIG_SCOPE_CONNECTION },
+        { "auth-cookie.revoked-users",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { "auth-cookie.service-tokens",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { "auth-cookie.audit-log",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { "auth-cookie.audit-log-size",
+          NULL, T_CONFIG_INT,    T_CONFIG_SCOPE_SERVER },
+        { "auth-cookie.user-stats",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { "auth-cookie.redirect-limit",
+          NULL, T_CONFIG_INT,    T_CONFIG_SCOPE_SERVER },
+        { "auth-cookie.tenants",
+          NULL, T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
         { NULL, NULL, T_CONFIG_UNSET, T_CONFIG_SCOPE_UNSET }
     };
 
@@ -538,6 +1995,29 @@ SETDEFAULTS_FUNC(module_set_defaults) {
         pc->key      = buffer_init();
         pc->timeout  = 86400;
         pc->options  = buffer_init();
+        pc->gossip_listen = buffer_init();
+        pc->gossip_peers  = array_init();
+        pc->gossip_key    = buffer_init();
+        pc->tokend        = buffer_init();
+        pc->pubtkt_key    = buffer_init();
+        pc->pubtkt_digest = buffer_init();
+        pc->tkt_secret    = buffer_init();
+        pc->tkt_digest    = buffer_init();
+        pc->jwt_secret    = buffer_init();
+        pc->jwt_key       = buffer_init();
+        pc->assertion_header = buffer_init();
+        pc->assertion_key    = buffer_init();
+        pc->directory         = buffer_init();
+        pc->directory_headers = array_init();
+        pc->require_group     = array_init();
+        pc->exclude           = array_init();
+        pc->schemes           = array_init();
+        pc->scheme_mask       = SCHEME_ALL;
+        pc->revoked_users     = buffer_init();
+        pc->service_tokens    = buffer_init();
+        pc->tenants           = buffer_init();
+        pc->audit_log         = buffer_init();
+        pc->user_stats        = buffer_init();
 
         cv[0].destination = &(pc->loglevel);
         cv[1].destination = pc->name;
@@ -546,11 +2026,431 @@ SETDEFAULTS_FUNC(module_set_defaults) {
         cv[4].destination = pc->key;
         cv[5].destination = &(pc->timeout);
         cv[6].destination = pc->options;
+        cv[7].destination = pc->gossip_listen;
+        cv[8].destination = pc->gossip_peers;
+        cv[9].destination = pc->gossip_key;
+        cv[10].destination = pc->tokend;
+        cv[11].destination = pc->pubtkt_key;
+        cv[12].destination = pc->pubtkt_digest;
+        cv[13].destination = pc->tkt_secret;
+        cv[14].destination = pc->tkt_digest;
+        cv[15].destination = &(pc->tkt_ignore_ip);
+        cv[16].destination = pc->jwt_secret;
+        cv[17].destination = pc->jwt_key;
+        cv[18].destination = &(pc->verify_threads);
+        cv[19].destination = pc->assertion_header;
+        cv[20].destination = pc->assertion_key;
+        cv[21].destination = pc->directory;
+        cv[22].destination = pc->directory_headers;
+        cv[23].destination = pc->require_group;
+        cv[24].destination = pc->exclude;
+        cv[25].destination = pc->schemes;
+        cv[26].destination = pc->revoked_users;
+        cv[27].destination = pc->service_tokens;
+        cv[28].destination = pc->audit_log;
+        cv[29].destination = &(pc->audit_log_size);
+        cv[30].destination = pc->user_stats;
+        cv[31].destination = &(pc->redirect_limit);
+        cv[32].destination = pc->tenants;
 
         array *ca = ((data_config *)srv->config_context->data[i])->value;
         if (config_insert_values_global(srv, ca, cv) != 0) {
             return HANDLER_ERROR;
         }
+
+        // load public key for mod_auth_pubtkt ticket
+        if (! buffer_is_empty(pc->pubtkt_key)) {
+#ifdef USE_OPENSSL
+            const char *md = buffer_is_empty(pc->pubtkt_digest)
+                ? "sha1" : pc->pubtkt_digest->ptr;
+
+            if ((pc->pubtkt_pkey = ac_pubkey_load(pc->pubtkt_key->ptr)) == NULL) {
+                log_error_write(srv, __FILE__, __LINE__, "sb",
+                                "cannot load public key:", pc->pubtkt_key);
+                return HANDLER_ERROR;
+            }
+            if ((pc->pubtkt_md = EVP_get_digestbyname(md)) == NULL) {
+                log_error_write(srv, __FILE__, __LINE__, "ss",
+                                "unknown digest:", md);
+                return HANDLER_ERROR;
+            }
+#else
+            log_error_write(srv, __FILE__, __LINE__, "s",
+                            "auth-cookie.pubtkt-key needs OpenSSL support");
+            return HANDLER_ERROR;
+#endif
+        }
+
+        // load public key for JWT
+        if (! buffer_is_empty(pc->jwt_key)) {
+#ifdef USE_OPENSSL
+            if ((pc->jwt_pkey = ac_pubkey_load(pc->jwt_key->ptr)) == NULL) {
+                log_error_write(srv, __FILE__, __LINE__, "sb",
+                                "cannot load public key:", pc->jwt_key);
+                return HANDLER_ERROR;
+            }
+#else
+            log_error_write(srv, __FILE__, __LINE__, "s",
+                            "auth-cookie.jwt-key needs OpenSSL support");
+            return HANDLER_ERROR;
+#endif
+        }
+#ifndef USE_OPENSSL
+        if (! buffer_is_empty(pc->jwt_secret)) {
+            log_error_write(srv, __FILE__, __LINE__, "s",
+                            "auth-cookie.jwt-secret needs OpenSSL support");
+            return HANDLER_ERROR;
+        }
+#endif
+
+#ifndef USE_OPENSSL
+        if (! buffer_is_empty(pc->assertion_header)) {
+            log_error_write(srv, __FILE__, __LINE__, "s",
+                            "auth-cookie.assertion-header needs OpenSSL support");
+            return HANDLER_ERROR;
+        }
+#endif
+
+        // digest type for mod_auth_tkt ticket (MD5 as default)
+        if (! buffer_is_empty(pc->tkt_digest) &&
+            (pc->tkt_type = ac_tkt_digest_type(pc->tkt_digest->ptr)) < 0) {
+            log_error_write(srv, __FILE__, __LINE__, "sb",
+                            "unsupported tkt digest:", pc->tkt_digest);
+            return HANDLER_ERROR;
+        }
+
+        // compile required groups into bitset
+        if (pc->require_group->used) {
+            if (buffer_is_empty(pd->config[0]->directory)) {
+                log_error_write(srv, __FILE__, __LINE__, "s",
+                                "auth-cookie.require-group needs auth-cookie.directory");
+                return HANDLER_ERROR;
+            }
+            if (compile_groups(srv, pd, pc) != 0) return HANDLER_ERROR;
+        }
+
+        // compile enabled schemes into bitset (all, if not given)
+        if (pc->schemes->used && compile_schemes(srv, pc) != 0) {
+            return HANDLER_ERROR;
+        }
+
+        // compile excluded paths into trie
+        if (pc->exclude->used && compile_exclude(srv, pc) != 0) {
+            return HANDLER_ERROR;
+        }
+
+        if (pd->max_timeout < pc->timeout) pd->max_timeout = pc->timeout;
+
+        if (! buffer_is_empty(pc->name)) {
+            if (! pd->early_name) pd->early_name = pc->name;
+            if (! buffer_is_equal(pd->early_name, pc->name)) names_differ = 1;
+        }
+    }
+    if (names_differ) pd->early_name = NULL;
+
+    // open random source for tokens while it is still reachable
+    if (ac_random_init() != 0) {
+        log_error_write(srv, __FILE__, __LINE__, "ss",
+                        "cannot open /dev/urandom:", strerror(errno));
+        return HANDLER_ERROR;
+    }
+
+    // setup token replication
+    plugin_config *pc = pd->config[0];
+    if (! buffer_is_empty(pc->gossip_listen)) {
+        pd->gossip = gossip_init(srv, pd->users, pc->gossip_listen,
+                                 pc->gossip_peers, pc->gossip_key);
+        if (! pd->gossip) return HANDLER_ERROR;
+    }
+
+    // setup external token store
+    if (! buffer_is_empty(pc->tokend)) {
+        pd->tokend = tokend_init(srv, pc->tokend, put_lost, pd);
+        pd->recent = ac_l1cache_init(RECENT_TTL);
+    }
+
+    // load user attributes
+    if (! buffer_is_empty(pc->directory) &&
+        ac_cdb_reload(&pd->dir, pc->directory->ptr) < 0) {
+        log_error_write(srv, __FILE__, __LINE__, "sb",
+                        "cannot load directory:", pc->directory);
+        return HANDLER_ERROR;
+    }
+
+    // map service tokens
+    if (! buffer_is_empty(pc->service_tokens) &&
+        ac_cdb_reload(&pd->services, pc->service_tokens->ptr) < 0) {
+        log_error_write(srv, __FILE__, __LINE__, "sb",
+                        "cannot load service tokens:", pc->service_tokens);
+        return HANDLER_ERROR;
+    }
+
+    // map realms of virtual hosts
+    if (! buffer_is_empty(pc->tenants) &&
+        ac_cdb_reload(&pd->tenants, pc->tenants->ptr) < 0) {
+        log_error_write(srv, __FILE__, __LINE__, "sb",
+                        "cannot load tenants:", pc->tenants);
+        return HANDLER_ERROR;
+    }
+
+    // open audit log (written by its own thread, started on first event)
+    if (! buffer_is_empty(pc->audit_log)) {
+        pc->audit = ac_audit_open(pc->audit_log->ptr,
+                                  (size_t)pc->audit_log_size << 20);
+        if (! pc->audit) {
+            log_error_write(srv, __FILE__, __LINE__, "sb",
+                            "cannot open audit log:", pc->audit_log);
+            return HANDLER_ERROR;
+        }
+    }
+
+    // count redirects per client, to break redirect loop
+    if (pc->redirect_limit > 0) {
+        pc->loops = ac_loopguard_init(pc->redirect_limit, REDIRECT_WINDOW);
+
+        // own mode, or core adds its error page to the body
+        pc->loop_mode = pd->id;
+    }
+
+    // count requests per user
+    if (! buffer_is_empty(pc->user_stats)) {
+        pd->ustats = ac_ustats_init(USER_STATS_MAX);
+    }
+
+    // load revoked users
+    if (! buffer_is_empty(pc->revoked_users) &&
+        ac_revoked_reload(&pd->revoked, pc->revoked_users->ptr) < 0) {
+        log_error_write(srv, __FILE__, __LINE__, "sb",
+                        "cannot load revoked users:", pc->revoked_users);
+        return HANDLER_ERROR;
+    }
+
+    // setup threads to verify public-key signatures
+    if (pc->verify_threads > 0) {
+        pd->verifier = vpool_init(srv, pc->verify_threads);
+    }
+    return HANDLER_GO_ON;
+}
+
+//
+// drop state left by connection still waiting for authtokend or verifier.
+//
+CONNECTION_FUNC(module_connection_reset) {
+    plugin_data *pd = p_d;
+    handler_ctx *hctx = con->plugin_ctx[pd->id];
+
+    UNUSED(srv);
+
+    if (! hctx) return HANDLER_GO_ON;
+
+    tokend_cancel(pd->tokend, hctx);
+#ifdef USE_OPENSSL
+    verify_cancel(hctx);
+#endif
+    handler_ctx_free(hctx);
+    con->plugin_ctx[pd->id] = NULL;
+
+    return HANDLER_GO_ON;
+}
+
+static void
+expire_entry(token_entry *te, void *ctx) {
+    void **args = ctx;
+    server *srv = args[0];
+
+    gossip_expire(srv, args[1], te->token);
+    audit_authinfo(args[2], srv->cur_ts, NULL, "expire",
+                   te->authinfo, te->authinfo_len, "token");
+}
+
+//
+// pick up CDB file (directory or service tokens) replaced since last
+// check. Previous one is kept (and used) if the new one cannot be loaded.
+//
+static void
+reload_cdb(server *srv, ac_cdb *db, buffer *path, int *failed,
+           const char *what) {
+    int rc;
+
+    if (buffer_is_empty(path)) return;
+
+    if ((rc = ac_cdb_reload(db, path->ptr)) < 0) {
+        if (! *failed) {
+            log_error_write(srv, __FILE__, __LINE__, "ssb",
+                            "cannot reload", what, path);
+        }
+    } else if (rc > 0) {
+        log_error_write(srv, __FILE__, __LINE__, "ssb",
+                        what, "reloaded:", path);
+    }
+    *failed = rc < 0;
+}
+
+static int
+token_revoked(token_entry *te, void *ctx) {
+    void **args = ctx;
+    return authinfo_revoked(args[1], te->authinfo, te->authinfo_len);
+}
+
+static int
+ticket_revoked(tcache_entry *e, void *ctx) {
+    return authinfo_revoked(ctx, e->authinfo, e->authinfo_len);
+}
+
+static void
+revoke_token(token_entry *te, void *ctx) {
+    void **args = ctx;
+    plugin_data *pd = args[1];
+
+    gossip_revoke(args[0], pd->gossip, te->token);
+    audit_authinfo(pd->config[0]->audit, time(NULL), NULL, "revoke",
+                   te->authinfo, te->authinfo_len, "token");
+}
+
+static void
+revoke_ticket(tcache_entry *e, void *ctx) {
+    plugin_data *pd = ctx;
+    audit_authinfo(pd->config[0]->audit, time(NULL), NULL, "revoke",
+                   e->authinfo, e->authinfo_len, "ticket");
+}
+
+//
+// pick up list of revoked users replaced since last check, and drop
+// all their sessions at once. Sessions not kept here (in authtokend,
+// or still being verified) are rejected on their next use.
+//
+static void
+reload_revoked(server *srv, plugin_data *pd) {
+    buffer *path = pd->config[0]->revoked_users;
+    void *args[2] = { srv, pd };
+    size_t ntokens, ntickets;
+    int rc;
+
+    if (buffer_is_empty(path)) return;
+
+    if ((rc = ac_revoked_reload(&pd->revoked, path->ptr)) < 0) {
+        if (! pd->revoked_failed) {
+            log_error_write(srv, __FILE__, __LINE__, "sb",
+                            "cannot reload revoked users:", path);
+        }
+    } else if (rc > 0) {
+        ntokens  = token_store_remove_if(pd->users, token_revoked,
+                                         revoke_token, args);
+        ntickets = tcache_remove_if(pd->tickets, ticket_revoked,
+                                    revoke_ticket, pd);
+        ac_l1cache_invalidate(pd->recent);
+        log_error_write(srv, __FILE__, __LINE__, "sbsdsd",
+                        "revoked users reloaded:", path,
+                        "tokens dropped:", (int)ntokens,
+                        "tickets dropped:", (int)ntickets);
+    }
+    pd->revoked_failed = rc < 0;
+}
+
+// totals of per-user counters, summed up while dumping them
+typedef struct {
+    FILE         *fp;
+    time_t        since;  // users seen after this are "active"
+    unsigned long users;
+    unsigned long active;
+    unsigned long requests;
+    unsigned long redirects;
+    unsigned long mints;
+} user_totals;
+
+static void
+dump_user(ac_user_stats *st, void *ctx) {
+    user_totals *t = ctx;
+
+    if (t->fp) {
+        fprintf(t->fp, "%s\t%lu\t%lu\t%lu\t%ld\n", st->user, st->requests,
+                st->redirects, st->mints, (long)st->last_seen);
+    }
+    t->users++;
+    if (st->last_seen > t->since) t->active++;
+    t->requests  += st->requests;
+    t->redirects += st->redirects;
+    t->mints     += st->mints;
+}
+
+// status counters are int, so saturate rather than wrap
+static void
+set_counter(server *srv, const char *name, size_t len, unsigned long v) {
+    status_counter_set(srv, name, len, v > INT_MAX ? INT_MAX : (int)v);
+}
+
+//
+// dump per-user counters to a file, replaced as a whole, and publish
+// their totals as status counters (server.statistics-url of
+// mod_status). Counters of each user are only in the file, as a
+// status entry per user would not scale to the users counted.
+//
+static void
+dump_user_stats(server *srv, plugin_data *pd) {
+    buffer *path = pd->config[0]->user_stats;
+    buffer *tmp = buffer_init_buffer(path);
+    user_totals t;
+
+    memset(&t, 0, sizeof(t));
+    t.since = srv->cur_ts - USER_STATS_INTERVAL;
+
+    buffer_append_string(tmp, ".tmp");
+    if ((t.fp = fopen(tmp->ptr, "w")) == NULL) {
+        log_error_write(srv, __FILE__, __LINE__, "sb",
+                        "cannot write user stats:", tmp);
+    } else {
+        fprintf(t.fp, "# user\trequests\tredirects\tmints\tlast_seen\n");
+    }
+    ac_ustats_walk(pd->ustats, dump_user, &t);
+
+    if (t.fp && fclose(t.fp) == 0) rename(tmp->ptr, path->ptr);
+    buffer_free(tmp);
+
+    set_counter(srv, CONST_STR_LEN("auth-cookie.users.counted"), t.users);
+    set_counter(srv, CONST_STR_LEN("auth-cookie.users.active"), t.active);
+    set_counter(srv, CONST_STR_LEN("auth-cookie.users.requests"), t.requests);
+    set_counter(srv, CONST_STR_LEN("auth-cookie.users.redirects"),
+                t.redirects);
+    set_counter(srv, CONST_STR_LEN("auth-cookie.users.mints"), t.mints);
+}
+
+//
+// periodic maintenance - sweep expired tokens and talk to peers.
+//
+TRIGGER_FUNC(module_trigger) {
+    plugin_data *pd = p_d;
+
+    if (srv->cur_ts - pd->last_expire >= EXPIRE_INTERVAL) {
+        void *args[3] = { srv, pd->gossip, pd->config[0]->audit };
+        size_t live, resident;
+
+        token_store_expire(pd->users, srv->cur_ts - pd->max_timeout,
+                           expire_entry, args);
+        tcache_expire(pd->tickets, srv->cur_ts);
+        pd->last_expire = srv->cur_ts;
+
+        // give memory of expired tokens back, and tell how much is left
+        token_store_compact(pd->users);
+        token_store_usage(pd->users, &live, &resident);
+        set_counter(srv, CONST_STR_LEN("auth-cookie.store.live-bytes"), live);
+        set_counter(srv, CONST_STR_LEN("auth-cookie.store.resident-bytes"),
+                    resident);
+    }
+    token_store_rehash(pd->users, TOKEN_REHASH_TICK);
+    tokend_trigger(srv, pd->tokend);
+    reload_cdb(srv, &pd->dir, pd->config[0]->directory,
+               &pd->dir_failed, "directory");
+    reload_cdb(srv, &pd->services, pd->config[0]->service_tokens,
+               &pd->services_failed, "service tokens");
+    reload_cdb(srv, &pd->tenants, pd->config[0]->tenants,
+               &pd->tenants_failed, "tenants");
+    reload_revoked(srv, pd);
+    // after expiry and revocation, so their records go out in batches
+    gossip_trigger(srv, pd->gossip);
+
+    if (pd->ustats && srv->cur_ts - pd->last_stats >= USER_STATS_INTERVAL) {
+        dump_user_stats(srv, pd);
+        pd->last_stats = srv->cur_ts;
     }
     return HANDLER_GO_ON;
 }
@@ -562,6 +2462,10 @@ mod_auth_cookie_plugin_init(plugin *p) {
     p->init             = module_init;
     p->set_defaults     = module_set_defaults;
     p->cleanup          = module_free;
+    p->handle_trigger   = module_trigger;
+    p->connection_reset = module_connection_reset;
+    p->handle_connection_close = module_connection_reset;
+    p->handle_uri_raw   = module_uri_early;
     p->handle_uri_clean = module_uri_handler;
     p->data             = NULL;
 
@@ -0,0 +1,11 @@
+#ifndef _AUTH_COOKIE_MODERN_MD5_H_
+#define _AUTH_COOKIE_MODERN_MD5_H_
+
+//
+// Current lighttpd no longer exports MD5 as md5.h, so the core (and
+// module) take it from OpenSSL instead.
+//
+
+#include <openssl/md5.h>
+
+#endif
@@ -0,0 +1,1964 @@
+//
+// Cookie-based authentication for lighttpd 1.4.64 or later
+//
+// Same as ../mod_auth_cookie.c, but built for current plugin API:
+// per-context config values are precompiled at startup (keys loaded,
+// header names resolved to IDs, group and path lists compiled), and
+// each request just picks them up with config_check_cond().
+//
+// With HTTP/2, many requests (streams) share a single connection,
+// usually carrying the same cookie. Last verdict is kept on the
+// connection, so concurrent streams verify the cookie only once.
+//
+// Token replication, external token store and verification threads
+// depend on fdevent API of 1.4.26, and are not available here.
+//
+
+#include "first.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "base.h"
+#include "plugin.h"
+#include "log.h"
+#include "buffer.h"
+#include "array.h"
+#include "http_header.h"
+#include "http_auth.h"
+
+#include "authcore.h"
+#include "store.h"
+#include "tcache.h"
+#include "cdb.h"
+#include "ptrie.h"
+#include "revoke.h"
+#include "audit.h"
+#include "ustats.h"
+#include "loopguard.h"
+#include "pubtkt.h"
+#include "tkt.h"
+#include "jwt.h"
+#include "base64.h"
+#include "md5.h"
+
+#define LOG(level, ...)                                           \
+    if (pc->loglevel >= level) {                                  \
+        log_error(r->conf.errh, __FILE__, __LINE__, __VA_ARGS__); \
+    }
+
+#define FATAL(...) LOG(0, __VA_ARGS__)
+#define ERROR(...) LOG(1, __VA_ARGS__)
+#define WARN(...)  LOG(2, __VA_ARGS__)
+#define INFO(...)  LOG(3, __VA_ARGS__)
+#define DEBUG(...) LOG(4, __VA_ARGS__)
+
+#define BUF_SLICE(b) AC_SLICE((b)->ptr, buffer_clen(b))
+
+#define EXPIRE_INTERVAL 10 // interval to sweep expired tokens
+#define TICKET_CACHE_MAX 1000000 // max number of verified tickets to cache
+#define GROUP_MAX 64 // max number of groups in require-group rules
+#define USER_STATS_MAX 100000 // max number of users to count requests of
+#define USER_STATS_INTERVAL 60 // interval to publish per-user counters
+#define REDIRECT_WINDOW 60 // window to count redirects to a client in
+
+// page sent instead of redirect once a client is caught in a loop
+#define LOOP_PAGE                                                       \
+    "<!DOCTYPE html>\n"                                                 \
+    "<html><head><title>429 Too Many Requests</title></head>\n"         \
+    "<body><h1>Too Many Requests</h1>\n"                                \
+    "<p>You have been sent to the login page too many times in a "      \
+    "short while. This usually means the login cookie your browser "    \
+    "sends is no longer accepted: please delete cookies of this site, " \
+    "check that your clock is right, and try again in a minute.</p>"    \
+    "</body></html>\n"
+
+/**********************************************************************
+ * data strutures
+ **********************************************************************/
+
+// request header, resolved to ID at startup
+typedef struct {
+    const buffer      *name;
+    enum http_header_e id;
+} header_conf;
+
+// directory attribute to pass as request header
+typedef struct {
+    const buffer *attr;
+    header_conf   header;
+} attr_header;
+
+typedef struct {
+    attr_header *ptr;
+    size_t       used;
+} attr_headers;
+
+// module configuration (values are shared with precompiled cvlist)
+typedef struct {
+    int loglevel;
+    const buffer *name;    // cookie name to extract auth info
+    int override;          // how to handle incoming Auth header
+    const buffer *authurl; // page to go when unauthorized
+    const buffer *key;     // key for cookie verification
+    int timeout;           // life duration of last-stage auth token
+    const buffer *options; // options for last-stage auth token cookie
+
+    EVP_PKEY     *pubtkt_pkey; // public key for mod_auth_pubtkt ticket
+    const EVP_MD *pubtkt_md;   // digest used to sign the ticket
+
+    const buffer *jwt_secret; // shared secret for HS256 JWT
+    EVP_PKEY     *jwt_pkey;   // public key for RS256/EdDSA JWT
+
+    const buffer *tkt_secret;   // shared secret for mod_auth_tkt ticket
+    int           tkt_type;     // digest type of the ticket (AC_TKT_*)
+    unsigned int  tkt_ignore_ip; // do not bind ticket to client address
+
+    const header_conf  *assertion_header; // to pass signed assertion
+    const buffer       *assertion_key;    // key to sign assertion
+
+    const attr_headers *directory_headers; // attributes to pass
+    uint64_t            require_groups;    // bitset of group IDs
+    const ac_ptrie     *exclude;           // paths not to protect
+    unsigned int        scheme_mask;       // cookie schemes to accept
+    ac_audit           *audit;             // audit log (server-wide)
+    ac_loopguard       *loops;             // redirects per client (ditto)
+    const plugin       *self;              // to send LOOP_PAGE as
+    const char         *tenant;            // record in tenant table, if any
+    unsigned char       realm[AC_REALM_LEN]; // ...its realm ID, or zeros
+} plugin_config;
+
+// top-level module structure
+typedef struct {
+    PLUGIN_DATA;
+    plugin_config defaults;
+    plugin_config conf;
+
+    token_store *users;
+    tcache      *tickets;     // verified public-key tickets
+    const buffer *directory;  // CDB file of user attributes
+    ac_cdb       dir;         // ...reloaded when replaced
+    int          dir_failed;  // last reload has failed
+    const buffer *service_tokens; // CDB file of pre-provisioned tokens
+    ac_cdb       services;    // ...reloaded when replaced
+    int          services_failed; // last reload has failed
+    const buffer *tenants_path;   // CDB file of realms by virtual host
+    ac_cdb       tenants;         // ...reloaded when replaced
+    int          tenants_failed;  // last reload has failed
+    buffer      *tenant_name;     // realm of current request's tenant
+    buffer      *tenant_key;
+    buffer      *tenant_authurl;
+    const buffer *audit_log;      // file to record auth events in
+    unsigned int audit_log_size;  // size (in MB) to rotate the file at
+    const buffer *user_stats;     // file to dump per-user counters to
+    ac_ustats   *ustats;          // ...counted here
+    unsigned int redirect_limit;  // max redirects to a client per window
+    unix_time64_t last_stats;     // last time counters were published
+    char        *groups[GROUP_MAX]; // group names, indexed by group ID
+    int          ngroups;
+    const buffer *revoked_users; // file of revoked users
+    ac_revoked  *revoked;        // ...replaced on reload
+    int          revoked_failed; // last reload has failed
+    unsigned char first[256];   // scheme (+1) by first byte of prefix
+    unsigned char next[32];     // other scheme (+1) with same first byte
+    unsigned char fallback;     // scheme (+1) without prefix
+    int          max_timeout; // longest timeout among all contexts
+    unix_time64_t last_expire; // last time expired tokens were swept
+} plugin_data;
+
+// last verdict on a connection, shared by all its streams
+typedef struct {
+    buffer       *cookie;   // cookie value verified
+    plugin_config conf;     // ...in this configuration
+    int           valid;
+    buffer       *authinfo;
+    time_t        expires;
+    buffer       *session;
+    ac_session_cache cache; // assertion and attributes for the verdict
+} verdict;
+
+// verifier of a cookie scheme, given cookie value without the prefix,
+// and (for CACHE_TICKET scheme) hash identifying the ticket
+typedef handler_t (*scheme_verify)(request_st *r, plugin_data *pd,
+                                   plugin_config *pc,
+                                   const char *line, size_t len,
+                                   const unsigned char *hash);
+
+// cookie scheme, recognized by leading bytes of cookie value
+typedef struct {
+    const char   *name;   // as in auth-cookie.schemes
+    const char   *prefix; // leading bytes, or NULL to try if none matched
+    size_t        skip;   // bytes to drop before passing to verifier
+    int           cache;  // CACHE_* policy
+    scheme_verify verify;
+} scheme;
+
+#define CACHE_NONE   0 // verified every time, as it is cheap enough
+#define CACHE_ONCE   1 // used only once to mint a token, never remembered
+#define CACHE_TOKEN  2 // verifier looks it up in token store
+#define CACHE_TICKET 3 // verified once, then found in ticket cache
+
+/**********************************************************************
+ * supporting functions
+ **********************************************************************/
+
+static void
+merge_config_cpv(plugin_config *pconf, const config_plugin_value_t *cpv) {
+    switch (cpv->k_id) {
+    case 0:  pconf->loglevel = (int)cpv->v.u; break;
+    case 1:  pconf->name = cpv->v.b; break;
+    case 2:  pconf->override = (int)cpv->v.u; break;
+    case 3:  pconf->authurl = cpv->v.b; break;
+    case 4:  pconf->key = cpv->v.b; break;
+    case 5:  pconf->timeout = (int)cpv->v.u; break;
+    case 6:  pconf->options = cpv->v.b; break;
+    case 7:  pconf->pubtkt_pkey = cpv->v.v; break;
+    case 8:  pconf->pubtkt_md = cpv->v.v; break;
+    case 9:  pconf->tkt_secret = cpv->v.b; break;
+    case 10: pconf->tkt_type = (int)cpv->v.u; break;
+    case 11: pconf->tkt_ignore_ip = cpv->v.u; break;
+    case 12: pconf->jwt_secret = cpv->v.b; break;
+    case 13: pconf->jwt_pkey = cpv->v.v; break;
+    case 14: pconf->assertion_header = cpv->v.v; break;
+    case 15: pconf->assertion_key = cpv->v.b; break;
+    case 16: break; // directory (server-wide)
+    case 17: pconf->directory_headers = cpv->v.v; break;
+    case 18: pconf->require_groups = *(const uint64_t *)cpv->v.v; break;
+    case 19: pconf->exclude = cpv->v.v; break;
+    case 20: pconf->scheme_mask = cpv->v.u; break;
+    case 21: break; // revoked-users (server-wide)
+    case 22: break; // service-tokens (server-wide)
+    case 23: break; // audit-log (server-wide)
+    case 24: break; // audit-log-size (server-wide)
+    case 25: break; // user-stats (server-wide)
+    case 26: break; // redirect-limit (server-wide)
+    case 27: break; // tenants (server-wide)
+    }
+}
+
+static void
+merge_config(plugin_config *pconf, const config_plugin_value_t *cpv) {
+    do {
+        merge_config_cpv(pconf, cpv);
+    } while ((++cpv)->k_id != -1);
+}
+
+//
+// helper to generate "configuration in current context".
+//
+static plugin_config *
+patch_config(request_st *r, plugin_data *pd) {
+    int i;
+
+    // copied as a whole (padding included), to compare with verdict
+    memcpy(&pd->conf, &pd->defaults, sizeof(pd->conf));
+    for (i = 1; i < pd->nconfig; i++) {
+        if (config_check_cond(r, (uint32_t)pd->cvlist[i].k_id)) {
+            merge_config(&pd->conf, pd->cvlist + pd->cvlist[i].v.u2[0]);
+        }
+    }
+    return &pd->conf;
+}
+
+//
+// fills (appends) given buffer with "current" URL.
+//
+static buffer *
+self_url(request_st *r, buffer *url, buffer_encoding_t enc) {
+    buffer_append_string_encoded(url, BUF_PTR_LEN(&r->uri.scheme), enc);
+    buffer_append_string_encoded(url, CONST_STR_LEN("://"), enc);
+    buffer_append_string_encoded(url, BUF_PTR_LEN(&r->uri.authority), enc);
+    buffer_append_string_encoded(url, BUF_PTR_LEN(&r->target), enc);
+    return url;
+}
+
+//
+// Find counters of the user of given session, if accounting is enabled.
+// Once found, it is kept in given cache (if any) for the session.
+//
+static ac_user_stats *
+user_stats(plugin_data *pd, ac_session_cache *cache,
+           const char *authinfo, size_t authinfo_len) {
+    char user[AC_USER_MAX];
+    ac_user_stats *st;
+    size_t len;
+
+    if (! pd->ustats) return NULL;
+    if (cache && cache->stats) return cache->stats;
+
+    if (ac_authinfo_user(AC_SLICE(authinfo, authinfo_len),
+                         user, &len) != AC_OK) {
+        return NULL;
+    }
+    st = ac_ustats_get(pd->ustats, AC_SLICE(user, len));
+    if (cache) cache->stats = st;
+    return st;
+}
+
+//
+// Record auth event of the client, if audit log is enabled.
+//
+static void
+audit(request_st *r, plugin_config *pc,
+      const char *event, ac_slice user, const char *detail) {
+    if (! pc->audit) return;
+
+    ac_audit_log(pc->audit, log_epoch_secs, event, user,
+                 BUF_SLICE(r->dst_addr_buf), AC_STR(detail));
+}
+
+//
+// Record event on a session given by authinfo, of the client (if any).
+//
+static void
+audit_authinfo(ac_audit *a, request_st *r, const char *event,
+               const char *authinfo, size_t authinfo_len, const char *detail) {
+    char user[AC_USER_MAX];
+    size_t len;
+
+    if (! a) return;
+    if (ac_authinfo_user(AC_SLICE(authinfo, authinfo_len),
+                         user, &len) != AC_OK) {
+        len = 0;
+    }
+    ac_audit_log(a, log_epoch_secs, event, AC_SLICE(user, len),
+                 r ? BUF_SLICE(r->dst_addr_buf) : AC_SLICE("", 0),
+                 AC_STR(detail));
+}
+
+//
+// Check if request carries <AuthName> cookie (which is being rejected,
+// when asked by endauth).
+//
+static int
+has_cookie(request_st *r, plugin_config *pc) {
+    const buffer *b = http_header_request_get(r, HTTP_HEADER_COOKIE,
+                                              CONST_STR_LEN("Cookie"));
+    ac_slice cv;
+
+    return b && ac_cookie_find(BUF_SLICE(b),
+                               BUF_SLICE(pc->name), &cv) == AC_OK;
+}
+
+//
+// Generates appropriate response depending on policy.
+//
+static handler_t
+endauth(request_st *r, plugin_config *pc) {
+    buffer *url;
+
+    // pass through if no redirect target is specified, unless only
+    // members of some group may pass, which anonymous user is not
+    if (! pc->authurl) {
+        if (pc->require_groups) {
+            INFO("%s", "no session for require-group - denying");
+            audit(r, pc, "deny", AC_SLICE("", 0), "require-group");
+            r->http_status = 403;
+            r->handler_module = NULL;
+            return HANDLER_FINISHED;
+        }
+        DEBUG("%s", "endauth - continuing");
+        return HANDLER_GO_ON;
+    }
+
+    // client keeps coming back with cookie we reject - stop bouncing it
+    if (pc->loops && has_cookie(r, pc) &&
+        ac_loopguard_hit(pc->loops, BUF_SLICE(r->dst_addr_buf),
+                         log_epoch_secs)) {
+        char retry[16];
+
+        INFO("redirect loop detected: %s", r->dst_addr_buf->ptr);
+        audit(r, pc, "loop", AC_SLICE("", 0), r->uri.path.ptr);
+
+        // tell why, rather than leave browser with blank page
+        http_header_response_set(r, HTTP_HEADER_CONTENT_TYPE,
+                                 CONST_STR_LEN("Content-Type"),
+                                 CONST_STR_LEN("text/html; charset=utf-8"));
+        snprintf(retry, sizeof(retry), "%d", REDIRECT_WINDOW);
+        http_header_response_set(r, HTTP_HEADER_OTHER,
+                                 CONST_STR_LEN("Retry-After"),
+                                 retry, strlen(retry));
+        http_header_response_set(r, HTTP_HEADER_CACHE_CONTROL,
+                                 CONST_STR_LEN("Cache-Control"),
+                                 CONST_STR_LEN("no-store"));
+        chunkqueue_append_mem(&r->write_queue, CONST_STR_LEN(LOOP_PAGE));
+        r->http_status = 429;
+        r->resp_body_finished = 1;
+        r->handler_module = pc->self;
+        return HANDLER_FINISHED;
+    }
+    DEBUG("endauth - redirecting: %s", pc->authurl->ptr);
+    audit(r, pc, "redirect", AC_SLICE("", 0), r->uri.path.ptr);
+
+    // prepare redirection header
+    url = buffer_init();
+    buffer_copy_buffer(url, pc->authurl);
+    buffer_append_string(url, strchr(url->ptr, '?') ? "&url=" : "?url=");
+    self_url(r, url, ENCODING_REL_URI);
+    http_header_response_set(r, HTTP_HEADER_LOCATION,
+                             CONST_STR_LEN("Location"), BUF_PTR_LEN(url));
+    buffer_free(url);
+
+    r->http_status = 307;
+    r->handler_module = NULL;
+    return HANDLER_FINISHED;
+}
+
+//
+// update REMOTE_USER field using (verified) authinfo.
+//
+static void
+set_user(request_st *r, plugin_config *pc,
+         const char *authinfo, size_t authinfo_len) {
+    char user[AC_USER_MAX];
+    size_t len;
+
+    if (ac_authinfo_user(AC_SLICE(authinfo, authinfo_len),
+                         user, &len) != AC_OK) {
+        WARN("%s", "cannot find username in authinfo");
+        return;
+    }
+    DEBUG("identified user: %s", user);
+    http_auth_setenv(r, user, len, CONST_STR_LEN("Cookie"));
+}
+
+//
+// Pass signed identity assertion to backends, if configured.
+// Once built, it is kept in given cache (if any) for the session,
+// so it is signed only once.
+//
+static void
+add_assertion(request_st *r, plugin_config *pc,
+              const char *authinfo, size_t authinfo_len,
+              time_t expires, ac_slice session, ac_session_cache *cache) {
+    char buf[AC_ASSERTION_MAX], user[AC_USER_MAX];
+    unsigned char sid[AC_MD5_LEN];
+    const char *assertion = buf;
+    size_t len, user_len;
+    MD5_CTX ctx;
+
+    if (! pc->assertion_header) return;
+    if (! pc->assertion_key) {
+        WARN("%s", "auth-cookie.assertion-key is not set");
+        return;
+    }
+
+    if (cache && cache->assertion &&
+        cache->assertion_key == pc->assertion_key) {
+        assertion = cache->assertion;
+        len = cache->assertion_len;
+    } else {
+        // session ID must not reveal the session credential itself
+        MD5_Init(&ctx);
+        MD5_Update(&ctx, session.ptr, session.len);
+        MD5_Final(sid, &ctx);
+
+        if (ac_authinfo_user(AC_SLICE(authinfo, authinfo_len),
+                             user, &user_len) != AC_OK ||
+            ac_assertion_make(BUF_SLICE(pc->assertion_key),
+                              AC_SLICE(user, user_len),
+                              expires, sid, buf, &len) != AC_OK) {
+            WARN("%s", "cannot build identity assertion");
+            return;
+        }
+        DEBUG("signed identity assertion: %s", buf);
+
+        char *copy = cache ? malloc(len) : NULL;
+        if (copy) {
+            memcpy(copy, buf, len);
+            free(cache->assertion);
+            cache->assertion     = copy;
+            cache->assertion_len = len;
+            cache->assertion_key = pc->assertion_key;
+        }
+    }
+    http_header_request_set(r, pc->assertion_header->id,
+                            BUF_PTR_LEN(pc->assertion_header->name),
+                            assertion, len);
+}
+
+//
+// Turn "groups" attribute of user record (comma-separated group names)
+// into bitset of group IDs. Groups not used in any rule are ignored.
+//
+static uint64_t
+user_groups(plugin_data *pd, ac_slice rec) {
+    const char *p, *end, *next;
+    uint64_t groups = 0;
+    ac_slice val;
+    int i;
+
+    if (ac_cdb_attr(rec, AC_STR("groups"), &val) != AC_OK) return 0;
+
+    for (p = val.ptr, end = val.ptr + val.len; p < end; p = next + 1) {
+        const char *e;
+
+        if ((next = memchr(p, ',', end - p)) == NULL) next = end;
+        for (e = next; e > p && e[-1] == ' '; e--);
+        while (p < e && *p == ' ') p++;
+
+        for (i = 0; i < pd->ngroups; i++) {
+            if (strlen(pd->groups[i]) == (size_t)(e - p) &&
+                memcmp(pd->groups[i], p, e - p) == 0) {
+                groups |= (uint64_t)1 << i;
+                break;
+            }
+        }
+    }
+    return groups;
+}
+
+//
+// Look up authenticated user in directory, pass attributes found as
+// request headers, and check group membership. Record found (or not)
+// is kept in given cache (if any) until directory is replaced.
+//
+static handler_t
+apply_directory(request_st *r, plugin_data *pd,
+                plugin_config *pc, ac_session_cache *cache) {
+    ac_session_cache tmp;
+    ac_slice val;
+    size_t i;
+
+    if (! cache) {
+        memset(&tmp, 0, sizeof(tmp));
+        cache = &tmp;
+    }
+    if (cache->attrs_gen != pd->dir.gen) {
+        const buffer *user = http_header_env_get(r, CONST_STR_LEN("REMOTE_USER"));
+
+        cache->attrs_gen = pd->dir.gen;
+        if (! user || ac_cdb_find(&pd->dir, BUF_SLICE(user),
+                                  &cache->attrs) != AC_OK) {
+            DEBUG("%s", "user not found in directory");
+            cache->attrs = AC_SLICE(NULL, 0);
+        }
+        cache->groups = user_groups(pd, cache->attrs);
+    }
+
+    for (i = 0; pc->directory_headers && i < pc->directory_headers->used; i++) {
+        const attr_header *ah = &pc->directory_headers->ptr[i];
+
+        if (ac_cdb_attr(cache->attrs, BUF_SLICE(ah->attr), &val) == AC_OK) {
+            http_header_request_set(r, ah->header.id,
+                                    BUF_PTR_LEN(ah->header.name),
+                                    val.ptr, val.len);
+        }
+    }
+
+    if (pc->require_groups && ! (cache->groups & pc->require_groups)) {
+        const buffer *user = http_header_env_get(r, CONST_STR_LEN("REMOTE_USER"));
+
+        INFO("%s", "user not in required group");
+        audit(r, pc, "deny", user ? BUF_SLICE(user) : AC_SLICE("", 0),
+              "require-group");
+        r->http_status = 403;
+        r->handler_module = NULL;
+        return HANDLER_FINISHED;
+    }
+    return HANDLER_GO_ON;
+}
+
+//
+// Remember authinfo as verdict on the cookie being checked, so other
+// requests (streams) on the same connection can skip verification.
+//
+static void
+verdict_set(request_st *r, plugin_data *pd, plugin_config *pc,
+            const char *authinfo, size_t authinfo_len,
+            time_t expires, ac_slice session) {
+    verdict *vc = r->con->plugin_ctx[pd->id];
+
+    if (! vc || vc->valid) return;
+
+    memcpy(&vc->conf, pc, sizeof(vc->conf));
+    vc->valid   = 1;
+    vc->expires = expires;
+    buffer_copy_string_len(vc->authinfo, authinfo, authinfo_len);
+    buffer_copy_string_len(vc->session, session.ptr, session.len);
+}
+
+//
+// Check if authinfo belongs to revoked user.
+//
+static int
+authinfo_revoked(plugin_data *pd, const char *authinfo, size_t authinfo_len) {
+    char user[AC_USER_MAX];
+    size_t len;
+
+    if (! pd->revoked) return 0;
+    if (ac_authinfo_user(AC_SLICE(authinfo, authinfo_len),
+                         user, &len) != AC_OK) {
+        return 0;
+    }
+    return ac_revoked_has(pd->revoked, AC_SLICE(user, len));
+}
+
+//
+// Inject verified authinfo as BasicAuth header, along with assertion
+// and directory attributes
+//
+static handler_t
+accept_authinfo(request_st *r, plugin_data *pd, plugin_config *pc,
+                const char *authinfo, size_t authinfo_len,
+                time_t expires, ac_slice session, ac_session_cache *cache) {
+    char field[sizeof("Basic ") - 1 + AC_AUTHINFO_MAX];
+    ac_user_stats *st;
+
+    if (authinfo_len > AC_AUTHINFO_MAX) {
+        WARN("%s", "authinfo too long");
+        return endauth(r, pc);
+    }
+    st = user_stats(pd, cache, authinfo, authinfo_len);
+    if (authinfo_revoked(pd, authinfo, authinfo_len)) {
+        INFO("%s", "session of revoked user");
+        audit_authinfo(pc->audit, r, "reject", authinfo, authinfo_len,
+                       "revoked");
+        if (st) st->redirects++;
+        return endauth(r, pc);
+    }
+    if (st) {
+        st->requests++;
+        st->last_seen = log_epoch_secs;
+    }
+    memcpy(field, "Basic ", sizeof("Basic ") - 1);
+    memcpy(field + sizeof("Basic ") - 1, authinfo, authinfo_len);
+    http_header_request_set(r, HTTP_HEADER_AUTHORIZATION,
+                            CONST_STR_LEN("Authorization"),
+                            field, sizeof("Basic ") - 1 + authinfo_len);
+
+    verdict_set(r, pd, pc, authinfo, authinfo_len, expires, session);
+    add_assertion(r, pc, authinfo, authinfo_len, expires, session, cache);
+    set_user(r, pc, authinfo, authinfo_len);
+
+    // session got through, so earlier redirects were no loop
+    if (pc->loops) ac_loopguard_reset(pc->loops, BUF_SLICE(r->dst_addr_buf));
+
+    DEBUG("%s", "all check passed");
+    return apply_directory(r, pd, pc, cache);
+}
+
+//
+// update header using (verified) authentication info.
+//
+static handler_t
+update_header(request_st *r, plugin_data *pd, plugin_config *pc,
+              const char *authinfo, size_t authinfo_len) {
+    char token[TOKEN_LEN + 1];
+    time_t now = log_epoch_secs;
+    token_entry *te;
+    ac_user_stats *st;
+    buffer *field;
+
+    // generate random token and relate it with authinfo
+    if (ac_token_gen(token, TOKEN_LEN) != 0) {
+        log_error(r->conf.errh, __FILE__, __LINE__, "%s",
+                  "cannot read /dev/urandom, no token issued");
+        r->http_status = 500;
+        r->handler_module = NULL;
+        return HANDLER_FINISHED;
+    }
+    DEBUG("pairing authinfo with token: %s", token);
+    te = token_store_put(pd->users, token, TOKEN_LEN,
+                         now, pc->realm, authinfo, authinfo_len);
+    audit_authinfo(pc->audit, r, "login", authinfo, authinfo_len, "crypt");
+    audit_authinfo(pc->audit, r, "mint", authinfo, authinfo_len, "token");
+    if ((st = user_stats(pd, te ? &te->cache : NULL,
+                         authinfo, authinfo_len)) != NULL) {
+        st->mints++;
+    }
+
+    // insert opaque auth token
+    field = buffer_init();
+    buffer_copy_buffer(field, pc->name);
+    buffer_append_string(field, "=token:");
+    buffer_append_string(field, token);
+    if (pc->options) {
+        buffer_append_string(field, "; ");
+        buffer_append_string_buffer(field, pc->options);
+    }
+    DEBUG("generating token cookie: %s", field->ptr);
+    http_header_response_insert(r, HTTP_HEADER_SET_COOKIE,
+                                CONST_STR_LEN("Set-Cookie"),
+                                BUF_PTR_LEN(field));
+    buffer_free(field);
+
+    return accept_authinfo(r, pd, pc, authinfo, authinfo_len,
+                           now + pc->timeout, AC_SLICE(token, TOKEN_LEN),
+                           te ? &te->cache : NULL);
+}
+
+//
+// Accept pre-provisioned service token, found in service token table
+// with a record of "name=value" lines:
+//
+//   user=<user>
+//   expires=<time>  (optional)
+//   realm=<realm name>  (required with tenant table)
+//
+// Token is only taken in its realm, named as in tenant table.
+//
+static handler_t
+accept_service(request_st *r, plugin_data *pd, plugin_config *pc,
+               const char *token, size_t len, ac_slice rec) {
+    char authinfo[AC_AUTHINFO_MAX];
+    size_t authinfo_len, i;
+    time_t now = log_epoch_secs, expires = now + pc->timeout;
+    unsigned char realm[AC_REALM_LEN];
+    ac_slice user, val;
+
+    if (ac_cdb_attr(rec, AC_STR("user"), &user) != AC_OK ||
+        ac_user_authinfo(user, authinfo, &authinfo_len) != AC_OK) {
+        WARN("%s", "malformed service token record");
+        return endauth(r, pc);
+    }
+    if (ac_cdb_attr(rec, AC_STR("realm"), &val) != AC_OK) {
+        if (pd->tenants_path) {
+            WARN("%s", "service token without realm - rejecting");
+            return endauth(r, pc);
+        }
+        val = AC_SLICE("", 0);
+    }
+    ac_realm_id(val, realm);
+    if (! ac_realm_equal(realm, pc->realm)) {
+        DEBUG("%s", "service token belongs to another realm");
+        return endauth(r, pc);
+    }
+    if (ac_cdb_attr(rec, AC_STR("expires"), &val) == AC_OK) {
+        for (expires = 0, i = 0; i < val.len; i++) {
+            if (val.ptr[i] < '0' || val.ptr[i] > '9') break;
+            expires = expires * 10 + (val.ptr[i] - '0');
+        }
+        if (expires < now) {
+            DEBUG("%s", "service token expired");
+            return endauth(r, pc);
+        }
+    }
+    DEBUG("%s", "found service token");
+
+    return accept_authinfo(r, pd, pc, authinfo, authinfo_len,
+                           expires, AC_SLICE(token, len), NULL);
+}
+
+//
+// Handle token given in cookie.
+//
+// Expected Cookie Format:
+//   <name>=token:<random-token-to-be-verified>
+//
+static handler_t
+handle_token(request_st *r, plugin_data *pd, plugin_config *pc,
+             const char *token, size_t len, const unsigned char *hash) {
+    token_entry *entry;
+    ac_slice rec;
+
+    UNUSED(hash);
+
+    // pre-provisioned service tokens first
+    if (pd->services.map &&
+        ac_cdb_find(&pd->services, AC_SLICE(token, len), &rec) == AC_OK) {
+        return accept_service(r, pd, pc, token, len, rec);
+    }
+
+    if ((entry = token_store_get(pd->users, token, len)) == NULL) {
+        return endauth(r, pc);
+    }
+    if (! ac_realm_equal(entry->realm, pc->realm)) {
+        DEBUG("%s", "token belongs to another realm");
+        return endauth(r, pc);
+    }
+
+    DEBUG("found token entry: %s", entry->authinfo);
+    if (log_epoch_secs - entry->issued > pc->timeout) {
+        ac_user_stats *st = user_stats(pd, &entry->cache, entry->authinfo,
+                                       entry->authinfo_len);
+        if (st) st->redirects++;
+        return endauth(r, pc);
+    }
+
+    return accept_authinfo(r, pd, pc, entry->authinfo, entry->authinfo_len,
+                           entry->issued + pc->timeout, AC_STR(token),
+                           &entry->cache);
+}
+
+//
+// Check for redirected auth request in cookie.
+//
+// Expected Cookie Format:
+//   <name>=crypt:<hash>:<data>
+//
+// See ac_crypt_verify() for details.
+//
+static handler_t
+handle_crypt(request_st *r, plugin_data *pd, plugin_config *pc,
+             const char *line, size_t len, const unsigned char *hash) {
+    char authinfo[AC_AUTHINFO_MAX];
+    size_t authinfo_len;
+
+    UNUSED(hash);
+
+    DEBUG("%s", "verifying crypt cookie...");
+
+    if (! pc->key) return endauth(r, pc);
+
+    switch (ac_crypt_verify(BUF_SLICE(pc->key), AC_SLICE(line, len),
+                            log_epoch_secs, authinfo, &authinfo_len)) {
+    case AC_OK:
+        break;
+    case AC_EEXPIRED:
+        DEBUG("%s", "timeout detected");
+        return endauth(r, pc);
+    case AC_EDECRYPT:
+        WARN("%s", "decryption error");
+        return endauth(r, pc);
+    default:
+        DEBUG("%s", "malformed crypt cookie");
+        return endauth(r, pc);
+    }
+    DEBUG("%s", "timeout check passed");
+
+    // never mint token for revoked user
+    if (authinfo_revoked(pd, authinfo, authinfo_len)) {
+        INFO("%s", "crypt cookie of revoked user");
+        audit_authinfo(pc->audit, r, "reject", authinfo, authinfo_len,
+                       "revoked");
+        return endauth(r, pc);
+    }
+
+    return update_header(r, pd, pc, authinfo, authinfo_len);
+}
+
+//
+// Accept ticket found in (or just put into) ticket cache, unless it is
+// bound to other client address.
+//
+static handler_t
+accept_ticket(request_st *r, plugin_data *pd, plugin_config *pc,
+              tcache_entry *e, const unsigned char *hash) {
+    if (e->bind[0] && strcmp(e->bind, r->dst_addr_buf->ptr) != 0) {
+        ac_user_stats *st = user_stats(pd, &e->cache,
+                                       e->authinfo, e->authinfo_len);
+        DEBUG("ticket is bound to other address: %s", e->bind);
+        if (st) st->redirects++;
+        return endauth(r, pc);
+    }
+    return accept_authinfo(r, pd, pc, e->authinfo, e->authinfo_len,
+                           e->expires, AC_SLICE((const char *)hash, AC_MD5_LEN),
+                           &e->cache);
+}
+
+//
+// Check for mod_auth_pubtkt compatible ticket in cookie.
+//
+// Expected Cookie Format:
+//   <name>=uid=<user>;...;validuntil=<time>;...;sig=<signature>
+//
+// This is called only when the ticket is not found in ticket cache.
+// Once verified, it is cached until the ticket expires. See pubtkt.c
+// for details.
+//
+static handler_t
+handle_pubtkt(request_st *r, plugin_data *pd, plugin_config *pc,
+              const char *line, size_t len, const unsigned char *hash) {
+    char authinfo[AC_AUTHINFO_MAX];
+    size_t authinfo_len;
+    time_t now = log_epoch_secs;
+    tcache_entry *e;
+    ac_pubtkt t;
+
+    if (! pc->pubtkt_pkey) {
+        DEBUG("%s", "pubtkt ticket given, but no key to verify it");
+        return endauth(r, pc);
+    }
+    DEBUG("%s", "verifying pubtkt ticket...");
+
+    if (ac_pubtkt_parse(AC_SLICE(line, len), &t) != AC_OK ||
+        ac_user_authinfo(t.uid, authinfo, &authinfo_len) != AC_OK) {
+        DEBUG("%s", "malformed pubtkt ticket");
+        return endauth(r, pc);
+    }
+    if (t.validuntil < now) {
+        DEBUG("%s", "timeout detected");
+        return endauth(r, pc);
+    }
+    if (ac_pubtkt_verify(&t, pc->pubtkt_pkey,
+                         pc->pubtkt_md ? pc->pubtkt_md
+                                       : EVP_sha1()) != AC_OK) {
+        WARN("%s", "pubtkt signature mismatch");
+        return endauth(r, pc);
+    }
+    audit(r, pc, "login", t.uid, "pubtkt");
+
+    e = tcache_put(pd->tickets, hash, pc->realm, t.validuntil,
+                   AC_SLICE(authinfo, authinfo_len), t.cip);
+    if (! e) {
+        // cache is full - accept without remembering it
+        if (t.cip.len && ! buffer_eq_slen(r->dst_addr_buf,
+                                          t.cip.ptr, t.cip.len)) {
+            return endauth(r, pc);
+        }
+        return accept_authinfo(r, pd, pc, authinfo, authinfo_len,
+                               t.validuntil, AC_SLICE((const char *)hash,
+                                                      AC_MD5_LEN), NULL);
+    }
+    return accept_ticket(r, pd, pc, e, hash);
+}
+
+//
+// Check for JSON Web Token in cookie.
+//
+// Expected Cookie Format:
+//   <name>=<header>.<payload>.<signature>
+//
+// As with pubtkt ticket, this is called only when the token is not
+// found in ticket cache, and the subject is cached until the token
+// expires. See jwt.c for details.
+//
+static handler_t
+handle_jwt(request_st *r, plugin_data *pd, plugin_config *pc,
+           const char *line, size_t len, const unsigned char *hash) {
+    ac_slice secret = pc->jwt_secret ? BUF_SLICE(pc->jwt_secret)
+                                     : AC_SLICE("", 0);
+    char authinfo[AC_AUTHINFO_MAX];
+    size_t authinfo_len;
+    time_t now = log_epoch_secs, expires;
+    tcache_entry *e;
+    ac_jwt t;
+
+    if (! secret.len && ! pc->jwt_pkey) {
+        DEBUG("%s", "JWT given, but no key to verify it");
+        return endauth(r, pc);
+    }
+    DEBUG("%s", "verifying JWT...");
+
+    if (ac_jwt_parse(AC_SLICE(line, len), &t) != AC_OK ||
+        ac_user_authinfo(AC_SLICE(t.sub, t.sub_len),
+                         authinfo, &authinfo_len) != AC_OK) {
+        DEBUG("%s", "malformed JWT");
+        return endauth(r, pc);
+    }
+    if ((t.exp && t.exp < now) || t.nbf > now) {
+        DEBUG("%s", "timeout detected");
+        return endauth(r, pc);
+    }
+    if (ac_jwt_verify(&t, secret, pc->jwt_pkey) != AC_OK) {
+        WARN("%s", "JWT signature mismatch");
+        return endauth(r, pc);
+    }
+    audit(r, pc, "login", AC_SLICE(t.sub, t.sub_len), "jwt");
+
+    // token without expiry is trusted as long as our own token
+    expires = t.exp ? t.exp : now + pc->timeout;
+    e = tcache_put(pd->tickets, hash, pc->realm, expires,
+                   AC_SLICE(authinfo, authinfo_len), AC_SLICE("", 0));
+    if (! e) {
+        // cache is full - accept without remembering it
+        return accept_authinfo(r, pd, pc, authinfo, authinfo_len,
+                               expires, AC_SLICE((const char *)hash,
+                                                 AC_MD5_LEN), NULL);
+    }
+    return accept_ticket(r, pd, pc, e, hash);
+}
+
+//
+// Check for mod_auth_tkt compatible ticket in cookie.
+//
+// Expected Cookie Format:
+//   <name>=<digest><ts><uid>!<tokens>!<udata>
+//
+// Ticket may also be base64-encoded, as most ticket generators do.
+// See tkt.c for details.
+//
+static handler_t
+handle_tkt(request_st *r, plugin_data *pd, plugin_config *pc,
+           const char *line, size_t len, const unsigned char *hash) {
+    unsigned char buf[BASE64_DECODED_MAX(AC_COOKIE_MAX)];
+    unsigned char ip[4] = { 0, 0, 0, 0 };
+    char authinfo[AC_AUTHINFO_MAX];
+    size_t authinfo_len;
+    ac_tkt t;
+    int rc;
+
+    UNUSED(hash);
+
+    if (! pc->tkt_secret) {
+        DEBUG("unrecognied cookie auth format: %s", line);
+        return endauth(r, pc);
+    }
+
+    // raw ticket always has "!" after uid
+    if (! memchr(line, '!', len)) {
+        int n;
+
+        if ((n = base64_decode(buf, line, len)) < 0) {
+            DEBUG("%s", "malformed tkt ticket");
+            return endauth(r, pc);
+        }
+        line = (const char *)buf;
+        len  = n;
+    }
+
+    // mod_auth_tkt only knows IPv4 address
+    if (! pc->tkt_ignore_ip && r->dst_addr->plain.sa_family == AF_INET) {
+        memcpy(ip, &r->dst_addr->ipv4.sin_addr.s_addr, sizeof(ip));
+    }
+
+    rc = ac_tkt_verify(BUF_SLICE(pc->tkt_secret), AC_SLICE(line, len),
+                       ip, pc->tkt_type, &t);
+    if (rc != AC_OK) {
+        DEBUG("tkt ticket verification failed: %d", rc);
+        return endauth(r, pc);
+    }
+    if (log_epoch_secs - t.ts > pc->timeout) {
+        DEBUG("%s", "timeout detected");
+        return endauth(r, pc);
+    }
+
+    if (ac_user_authinfo(t.uid, authinfo, &authinfo_len) != AC_OK) {
+        DEBUG("%s", "username too long");
+        return endauth(r, pc);
+    }
+    return accept_authinfo(r, pd, pc, authinfo, authinfo_len,
+                           t.ts + pc->timeout, AC_SLICE(line, len), NULL);
+}
+
+//
+// All cookie schemes known. Each is recognized by its prefix, and
+// handled by its verifier with given cache policy.
+//
+static const scheme schemes[] = {
+    { "token",  "token:", 6, CACHE_TOKEN,  handle_token },
+    { "crypt",  "crypt:", 6, CACHE_ONCE,   handle_crypt },
+    { "pubtkt", "uid=",   0, CACHE_TICKET, handle_pubtkt },
+    { "jwt",    "eyJ",    0, CACHE_TICKET, handle_jwt },
+    { "tkt",    NULL,     0, CACHE_NONE,   handle_tkt },
+};
+
+#define SCHEME_COUNT (sizeof(schemes) / sizeof(schemes[0]))
+#define SCHEME_ALL   ((1U << SCHEME_COUNT) - 1)
+
+//
+// Index schemes by first byte of their prefixes, so a cookie value is
+// dispatched by one table lookup (and one prefix comparison, unless
+// some prefixes share the same first byte).
+//
+static void
+index_schemes(plugin_data *pd) {
+    size_t i;
+
+    for (i = SCHEME_COUNT; i-- > 0;) {
+        if (schemes[i].prefix) {
+            unsigned char c = schemes[i].prefix[0];
+            pd->next[i]  = pd->first[c];
+            pd->first[c] = i + 1;
+        } else {
+            pd->fallback = i + 1;
+        }
+    }
+}
+
+static const scheme *
+find_scheme(plugin_data *pd, const char *cs, size_t len) {
+    unsigned char n;
+
+    for (n = pd->first[(unsigned char)cs[0]]; n; n = pd->next[n - 1]) {
+        const scheme *sc = &schemes[n - 1];
+        size_t plen = strlen(sc->prefix);
+
+        if (len >= plen && memcmp(cs, sc->prefix, plen) == 0) return sc;
+    }
+    return pd->fallback ? &schemes[pd->fallback - 1] : NULL;
+}
+
+//
+// Hash identifying a ticket verified with keys of current context
+// (as other context may use other keys) in realm of current tenant.
+//
+static void
+ticket_hash(plugin_config *pc, const scheme *sc,
+            const char *line, size_t len, unsigned char *hash) {
+    MD5_CTX ctx;
+
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, sc->name, strlen(sc->name) + 1);
+    MD5_Update(&ctx, &pc->pubtkt_pkey, sizeof(pc->pubtkt_pkey));
+    MD5_Update(&ctx, &pc->pubtkt_md, sizeof(pc->pubtkt_md));
+    MD5_Update(&ctx, &pc->jwt_pkey, sizeof(pc->jwt_pkey));
+    if (pc->jwt_secret) MD5_Update(&ctx, BUF_PTR_LEN(pc->jwt_secret));
+    MD5_Update(&ctx, "", 1);
+    MD5_Update(&ctx, pc->realm, AC_REALM_LEN);
+    MD5_Update(&ctx, line, len);
+    MD5_Final(hash, &ctx);
+}
+
+//
+// Pass cookie value to the verifier of its scheme, if enabled in
+// current context. Ticket already verified is accepted from ticket
+// cache, without calling the verifier.
+//
+static handler_t
+dispatch(request_st *r, plugin_data *pd, plugin_config *pc,
+         const char *cs, size_t len) {
+    const scheme *sc = find_scheme(pd, cs, len);
+    unsigned char hash[AC_MD5_LEN];
+    verdict *vc = r->con->plugin_ctx[pd->id];
+    tcache_entry *e;
+
+    if (! sc || ! (pc->scheme_mask & 1U << (sc - schemes))) {
+        DEBUG("unrecognied cookie auth format: %s", cs);
+        return endauth(r, pc);
+    }
+    cs  += sc->skip;
+    len -= sc->skip;
+
+    // cookie used only once is not worth a verdict
+    if (vc && sc->cache == CACHE_ONCE) vc->valid = -1;
+
+    if (sc->cache != CACHE_TICKET) {
+        return sc->verify(r, pd, pc, cs, len, NULL);
+    }
+
+    ticket_hash(pc, sc, cs, len, hash);
+    if ((e = tcache_get(pd->tickets, hash, pc->realm,
+                        log_epoch_secs)) != NULL) {
+        return accept_ticket(r, pd, pc, e, hash);
+    }
+    return sc->verify(r, pd, pc, cs, len, hash);
+}
+
+static verdict *
+verdict_init(void) {
+    verdict *vc = calloc(1, sizeof(*vc));
+
+    vc->cookie   = buffer_init();
+    vc->authinfo = buffer_init();
+    vc->session  = buffer_init();
+    return vc;
+}
+
+static void
+verdict_free(verdict *vc) {
+    buffer_free(vc->cookie);
+    buffer_free(vc->authinfo);
+    buffer_free(vc->session);
+    free(vc->cache.assertion);
+    free(vc);
+}
+
+//
+// Find verdict on given cookie made earlier on this connection. If not
+// found, start a new one, to be filled once the cookie is verified.
+//
+static verdict *
+verdict_get(request_st *r, plugin_data *pd, plugin_config *pc,
+            const char *cookie, size_t len) {
+    verdict *vc = r->con->plugin_ctx[pd->id];
+
+    if (! vc) vc = r->con->plugin_ctx[pd->id] = verdict_init();
+
+    if (vc->valid > 0 && vc->expires >= log_epoch_secs &&
+        buffer_eq_slen(vc->cookie, cookie, len) &&
+        memcmp(&vc->conf, pc, sizeof(*pc)) == 0) {
+        return vc;
+    }
+
+    buffer_copy_string_len(vc->cookie, cookie, len);
+    vc->valid = 0;
+    free(vc->cache.assertion);
+    memset(&vc->cache, 0, sizeof(vc->cache));
+    return NULL;
+}
+
+//
+// Give each group in require-group rule an ID (shared by all contexts),
+// and turn the rule into bitset of them.
+//
+static uint64_t *
+compile_groups(server *srv, plugin_data *pd, const array *a) {
+    uint64_t *groups = calloc(1, sizeof(*groups));
+    uint32_t i;
+    int id;
+
+    for (i = 0; i < a->used; i++) {
+        const data_string *ds = (const data_string *)a->data[i];
+
+        for (id = 0; id < pd->ngroups; id++) {
+            if (strcmp(pd->groups[id], ds->value.ptr) == 0) break;
+        }
+        if (id == pd->ngroups) {
+            if (pd->ngroups == GROUP_MAX) {
+                log_error(srv->errh, __FILE__, __LINE__,
+                          "too many groups in require-group, max: %d",
+                          GROUP_MAX);
+                free(groups);
+                return NULL;
+            }
+            pd->groups[pd->ngroups++] = strdup(ds->value.ptr);
+        }
+        *groups |= (uint64_t)1 << id;
+    }
+    return groups;
+}
+
+//
+// Compile exclude list into a trie, so request path is matched
+// against all of them in one pass.
+//
+static ac_ptrie *
+compile_exclude(server *srv, const array *a) {
+    ac_ptrie *t = ac_ptrie_init();
+    uint32_t i;
+
+    for (i = 0; i < a->used; i++) {
+        const data_string *ds = (const data_string *)a->data[i];
+
+        if (ds->value.ptr[0] != '/' ||
+            ac_ptrie_add(t, BUF_SLICE(&ds->value)) != 0) {
+            log_error(srv->errh, __FILE__, __LINE__,
+                      "bad path in auth-cookie.exclude: %s", ds->value.ptr);
+            ac_ptrie_free(t);
+            return NULL;
+        }
+    }
+    return t;
+}
+
+//
+// Resolve name of each header to pass attribute in, to its ID.
+//
+static attr_headers *
+compile_attr_headers(const array *a) {
+    attr_headers *ah = calloc(1, sizeof(*ah));
+    uint32_t i;
+
+    ah->ptr = calloc(a->used, sizeof(*ah->ptr));
+    for (i = 0; i < a->used; i++) {
+        const data_string *ds = (const data_string *)a->data[i];
+
+        ah->ptr[i].attr        = &ds->key;
+        ah->ptr[i].header.name = &ds->value;
+        ah->ptr[i].header.id   = http_header_hkey_get(BUF_PTR_LEN(&ds->value));
+    }
+    ah->used = a->used;
+    return ah;
+}
+
+//
+// Turn list of scheme names into bitset.
+//
+static int
+compile_schemes(server *srv, const array *a, unsigned int *mask) {
+    uint32_t i;
+    size_t j;
+
+    *mask = 0;
+    for (i = 0; i < a->used; i++) {
+        const data_string *ds = (const data_string *)a->data[i];
+
+        for (j = 0; j < SCHEME_COUNT; j++) {
+            if (strcmp(ds->value.ptr, schemes[j].name) == 0) break;
+        }
+        if (j == SCHEME_COUNT) {
+            log_error(srv->errh, __FILE__, __LINE__,
+                      "unknown scheme in auth-cookie.schemes: %s",
+                      ds->value.ptr);
+            return -1;
+        }
+        *mask |= 1U << j;
+    }
+    return 0;
+}
+
+/**********************************************************************
+ * module interface
+ **********************************************************************/
+
+INIT_FUNC(module_init) {
+    plugin_data *pd = calloc(1, sizeof(*pd));
+
+    pd->users   = token_store_init();
+    pd->tickets = tcache_init(TICKET_CACHE_MAX);
+    pd->tenant_name    = buffer_init();
+    pd->tenant_key     = buffer_init();
+    pd->tenant_authurl = buffer_init();
+    index_schemes(pd);
+    return pd;
+}
+
+FREE_FUNC(module_free) {
+    plugin_data *pd = p_d;
+    int i;
+
+    token_store_free(pd->users);
+    tcache_free(pd->tickets);
+    ac_cdb_close(&pd->dir);
+    ac_cdb_close(&pd->services);
+    ac_cdb_close(&pd->tenants);
+    buffer_free(pd->tenant_name);
+    buffer_free(pd->tenant_key);
+    buffer_free(pd->tenant_authurl);
+    ac_revoked_free(pd->revoked);
+    ac_ustats_free(pd->ustats);
+    ac_audit_close(pd->defaults.audit);
+    ac_loopguard_free(pd->defaults.loops);
+    while (pd->ngroups > 0) free(pd->groups[--pd->ngroups]);
+
+    if (! pd->cvlist) return;
+
+    // free precompiled values, for each context
+    for (i = ! pd->cvlist[0].v.u2[1]; i < pd->nconfig; i++) {
+        config_plugin_value_t *cpv = pd->cvlist + pd->cvlist[i].v.u2[0];
+
+        for (; cpv->k_id != -1; cpv++) {
+            if (cpv->vtype != T_CONFIG_LOCAL || ! cpv->v.v) continue;
+
+            switch (cpv->k_id) {
+            case 7:  // pubtkt-key
+            case 13: // jwt-key
+                EVP_PKEY_free(cpv->v.v);
+                break;
+            case 17: // directory-headers
+                free(((attr_headers *)cpv->v.v)->ptr);
+                free(cpv->v.v);
+                break;
+            case 19: // exclude
+                ac_ptrie_free(cpv->v.v);
+                break;
+            case 14: // assertion-header
+            case 18: // require-group
+                free(cpv->v.v);
+                break;
+            }
+        }
+    }
+}
+
+SETDEFAULTS_FUNC(module_set_defaults) {
+    static const config_plugin_keys_t cpk[] = {
+        { CONST_STR_LEN("auth-cookie.loglevel"),
+          T_CONFIG_INT,    T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.name"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.override"),
+          T_CONFIG_INT,    T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.authurl"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.key"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.timeout"),
+          T_CONFIG_INT,    T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.options"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.pubtkt-key"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.pubtkt-digest"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.tkt-secret"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.tkt-digest"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.tkt-ignore-ip"),
+          T_CONFIG_BOOL,   T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.jwt-secret"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.jwt-key"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.assertion-header"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.assertion-key"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.directory"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { CONST_STR_LEN("auth-cookie.directory-headers"),
+          T_CONFIG_ARRAY_KVSTRING, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.require-group"),
+          T_CONFIG_ARRAY_VLIST, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.exclude"),
+          T_CONFIG_ARRAY_VLIST, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.schemes"),
+          T_CONFIG_ARRAY_VLIST, T_CONFIG_SCOPE_CONNECTION },
+        { CONST_STR_LEN("auth-cookie.revoked-users"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { CONST_STR_LEN("auth-cookie.service-tokens"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { CONST_STR_LEN("auth-cookie.audit-log"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { CONST_STR_LEN("auth-cookie.audit-log-size"),
+          T_CONFIG_INT, T_CONFIG_SCOPE_SERVER },
+        { CONST_STR_LEN("auth-cookie.user-stats"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { CONST_STR_LEN("auth-cookie.redirect-limit"),
+          T_CONFIG_INT, T_CONFIG_SCOPE_SERVER },
+        { CONST_STR_LEN("auth-cookie.tenants"),
+          T_CONFIG_STRING, T_CONFIG_SCOPE_SERVER },
+        { NULL, 0, T_CONFIG_UNSET, T_CONFIG_SCOPE_UNSET }
+    };
+    plugin_data *pd = p_d;
+    int i;
+
+    if (! config_plugin_values_init(srv, pd, cpk, "mod_auth_cookie")) {
+        return HANDLER_ERROR;
+    }
+
+    // precompile values, for each context
+    for (i = ! pd->cvlist[0].v.u2[1]; i < pd->nconfig; i++) {
+        config_plugin_value_t *cpv = pd->cvlist + pd->cvlist[i].v.u2[0];
+
+        for (; cpv->k_id != -1; cpv++) {
+            switch (cpv->k_id) {
+            case 1: case 3: case 4: case 6: case 9: case 12: case 15:
+                if (buffer_is_blank(cpv->v.b)) cpv->v.b = NULL;
+                break;
+            case 5:
+                if ((int)cpv->v.u > pd->max_timeout) {
+                    pd->max_timeout = cpv->v.u;
+                }
+                break;
+            case 7:  // pubtkt-key
+            case 13: // jwt-key
+                if (buffer_is_blank(cpv->v.b)) {
+                    cpv->v.v = NULL;
+                } else if ((cpv->v.v = ac_pubkey_load(cpv->v.b->ptr)) == NULL) {
+                    log_error(srv->errh, __FILE__, __LINE__,
+                              "cannot load public key: %s", cpv->v.b->ptr);
+                    return HANDLER_ERROR;
+                }
+                cpv->vtype = T_CONFIG_LOCAL;
+                break;
+            case 8: { // pubtkt-digest
+                const buffer *md = cpv->v.b;
+
+                if (buffer_is_blank(md)) {
+                    cpv->v.v = NULL;
+                } else if ((cpv->v.v = (void *)EVP_get_digestbyname(md->ptr)) == NULL) {
+                    log_error(srv->errh, __FILE__, __LINE__,
+                              "unknown digest: %s", md->ptr);
+                    return HANDLER_ERROR;
+                }
+                cpv->vtype = T_CONFIG_LOCAL;
+                break;
+            }
+            case 10: { // tkt-digest
+                int type = 0;
+
+                if (! buffer_is_blank(cpv->v.b) &&
+                    (type = ac_tkt_digest_type(cpv->v.b->ptr)) < 0) {
+                    log_error(srv->errh, __FILE__, __LINE__,
+                              "unsupported tkt digest: %s", cpv->v.b->ptr);
+                    return HANDLER_ERROR;
+                }
+                cpv->v.u = type;
+                cpv->vtype = T_CONFIG_INT;
+                break;
+            }
+            case 14: { // assertion-header
+                header_conf *h = NULL;
+
+                if (! buffer_is_blank(cpv->v.b)) {
+                    h = calloc(1, sizeof(*h));
+                    h->name = cpv->v.b;
+                    h->id   = http_header_hkey_get(BUF_PTR_LEN(cpv->v.b));
+                }
+                cpv->v.v = h;
+                cpv->vtype = T_CONFIG_LOCAL;
+                break;
+            }
+            case 16:
+                if (! buffer_is_blank(cpv->v.b)) pd->directory = cpv->v.b;
+                break;
+            case 17:
+                cpv->v.v = cpv->v.a->used ? compile_attr_headers(cpv->v.a) : NULL;
+                cpv->vtype = T_CONFIG_LOCAL;
+                break;
+            case 18:
+                if ((cpv->v.v = compile_groups(srv, pd, cpv->v.a)) == NULL) {
+                    return HANDLER_ERROR;
+                }
+                cpv->vtype = T_CONFIG_LOCAL;
+                break;
+            case 19:
+                if (! cpv->v.a->used) {
+                    cpv->v.v = NULL;
+                } else if ((cpv->v.v = compile_exclude(srv, cpv->v.a)) == NULL) {
+                    return HANDLER_ERROR;
+                }
+                cpv->vtype = T_CONFIG_LOCAL;
+                break;
+            case 20: { // schemes
+                unsigned int mask = SCHEME_ALL;
+
+                if (cpv->v.a->used &&
+                    compile_schemes(srv, cpv->v.a, &mask) != 0) {
+                    return HANDLER_ERROR;
+                }
+                cpv->v.u = mask;
+                cpv->vtype = T_CONFIG_INT;
+                break;
+            }
+            case 21:
+                if (! buffer_is_blank(cpv->v.b)) pd->revoked_users = cpv->v.b;
+                break;
+            case 22:
+                if (! buffer_is_blank(cpv->v.b)) pd->service_tokens = cpv->v.b;
+                break;
+            case 23:
+                if (! buffer_is_blank(cpv->v.b)) pd->audit_log = cpv->v.b;
+                break;
+            case 24:
+                pd->audit_log_size = cpv->v.u;
+                break;
+            case 25:
+                if (! buffer_is_blank(cpv->v.b)) pd->user_stats = cpv->v.b;
+                break;
+            case 26:
+                pd->redirect_limit = cpv->v.u;
+                break;
+            case 27:
+                if (! buffer_is_blank(cpv->v.b)) pd->tenants_path = cpv->v.b;
+                break;
+            }
+        }
+    }
+
+    pd->defaults.loglevel = 1;
+    pd->defaults.override = 2;
+    pd->defaults.timeout  = 86400;
+    pd->defaults.scheme_mask = SCHEME_ALL;
+    if (pd->max_timeout < pd->defaults.timeout) {
+        pd->max_timeout = pd->defaults.timeout;
+    }
+
+    // initialize defaults from global config context
+    if (pd->nconfig > 0 && pd->cvlist[0].v.u2[1]) {
+        const config_plugin_value_t *cpv = pd->cvlist + pd->cvlist[0].v.u2[0];
+        if (cpv->k_id != -1) merge_config(&pd->defaults, cpv);
+    }
+
+    // open random source for tokens while it is still reachable
+    if (ac_random_init() != 0) {
+        log_perror(srv->errh, __FILE__, __LINE__, "cannot open /dev/urandom");
+        return HANDLER_ERROR;
+    }
+
+    // load user attributes
+    if (pd->directory && ac_cdb_reload(&pd->dir, pd->directory->ptr) < 0) {
+        log_error(srv->errh, __FILE__, __LINE__,
+                  "cannot load directory: %s", pd->directory->ptr);
+        return HANDLER_ERROR;
+    }
+    if (pd->ngroups && ! pd->directory) {
+        log_error(srv->errh, __FILE__, __LINE__, "%s",
+                  "auth-cookie.require-group needs auth-cookie.directory");
+        return HANDLER_ERROR;
+    }
+
+    // map service tokens
+    if (pd->service_tokens &&
+        ac_cdb_reload(&pd->services, pd->service_tokens->ptr) < 0) {
+        log_error(srv->errh, __FILE__, __LINE__,
+                  "cannot load service tokens: %s", pd->service_tokens->ptr);
+        return HANDLER_ERROR;
+    }
+
+    // map realms of virtual hosts
+    if (pd->tenants_path &&
+        ac_cdb_reload(&pd->tenants, pd->tenants_path->ptr) < 0) {
+        log_error(srv->errh, __FILE__, __LINE__,
+                  "cannot load tenants: %s", pd->tenants_path->ptr);
+        return HANDLER_ERROR;
+    }
+
+    // open audit log (written by its own thread, started on first event)
+    if (pd->audit_log) {
+        pd->defaults.audit = ac_audit_open(pd->audit_log->ptr,
+                                           (size_t)pd->audit_log_size << 20);
+        if (! pd->defaults.audit) {
+            log_error(srv->errh, __FILE__, __LINE__,
+                      "cannot open audit log: %s", pd->audit_log->ptr);
+            return HANDLER_ERROR;
+        }
+    }
+
+    // count redirects per client, to break redirect loop
+    if (pd->redirect_limit) {
+        pd->defaults.loops = ac_loopguard_init(pd->redirect_limit,
+                                               REDIRECT_WINDOW);
+
+        // own handler, or core replaces the body with its error page
+        pd->defaults.self = pd->self;
+    }
+
+    // count requests per user
+    if (pd->user_stats) pd->ustats = ac_ustats_init(USER_STATS_MAX);
+
+    // load revoked users
+    if (pd->revoked_users &&
+        ac_revoked_reload(&pd->revoked, pd->revoked_users->ptr) < 0) {
+        log_error(srv->errh, __FILE__, __LINE__,
+                  "cannot load revoked users: %s", pd->revoked_users->ptr);
+        return HANDLER_ERROR;
+    }
+    return HANDLER_GO_ON;
+}
+
+//
+// authorization handler
+//
+//
+// Find record of given virtual host in tenant table, along with ID
+// of its realm - "realm" attribute if given (for hosts sharing one),
+// or the host name. Realm is all zero for host not in the table.
+//
+static int
+find_tenant(plugin_data *pd, const buffer *host, ac_slice *rec,
+            unsigned char *realm) {
+    ac_slice h = BUF_SLICE(host), v;
+    size_t i;
+
+    memset(realm, 0, AC_REALM_LEN);
+    if (! pd->tenants.map || ! h.len) return AC_EFORMAT;
+
+    // drop port, if any (but not a part of IPv6 address)
+    for (i = h.len; i-- > 0 && h.ptr[i] >= '0' && h.ptr[i] <= '9'; );
+    if (i < h.len && h.ptr[i] == ':' &&
+        (h.ptr[0] != '[' || (i > 0 && h.ptr[i - 1] == ']'))) {
+        h.len = i;
+    }
+    if (ac_cdb_find(&pd->tenants, h, rec) != AC_OK) return AC_EFORMAT;
+
+    if (ac_cdb_attr(*rec, AC_STR("realm"), &v) != AC_OK) v = h;
+    ac_realm_id(v, realm);
+    return AC_OK;
+}
+
+//
+// Take realm of the virtual host from tenant table, with a record of
+// "name=value" lines:
+//
+//   name=<cookie name>
+//   key=<key for cookie verification>
+//   authurl=<page to go when unauthorized>
+//   realm=<realm name>  (optional, defaults to host name)
+//
+// Each of the first three given overrides lighttpd.conf for this
+// request. Record and realm are part of the config, so verdict on a
+// connection is never shared by different tenants, and tokens and
+// tickets are only taken in the realm they were issued in.
+//
+static void
+apply_tenant(request_st *r, plugin_data *pd, plugin_config *pc) {
+    ac_slice rec, v;
+
+    if (find_tenant(pd, &r->uri.authority, &rec, pc->realm) != AC_OK) {
+        return;
+    }
+
+    pc->tenant = rec.ptr;
+    if (ac_cdb_attr(rec, AC_STR("name"), &v) == AC_OK) {
+        buffer_copy_string_len(pd->tenant_name, v.ptr, v.len);
+        pc->name = pd->tenant_name;
+    }
+    if (ac_cdb_attr(rec, AC_STR("key"), &v) == AC_OK) {
+        buffer_copy_string_len(pd->tenant_key, v.ptr, v.len);
+        pc->key = pd->tenant_key;
+    }
+    if (ac_cdb_attr(rec, AC_STR("authurl"), &v) == AC_OK) {
+        buffer_copy_string_len(pd->tenant_authurl, v.ptr, v.len);
+        pc->authurl = pd->tenant_authurl;
+    }
+    DEBUG("realm of tenant: %s", r->uri.authority.ptr);
+}
+
+URIHANDLER_FUNC(module_uri_handler) {
+    plugin_data   *pd = p_d;
+    plugin_config *pc = patch_config(r, pd);
+    const buffer *b;
+    char buf[AC_COOKIE_MAX]; // cookie content
+    ac_slice cv;    // <AuthName> entry in a cookie
+    verdict *vc;
+    size_t i;
+
+    apply_tenant(r, pd, pc);
+
+    // skip if not enabled
+    if (! pc->name) return HANDLER_GO_ON;
+
+    // never pass assertion or attributes made up by client
+    if (pc->assertion_header) {
+        http_header_request_unset(r, pc->assertion_header->id,
+                                  BUF_PTR_LEN(pc->assertion_header->name));
+    }
+    for (i = 0; pc->directory_headers && i < pc->directory_headers->used; i++) {
+        const header_conf *h = &pc->directory_headers->ptr[i].header;
+        http_header_request_unset(r, h->id, BUF_PTR_LEN(h->name));
+    }
+
+    // public paths in protected tree
+    if (pc->exclude &&
+        ac_ptrie_match(pc->exclude, BUF_SLICE(&r->uri.path))) {
+        DEBUG("excluded path: %s", r->uri.path.ptr);
+        return HANDLER_GO_ON;
+    }
+
+    // decide how to handle incoming Auth header
+    if (http_header_request_get(r, HTTP_HEADER_AUTHORIZATION,
+                                CONST_STR_LEN("Authorization"))) {
+        switch (pc->override) {
+        case 0:                         // just use it if supplied,
+            if (! pc->require_groups) return HANDLER_GO_ON;
+            break;                      // but groups need a session
+        case 1: break;                  // use CookieAuth if exists
+        case 2:
+        default:                        // use CookieAuth only
+            http_header_request_unset(r, HTTP_HEADER_AUTHORIZATION,
+                                      CONST_STR_LEN("Authorization"));
+        }
+    }
+
+    // check for cookie
+    b = http_header_request_get(r, HTTP_HEADER_COOKIE, CONST_STR_LEN("Cookie"));
+    if (! b) return endauth(r, pc);
+    DEBUG("parsing cookie: %s", b->ptr);
+
+    // check for "<AuthName>=" entry in a cookie
+    if (ac_cookie_find(BUF_SLICE(b), BUF_SLICE(pc->name), &cv) != AC_OK) {
+        return endauth(r, pc); // not found - rejecting
+    }
+    if (cv.len >= sizeof(buf)) {
+        DEBUG("%s", "cookie too long");
+        return endauth(r, pc);
+    }
+
+    // same cookie already verified on this connection (or stream)
+    if ((vc = verdict_get(r, pd, pc, cv.ptr, cv.len)) != NULL) {
+        DEBUG("%s", "cookie verified earlier on this connection");
+        return accept_authinfo(r, pd, pc, BUF_PTR_LEN(vc->authinfo),
+                               vc->expires, BUF_SLICE(vc->session),
+                               &vc->cache);
+    }
+
+    // unescape payload
+    cv.len = ac_urldecode(buf, cv);
+    buf[cv.len] = '\0';
+
+    // hand it over to the verifier of its scheme
+    return dispatch(r, pd, pc, buf, cv.len);
+}
+
+//
+// drop verdict when connection (with all its streams) is closed.
+//
+CONNECTION_FUNC(module_connection_close) {
+    plugin_data *pd = p_d;
+    verdict *vc = con->plugin_ctx[pd->id];
+
+    if (vc) {
+        verdict_free(vc);
+        con->plugin_ctx[pd->id] = NULL;
+    }
+    return HANDLER_GO_ON;
+}
+
+//
+// pick up CDB file (directory or service tokens) replaced since last
+// check. Previous one is kept (and used) if the new one cannot be loaded.
+//
+static void
+reload_cdb(server *srv, ac_cdb *db, const buffer *path, int *failed,
+           const char *what) {
+    int rc;
+
+    if (! path) return;
+
+    if ((rc = ac_cdb_reload(db, path->ptr)) < 0) {
+        if (! *failed) {
+            log_error(srv->errh, __FILE__, __LINE__,
+                      "cannot reload %s: %s", what, path->ptr);
+        }
+    } else if (rc > 0) {
+        log_error(srv->errh, __FILE__, __LINE__,
+                  "%s reloaded: %s", what, path->ptr);
+    }
+    *failed = rc < 0;
+}
+
+static int
+token_revoked(token_entry *te, void *ctx) {
+    return authinfo_revoked(ctx, te->authinfo, te->authinfo_len);
+}
+
+static int
+ticket_revoked(tcache_entry *e, void *ctx) {
+    return authinfo_revoked(ctx, e->authinfo, e->authinfo_len);
+}
+
+static void
+revoke_token(token_entry *te, void *ctx) {
+    plugin_data *pd = ctx;
+    audit_authinfo(pd->defaults.audit, NULL, "revoke",
+                   te->authinfo, te->authinfo_len, "token");
+}
+
+static void
+revoke_ticket(tcache_entry *e, void *ctx) {
+    plugin_data *pd = ctx;
+    audit_authinfo(pd->defaults.audit, NULL, "revoke",
+                   e->authinfo, e->authinfo_len, "ticket");
+}
+
+static void
+expire_token(token_entry *te, void *ctx) {
+    plugin_data *pd = ctx;
+    audit_authinfo(pd->defaults.audit, NULL, "expire",
+                   te->authinfo, te->authinfo_len, "token");
+}
+
+//
+// pick up list of revoked users replaced since last check, and drop
+// all their sessions at once. Verdicts kept on connections are
+// rejected on their next use.
+//
+static void
+reload_revoked(server *srv, plugin_data *pd) {
+    size_t ntokens, ntickets;
+    int rc;
+
+    if (! pd->revoked_users) return;
+
+    if ((rc = ac_revoked_reload(&pd->revoked, pd->revoked_users->ptr)) < 0) {
+        if (! pd->revoked_failed) {
+            log_error(srv->errh, __FILE__, __LINE__,
+                      "cannot reload revoked users: %s",
+                      pd->revoked_users->ptr);
+        }
+    } else if (rc > 0) {
+        ntokens  = token_store_remove_if(pd->users, token_revoked,
+                                         revoke_token, pd);
+        ntickets = tcache_remove_if(pd->tickets, ticket_revoked,
+                                    revoke_ticket, pd);
+        log_error(srv->errh, __FILE__, __LINE__,
+                  "revoked users reloaded: %s (tokens dropped: %zu, "
+                  "tickets dropped: %zu)", pd->revoked_users->ptr,
+                  ntokens, ntickets);
+    }
+    pd->revoked_failed = rc < 0;
+}
+
+// totals of per-user counters, summed up while dumping them
+typedef struct {
+    FILE         *fp;
+    unix_time64_t since;  // users seen after this are "active"
+    unsigned long users;
+    unsigned long active;
+    unsigned long requests;
+    unsigned long redirects;
+    unsigned long mints;
+} user_totals;
+
+static void
+dump_user(ac_user_stats *st, void *ctx) {
+    user_totals *t = ctx;
+
+    if (t->fp) {
+        fprintf(t->fp, "%s\t%lu\t%lu\t%lu\t%lld\n", st->user, st->requests,
+                st->redirects, st->mints, (long long)st->last_seen);
+    }
+    t->users++;
+    if (st->last_seen > t->since) t->active++;
+    t->requests  += st->requests;
+    t->redirects += st->redirects;
+    t->mints     += st->mints;
+}
+
+//
+// dump per-user counters to a file, replaced as a whole, and publish
+// their totals as plugin statistics (mod_status). Counters of each
+// user are only in the file, as a statistic per user would not scale
+// to the users counted.
+//
+static void
+dump_user_stats(server *srv, plugin_data *pd) {
+    buffer *tmp = buffer_init();
+    user_totals t;
+
+    memset(&t, 0, sizeof(t));
+    t.since = log_epoch_secs - USER_STATS_INTERVAL;
+
+    buffer_copy_buffer(tmp, pd->user_stats);
+    buffer_append_string(tmp, ".tmp");
+    if ((t.fp = fopen(tmp->ptr, "w")) == NULL) {
+        log_error(srv->errh, __FILE__, __LINE__,
+                  "cannot write user stats: %s", tmp->ptr);
+    } else {
+        fprintf(t.fp, "# user\trequests\tredirects\tmints\tlast_seen\n");
+    }
+    ac_ustats_walk(pd->ustats, dump_user, &t);
+
+    if (t.fp && fclose(t.fp) == 0) rename(tmp->ptr, pd->user_stats->ptr);
+    buffer_free(tmp);
+
+    plugin_stats_set(CONST_STR_LEN("auth-cookie.users.counted"),
+                     (off_t)t.users);
+    plugin_stats_set(CONST_STR_LEN("auth-cookie.users.active"),
+                     (off_t)t.active);
+    plugin_stats_set(CONST_STR_LEN("auth-cookie.users.requests"),
+                     (off_t)t.requests);
+    plugin_stats_set(CONST_STR_LEN("auth-cookie.users.redirects"),
+                     (off_t)t.redirects);
+    plugin_stats_set(CONST_STR_LEN("auth-cookie.users.mints"),
+                     (off_t)t.mints);
+}
+
+//
+// periodic maintenance - sweep expired tokens and tickets.
+//
+TRIGGER_FUNC(module_trigger) {
+    plugin_data *pd = p_d;
+
+    if (log_epoch_secs - pd->last_expire >= EXPIRE_INTERVAL) {
+        size_t live, resident;
+
+        token_store_expire(pd->users, log_epoch_secs - pd->max_timeout,
+                           expire_token, pd);
+        tcache_expire(pd->tickets, log_epoch_secs);
+        pd->last_expire = log_epoch_secs;
+
+        // give memory of expired tokens back, and tell how much is left
+        token_store_compact(pd->users);
+        token_store_usage(pd->users, &live, &resident);
+        plugin_stats_set(CONST_STR_LEN("auth-cookie.store.live-bytes"),
+                         (off_t)live);
+        plugin_stats_set(CONST_STR_LEN("auth-cookie.store.resident-bytes"),
+                         (off_t)resident);
+    }
+    token_store_rehash(pd->users, TOKEN_REHASH_TICK);
+    reload_cdb(srv, &pd->dir, pd->directory, &pd->dir_failed, "directory");
+    reload_cdb(srv, &pd->services, pd->service_tokens,
+               &pd->services_failed, "service tokens");
+    reload_cdb(srv, &pd->tenants, pd->tenants_path,
+               &pd->tenants_failed, "tenants");
+    reload_revoked(srv, pd);
+
+    if (pd->ustats && log_epoch_secs - pd->last_stats >= USER_STATS_INTERVAL) {
+        dump_user_stats(srv, pd);
+        pd->last_stats = log_epoch_secs;
+    }
+    return HANDLER_GO_ON;
+}
+
+__attribute_cold__
+int mod_auth_cookie_plugin_init(plugin *p);
+int
+mod_auth_cookie_plugin_init(plugin *p) {
+    p->version          = LIGHTTPD_VERSION_ID;
+    p->name             = "auth_cookie";
+    p->init             = module_init;
+    p->set_defaults     = module_set_defaults;
+    p->cleanup          = module_free;
+    p->handle_trigger   = module_trigger;
+    p->handle_connection_close = module_connection_close;
+    p->handle_uri_clean = module_uri_handler;
+
+    return 0;
+}
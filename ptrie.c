@@ -0,0 +1,100 @@
+//
+// Path pattern matcher.
+//
+// Pattern is either an exact path ("/favicon.ico"), or a prefix
+// ending with "*" ("/static/*"). All patterns are compiled into a
+// single trie, so a path is matched against all of them in one pass,
+// however many there are.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ptrie.h"
+
+#define INITIAL_SIZE 64
+
+#define EXACT  0x01 // pattern ends here
+#define PREFIX 0x02 // pattern ending with "*" ends here
+
+static uint32_t
+new_node(ac_ptrie *t, unsigned char c) {
+    if (t->used >= t->size) {
+        ac_ptrie_node *nodes;
+
+        nodes = realloc(t->nodes, (t->size << 1) * sizeof(*nodes));
+        if (! nodes) return 0;
+        t->nodes = nodes;
+        t->size <<= 1;
+    }
+    memset(&t->nodes[t->used], 0, sizeof(t->nodes[0]));
+    t->nodes[t->used].c = c;
+    return t->used++;
+}
+
+ac_ptrie *
+ac_ptrie_init(void) {
+    ac_ptrie *t = calloc(1, sizeof(*t));
+
+    t->size  = INITIAL_SIZE;
+    t->nodes = calloc(t->size, sizeof(*t->nodes));
+    t->used  = 1; // root
+    return t;
+}
+
+void
+ac_ptrie_free(ac_ptrie *t) {
+    if (! t) return;
+    free(t->nodes);
+    free(t);
+}
+
+//
+// Add pattern to the trie. Returns 0 on success, -1 on error.
+//
+int
+ac_ptrie_add(ac_ptrie *t, ac_slice pattern) {
+    unsigned char flag = EXACT;
+    uint32_t n = 0;
+    size_t i;
+
+    if (pattern.len && pattern.ptr[pattern.len - 1] == '*') {
+        flag = PREFIX;
+        pattern.len--;
+    }
+
+    for (i = 0; i < pattern.len; i++) {
+        unsigned char c = pattern.ptr[i];
+        uint32_t m;
+
+        for (m = t->nodes[n].child; m && t->nodes[m].c != c;
+             m = t->nodes[m].sibling);
+        if (! m) {
+            if ((m = new_node(t, c)) == 0) return -1;
+            t->nodes[m].sibling = t->nodes[n].child;
+            t->nodes[n].child   = m;
+        }
+        n = m;
+    }
+    t->nodes[n].flags |= flag;
+    return 0;
+}
+
+//
+// Returns 1 if path matches any pattern, 0 otherwise.
+//
+int
+ac_ptrie_match(const ac_ptrie *t, ac_slice path) {
+    const ac_ptrie_node *nodes = t->nodes;
+    uint32_t n = 0;
+    size_t i;
+
+    for (i = 0; i < path.len; i++) {
+        unsigned char c = path.ptr[i];
+
+        if (nodes[n].flags & PREFIX) return 1;
+        for (n = nodes[n].child; n && nodes[n].c != c; n = nodes[n].sibling);
+        if (! n) return 0;
+    }
+    return (nodes[n].flags & (EXACT | PREFIX)) != 0;
+}
@@ -0,0 +1,30 @@
+#ifndef _AUTH_COOKIE_PTRIE_H_
+#define _AUTH_COOKIE_PTRIE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "authcore.h"
+
+// trie node, linked to first child and next sibling by index
+typedef struct {
+    uint32_t      child;
+    uint32_t      sibling;
+    unsigned char c;
+    unsigned char flags;
+} ac_ptrie_node;
+
+// set of path patterns, compiled into a trie
+typedef struct {
+    ac_ptrie_node *nodes; // nodes[0] is root
+    size_t used;
+    size_t size;
+} ac_ptrie;
+
+ac_ptrie *ac_ptrie_init(void);
+void ac_ptrie_free(ac_ptrie *t);
+
+int ac_ptrie_add(ac_ptrie *t, ac_slice pattern);
+int ac_ptrie_match(const ac_ptrie *t, ac_slice path);
+
+#endif
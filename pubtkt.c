@@ -0,0 +1,95 @@
+//
+// mod_auth_pubtkt compatible ticket.
+//
+// Ticket Format:
+//   uid=<user>;cip=<addr>;validuntil=<time>;tokens=<list>;udata=<data>;sig=<sig>
+//
+//   sig = base64(sign(privkey, everything before ";sig="))
+//
+// Only uid, validuntil and sig are mandatory. Signature is made with
+// RSA or DSA key (SHA1 digest by default, as mod_auth_pubtkt does),
+// or Ed25519 key.
+//
+
+#include <stdlib.h>
+
+#include "pubtkt.h"
+#include "base64.h"
+
+#define SIG_MAX 1024 // enough for 4096-bit RSA signature in base64
+
+#define FIELD(k) (klen == sizeof(k) - 1 && memcmp(p, k, klen) == 0)
+
+int
+ac_pubtkt_parse(ac_slice ticket, ac_pubtkt *t) {
+    const char *p = ticket.ptr, *end = ticket.ptr + ticket.len;
+    int has_validuntil = 0;
+
+    memset(t, 0, sizeof(*t));
+
+    while (p < end) {
+        const char *eov = memchr(p, ';', end - p);
+        const char *eq;
+        size_t klen;
+
+        if (! eov) eov = end;
+        if ((eq = memchr(p, '=', eov - p)) == NULL) return AC_EFORMAT;
+        klen = eq - p;
+
+        if (FIELD("sig")) {
+            // signature covers everything before ";sig="
+            if (p == ticket.ptr) return AC_EFORMAT;
+            t->data = AC_SLICE(ticket.ptr, p - 1 - ticket.ptr);
+            t->sig  = AC_SLICE(eq + 1, end - eq - 1);
+            break;
+        } else if (FIELD("uid")) {
+            t->uid = AC_SLICE(eq + 1, eov - eq - 1);
+        } else if (FIELD("cip")) {
+            t->cip = AC_SLICE(eq + 1, eov - eq - 1);
+        } else if (FIELD("tokens")) {
+            t->tokens = AC_SLICE(eq + 1, eov - eq - 1);
+        } else if (FIELD("udata")) {
+            t->udata = AC_SLICE(eq + 1, eov - eq - 1);
+        } else if (FIELD("validuntil")) {
+            const char *v;
+            if (eov - eq - 1 > AC_TIME_DIGITS) return AC_EFORMAT;
+            for (v = eq + 1; v < eov && *v >= '0' && *v <= '9'; v++) {
+                t->validuntil = t->validuntil * 10 + (*v - '0');
+            }
+            if (v != eov || v == eq + 1) return AC_EFORMAT;
+            has_validuntil = 1;
+        }
+        p = eov + 1;
+    }
+
+    if (! t->uid.len || ! t->sig.len || ! has_validuntil) return AC_EFORMAT;
+    return AC_OK;
+}
+
+#ifdef USE_OPENSSL
+
+int
+ac_pubtkt_verify(const ac_pubtkt *t, EVP_PKEY *key, const EVP_MD *md) {
+    unsigned char sig[BASE64_DECODED_MAX(SIG_MAX)];
+    EVP_MD_CTX *ctx;
+    int siglen, ok;
+
+    if (t->sig.len > SIG_MAX) return AC_EFORMAT;
+    if ((siglen = base64_decode(sig, t->sig.ptr, t->sig.len)) <= 0) {
+        return AC_EFORMAT;
+    }
+
+    // EdDSA does its own hashing
+    if (EVP_PKEY_id(key) == EVP_PKEY_ED25519) md = NULL;
+
+    if ((ctx = EVP_MD_CTX_new()) == NULL) return AC_EVERIFY;
+    ok = EVP_DigestVerifyInit(ctx, NULL, md, NULL, key) == 1 &&
+        EVP_DigestVerify(ctx, sig, siglen,
+                         (const unsigned char *)t->data.ptr,
+                         t->data.len) == 1;
+    EVP_MD_CTX_free(ctx);
+
+    return ok ? AC_OK : AC_EVERIFY;
+}
+
+#endif
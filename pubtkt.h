@@ -0,0 +1,23 @@
+#ifndef _AUTH_COOKIE_PUBTKT_H_
+#define _AUTH_COOKIE_PUBTKT_H_
+
+#include "authcore.h"
+
+// mod_auth_pubtkt ticket, as slices into the original cookie value
+typedef struct {
+    ac_slice data;       // signed part, everything before ";sig="
+    ac_slice uid;
+    ac_slice cip;
+    ac_slice tokens;
+    ac_slice udata;
+    ac_slice sig;        // base64-encoded signature
+    time_t   validuntil;
+} ac_pubtkt;
+
+int ac_pubtkt_parse(ac_slice ticket, ac_pubtkt *t);
+
+#ifdef USE_OPENSSL
+int ac_pubtkt_verify(const ac_pubtkt *t, EVP_PKEY *key, const EVP_MD *md);
+#endif
+
+#endif
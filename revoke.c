@@ -0,0 +1,153 @@
+//
+// Revoked users.
+//
+// File Format:
+//   one username per line; blank lines and lines starting with "#"
+//   are ignored
+//
+// The file is read whole into a new open-addressing hash set, which
+// is never modified afterwards. Reload builds another set and swaps
+// the pointer, so a lookup always sees either the old set or the new
+// one, and costs a single hash and (usually) one comparison.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "revoke.h"
+
+static uint32_t
+hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u; // FNV-1a
+
+    while (len--) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static const char *
+next_line(const char *p, const char *end, ac_slice *line) {
+    const char *eol = memchr(p, '\n', end - p), *e;
+
+    if (! eol) eol = end;
+    for (e = eol; e > p && (e[-1] == '\r' || e[-1] == ' ' ||
+                            e[-1] == '\t'); e--);
+    while (p < e && (*p == ' ' || *p == '\t')) p++;
+    line->ptr = p;
+    line->len = e - p;
+    return eol < end ? eol + 1 : end;
+}
+
+//
+// Build set from file content. Names are copied in place of the
+// content itself, as each name is shorter than its line.
+//
+static ac_revoked *
+build(char *text, size_t len) {
+    const char *p, *end = text + len;
+    ac_revoked *set;
+    ac_slice line;
+    size_t n = 0, size = 16, used = 0;
+
+    for (p = text; p < end; p = next_line(p, end, &line)) n++;
+    while (size < n * 2) size <<= 1;
+
+    if ((set = calloc(1, sizeof(*set))) == NULL) return NULL;
+    if ((set->slot = calloc(size, sizeof(*set->slot))) == NULL) {
+        free(set);
+        return NULL;
+    }
+    set->mask  = size - 1;
+    set->names = text;
+
+    for (p = text; p < end;) {
+        uint32_t i;
+
+        p = next_line(p, end, &line);
+        if (line.len == 0 || line.ptr[0] == '#') continue;
+        if (ac_revoked_has(set, line)) continue;
+
+        memmove(text + used, line.ptr, line.len);
+        text[used + line.len] = '\0';
+
+        // hash the copy: the move may have overwritten line itself
+        i = hash(text + used, line.len) & set->mask;
+        while (set->slot[i]) i = (i + 1) & set->mask;
+        set->slot[i] = used + 1;
+
+        used += line.len + 1;
+        set->count++;
+    }
+    return set;
+}
+
+//
+// (Re)load set if the file has been replaced since last load.
+// Returns 1 if loaded, 0 if unchanged, or -1 on error, in which
+// case previous set is kept as is.
+//
+int
+ac_revoked_reload(ac_revoked **set, const char *path) {
+    ac_revoked *old = *set, *s;
+    struct stat st;
+    char *text;
+    FILE *fp;
+
+    if (stat(path, &st) != 0) return -1;
+    if (old && st.st_ino == old->ino && st.st_mtime == old->mtime &&
+        st.st_size == old->size) {
+        return 0;
+    }
+    if (st.st_size >= UINT32_MAX) return -1;
+
+    if ((fp = fopen(path, "re")) == NULL) return -1;
+    if ((text = malloc(st.st_size + 1)) == NULL ||
+        fread(text, 1, st.st_size, fp) != (size_t)st.st_size) {
+        free(text);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    if ((s = build(text, st.st_size)) == NULL) {
+        free(text);
+        return -1;
+    }
+    s->ino   = st.st_ino;
+    s->mtime = st.st_mtime;
+    s->size  = st.st_size;
+
+    *set = s;
+    ac_revoked_free(old);
+    return 1;
+}
+
+void
+ac_revoked_free(ac_revoked *set) {
+    if (! set) return;
+
+    free(set->slot);
+    free(set->names);
+    free(set);
+}
+
+int
+ac_revoked_has(const ac_revoked *set, ac_slice user) {
+    uint32_t i;
+
+    if (! set || ! set->count) return 0;
+
+    for (i = hash(user.ptr, user.len) & set->mask; set->slot[i];
+         i = (i + 1) & set->mask) {
+        const char *name = set->names + set->slot[i] - 1;
+
+        if (memcmp(name, user.ptr, user.len) == 0 && name[user.len] == '\0') {
+            return 1;
+        }
+    }
+    return 0;
+}
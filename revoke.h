@@ -0,0 +1,25 @@
+#ifndef _AUTH_COOKIE_REVOKE_H_
+#define _AUTH_COOKIE_REVOKE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "authcore.h"
+
+// set of revoked usernames, never modified once loaded
+typedef struct {
+    size_t    mask;  // number of slots - 1
+    uint32_t *slot;  // offset (+1) of name in names, or 0 if empty
+    char     *names; // NUL-terminated usernames
+    size_t    count;
+    ino_t     ino;   // to tell if file has been replaced
+    time_t    mtime;
+    off_t     size;
+} ac_revoked;
+
+int ac_revoked_reload(ac_revoked **set, const char *path);
+void ac_revoked_free(ac_revoked *set);
+int ac_revoked_has(const ac_revoked *set, ac_slice user);
+
+#endif
@@ -0,0 +1,510 @@
+//
+// Token store - maps opaque auth token to authinfo.
+//
+// Tokens are random hex strings, so there's no need for a strong
+// hash function. Unlike lighttpd's array, this allows entries to
+// be removed, so expired tokens can actually free memory.
+//
+// Table is resized incrementally: a new table is allocated and
+// entries move over a few buckets per insert (and per trigger tick),
+// with lookups checking both tables meanwhile. Rehashing millions
+// of tokens at once would stall the server in the middle of a
+// login wave, just when it's busiest. For the same reason, previous
+// table is given back to the kernel part by part as it empties, and
+// arrays indexed by slot grow by doubling.
+//
+// Issue time of every entry is also kept in a dense array, so the
+// expiry sweep reads 8 bytes per token (many per cache line) instead
+// of chasing each entry, and only touches entries it removes.
+//
+// Entries themselves are packed in slot order into pages of their
+// own, and the last one moves into the hole left by removal. Thus
+// they never fragment the heap, and once a login wave has expired,
+// pages past the last entry can be handed back to the kernel.
+//
+// Hash chains link slots rather than entries, through a dense array
+// beside one of 64-bit token hashes (tags). Lookup walks these two,
+// and only reads an entry (a cache miss of its own, as entries are
+// scattered over pages) whose tag matches, which is almost always
+// the one looked for. Rehash reuses tags instead of hashing tokens.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "store.h"
+
+#define INITIAL_SIZE 64
+#define REHASH_STEPS 16 // buckets to move per insert
+#define SWEEP_BLOCK  16 // issue times to check at once in expiry sweep
+#define PAGE_BYTES   (64 * 1024)
+#define PAGE_ENTRIES (PAGE_BYTES / sizeof(token_entry))
+#define SPARE_PAGES  1  // kept past last entry, so as not to thrash
+#define RELEASE_BYTES (4 * PAGE_BYTES) // of previous table, at once
+
+static uint64_t
+hash(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ull; // FNV-1a
+
+    while (len--) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static token_entry *
+entry_at(token_store *ts, size_t slot) {
+    return &ts->page[slot / PAGE_ENTRIES][slot % PAGE_ENTRIES];
+}
+
+static void
+entry_clear(token_store *ts, token_entry *te) {
+    if (te->authinfo) ts->strings -= te->authinfo_len + 1;
+    free(te->authinfo);
+    free(te->cache.assertion);
+}
+
+//
+// Starts moving entries over to a table of given size.
+//
+static void
+resize(token_store *ts, size_t size) {
+    size_t *bucket;
+
+    if (ts->old) return; // one at a time
+    if ((bucket = calloc(size, sizeof(*bucket))) == NULL) {
+        return; // keep using current table
+    }
+    ts->old      = ts->bucket;
+    ts->old_size = ts->size;
+    ts->moved    = 0;
+    ts->released = 0;
+    ts->bucket   = bucket;
+    ts->size     = size;
+}
+
+static size_t *
+find_in(token_store *ts, size_t *pp, uint64_t tag,
+        const char *token, size_t len) {
+    for (; *pp; pp = &ts->link[*pp - 1]) {
+        token_entry *te;
+
+        if (ts->tags[*pp - 1] != tag) continue;
+        te = entry_at(ts, *pp - 1);
+        if (memcmp(te->token, token, len) == 0 && te->token[len] == '\0') {
+            break;
+        }
+    }
+    return pp;
+}
+
+//
+// Returns link holding slot of given token (hashed to tag), or
+// holding 0 if none.
+//
+static size_t *
+find(token_store *ts, uint64_t tag, const char *token, size_t len) {
+    size_t *pp = find_in(ts, &ts->bucket[tag & (ts->size - 1)],
+                         tag, token, len);
+
+    if (! *pp && ts->old) {
+        size_t *op = find_in(ts, &ts->old[tag & (ts->old_size - 1)],
+                             tag, token, len);
+        if (*op) return op;
+    }
+    return pp;
+}
+
+//
+// Returns link holding given slot, which must be in use.
+//
+static size_t *
+find_slot(token_store *ts, size_t slot) {
+    uint64_t tag = ts->tags[slot];
+    size_t *pp = &ts->bucket[tag & (ts->size - 1)];
+
+    while (*pp && *pp != slot + 1) pp = &ts->link[*pp - 1];
+    if (! *pp && ts->old) {
+        pp = &ts->old[tag & (ts->old_size - 1)];
+        while (*pp != slot + 1) pp = &ts->link[*pp - 1];
+    }
+    return pp;
+}
+
+//
+// Makes room for at least n items in array of given capacity,
+// doubling it, so it is copied only O(log n) times as store grows.
+// Returns the array (moved or not), or NULL if out of memory.
+//
+static void *
+reserve(void *v, size_t *cap, size_t n, size_t item) {
+    size_t size = *cap ? *cap : 1;
+
+    if (n <= *cap) return v;
+    while (size < n) size <<= 1;
+    if ((v = realloc(v, size * item)) != NULL) *cap = size;
+    return v;
+}
+
+//
+// Makes room for at least n slots in arrays by slot.
+// Returns -1 if out of memory.
+//
+static int
+reserve_slots(token_store *ts, size_t n) {
+    size_t cap;
+    void *v;
+
+    cap = ts->slot_cap;
+    if ((v = reserve(ts->issued, &cap, n, sizeof(*ts->issued))) == NULL) {
+        return -1;
+    }
+    ts->issued = v;
+    cap = ts->slot_cap;
+    if ((v = reserve(ts->tags, &cap, n, sizeof(*ts->tags))) == NULL) {
+        return -1;
+    }
+    ts->tags = v;
+    cap = ts->slot_cap;
+    if ((v = reserve(ts->link, &cap, n, sizeof(*ts->link))) == NULL) {
+        return -1;
+    }
+    ts->link = v;
+    ts->slot_cap = cap;
+    return 0;
+}
+
+//
+// Takes next free slot for new entry, mapping another page if needed.
+//
+static token_entry *
+append(token_store *ts, time_t issued, uint64_t tag) {
+    size_t n = ts->used / PAGE_ENTRIES;
+    token_entry *te;
+
+    if (n == ts->resident) {
+        if (n == ts->npages) {
+            token_entry **page_v;
+            void *page;
+
+            page_v = reserve(ts->page, &ts->page_cap, n + 1, sizeof(*page_v));
+            if (! page_v) return NULL;
+            ts->page = page_v;
+
+            page = mmap(NULL, PAGE_BYTES, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (page == MAP_FAILED) return NULL;
+            ts->page[ts->npages++] = page;
+        }
+        if (reserve_slots(ts, (n + 1) * PAGE_ENTRIES) != 0) return NULL;
+        ts->resident = n + 1;
+    }
+    te = entry_at(ts, ts->used);
+    memset(te, 0, sizeof(*te));
+    te->slot = ts->used;
+    ts->issued[ts->used] = issued;
+    ts->tags[ts->used]   = tag;
+    ts->link[ts->used++] = 0;
+    return te;
+}
+
+//
+// Removes entry from the table, and frees it. Last entry moves into
+// its slot, so the link to that one is updated as well.
+//
+static void
+unlink_entry(token_store *ts, size_t *pp) {
+    size_t slot = *pp - 1, last;
+    token_entry *te = entry_at(ts, slot);
+
+    *pp = ts->link[slot];
+    entry_clear(ts, te);
+
+    last = --ts->used;
+    if (slot != last) {
+        size_t *lp = find_slot(ts, last);
+
+        *te = *entry_at(ts, last);
+        te->slot = slot;
+        ts->issued[slot] = ts->issued[last];
+        ts->tags[slot]   = ts->tags[last];
+        ts->link[slot]   = ts->link[last];
+        *lp = slot + 1;
+    }
+}
+
+//
+// Returns index of first entry at or after i issued before deadline
+// (or ts->used, if none). Whole block is checked without branching,
+// which compiler can turn into SIMD compares.
+//
+static size_t
+next_expired(token_store *ts, size_t i, time_t deadline) {
+    const time_t *issued = ts->issued;
+
+    for (; i + SWEEP_BLOCK <= ts->used; i += SWEEP_BLOCK) {
+        int any = 0;
+        size_t j;
+
+        for (j = 0; j < SWEEP_BLOCK; j++) any |= issued[i + j] < deadline;
+        if (any) break;
+    }
+    while (i < ts->used && issued[i] >= deadline) i++;
+    return i;
+}
+
+token_store *
+token_store_init(void) {
+    token_store *ts = calloc(1, sizeof(*ts));
+
+    ts->size   = INITIAL_SIZE;
+    ts->bucket = calloc(ts->size, sizeof(*ts->bucket));
+    return ts;
+}
+
+void
+token_store_free(token_store *ts) {
+    size_t i;
+
+    if (! ts) return;
+
+    for (i = 0; i < ts->used; i++) entry_clear(ts, entry_at(ts, i));
+    for (i = 0; i < ts->npages; i++) munmap(ts->page[i], PAGE_BYTES);
+    free(ts->page);
+    free(ts->issued);
+    free(ts->tags);
+    free(ts->link);
+    free(ts->old);
+    free(ts->bucket);
+    free(ts);
+}
+
+token_entry *
+token_store_get(token_store *ts, const char *token, size_t len) {
+    size_t slot;
+
+    if (len == 0 || len > TOKEN_LEN) return NULL;
+
+    slot = *find(ts, hash(token, len), token, len);
+    return slot ? entry_at(ts, slot - 1) : NULL;
+}
+
+//
+// Returns entry in given slot, or NULL past the last one. Removal
+// moves the last entry into the hole, so a walk going down from the
+// top meets every entry present throughout (some maybe twice), even
+// if entries are removed between steps.
+//
+token_entry *
+token_store_at(token_store *ts, size_t slot) {
+    return slot < ts->used ? entry_at(ts, slot) : NULL;
+}
+
+//
+// Inserts (or replaces) token entry.
+//
+token_entry *
+token_store_put(token_store *ts, const char *token, size_t len,
+                time_t issued, const unsigned char *realm,
+                const char *authinfo, size_t authinfo_len) {
+    token_entry *te;
+    uint64_t tag;
+    size_t slot;
+    char *ai;
+
+    if (len == 0 || len > TOKEN_LEN) return NULL;
+
+    if ((ai = malloc(authinfo_len + 1)) == NULL) return NULL;
+    memcpy(ai, authinfo, authinfo_len);
+    ai[authinfo_len] = '\0';
+
+    tag = hash(token, len);
+    if ((slot = *find(ts, tag, token, len)) != 0) {
+        te = entry_at(ts, slot - 1);
+    } else {
+        size_t n;
+
+        if ((te = append(ts, issued, tag)) == NULL) {
+            free(ai);
+            return NULL;
+        }
+        memcpy(te->token, token, len);
+
+        if (ts->used > ts->size) resize(ts, ts->size << 1);
+        token_store_rehash(ts, REHASH_STEPS);
+        n = tag & (ts->size - 1);
+        ts->link[te->slot] = ts->bucket[n];
+        ts->bucket[n] = te->slot + 1;
+    }
+    entry_clear(ts, te);
+    memset(&te->cache, 0, sizeof(te->cache));
+    ts->strings += authinfo_len + 1;
+    ts->issued[te->slot] = issued;
+    te->issued       = issued;
+    memcpy(te->realm, realm, AC_REALM_LEN);
+    te->authinfo     = ai;
+    te->authinfo_len = authinfo_len;
+    return te;
+}
+
+int
+token_store_remove(token_store *ts, const char *token, size_t len) {
+    size_t *pp;
+
+    if (len == 0 || len > TOKEN_LEN) return -1;
+
+    if (*(pp = find(ts, hash(token, len), token, len)) == 0) return -1;
+    unlink_entry(ts, pp);
+    return 0;
+}
+
+//
+// Removes all entries issued before deadline.
+// Given callback is called for each entry just before removal.
+//
+size_t
+token_store_expire(token_store *ts, time_t deadline,
+                   token_store_cb cb, void *ctx) {
+    size_t i = 0, n = 0;
+
+    while ((i = next_expired(ts, i, deadline)) < ts->used) {
+        if (cb) cb(entry_at(ts, i), ctx);
+        unlink_entry(ts, find_slot(ts, i));
+        n++; // slot i now holds what was last entry - check it again
+    }
+    return n;
+}
+
+//
+// Removes all entries given matcher returns true for.
+// Given callback is called for each entry just before removal.
+//
+size_t
+token_store_remove_if(token_store *ts, token_store_match match,
+                      token_store_cb cb, void *ctx) {
+    size_t i = 0, n = 0;
+
+    while (i < ts->used) {
+        token_entry *te = entry_at(ts, i);
+
+        if (! match(te, ctx)) {
+            i++;
+            continue;
+        }
+        if (cb) cb(te, ctx);
+        unlink_entry(ts, find_slot(ts, i));
+        n++;
+    }
+    return n;
+}
+
+void
+token_store_walk(token_store *ts, token_store_cb cb, void *ctx) {
+    size_t i;
+
+    for (i = 0; i < ts->used; i++) cb(entry_at(ts, i), ctx);
+}
+
+//
+// Hands part of previous table already moved over back to the kernel.
+// Freeing a large table at once means unmapping all its pages in one
+// go, which would stall the insert that happens to finish the move.
+// Buckets moved are all 0, and so read pages given back.
+//
+static void
+release_moved(token_store *ts) {
+    uintptr_t base = (uintptr_t)ts->old, mask = PAGE_BYTES - 1, from, to;
+
+    from = (base + ts->released + mask) & ~mask;
+    to   = (base + ts->moved * sizeof(*ts->old)) & ~mask;
+    if (to < from + RELEASE_BYTES) return;
+
+    madvise((void *)from, to - from, MADV_DONTNEED);
+    ts->released = to - base;
+}
+
+//
+// Moves up to given number of buckets over to the new table, if
+// resizing. Also starts shrinking table once most entries are gone,
+// so call this periodically even if nothing is inserted.
+//
+void
+token_store_rehash(token_store *ts, size_t steps) {
+    if (! ts->old && ts->size > INITIAL_SIZE && ts->used < ts->size / 8) {
+        resize(ts, ts->size >> 1);
+    }
+
+    while (ts->old && steps--) {
+        size_t s, next;
+
+        for (s = ts->old[ts->moved]; s; s = next) {
+            size_t n = ts->tags[s - 1] & (ts->size - 1);
+            next = ts->link[s - 1];
+            ts->link[s - 1] = ts->bucket[n];
+            ts->bucket[n] = s;
+        }
+        ts->old[ts->moved] = 0;
+
+        if (++ts->moved == ts->old_size) {
+            free(ts->old);
+            ts->old      = NULL;
+            ts->old_size = 0;
+            ts->moved    = 0;
+        }
+    }
+    if (ts->old) release_moved(ts);
+}
+
+//
+// Hands pages past the last entry (but a spare one) back to the
+// kernel. They stay mapped, to be faulted in again as zero pages
+// when the store grows. Call periodically, after expiry.
+//
+void
+token_store_compact(token_store *ts) {
+    size_t i, keep = (ts->used + PAGE_ENTRIES - 1) / PAGE_ENTRIES;
+    void *v;
+
+    if (ts->resident <= keep + SPARE_PAGES) return;
+    keep += SPARE_PAGES;
+
+    for (i = keep; i < ts->resident; i++) {
+        madvise(ts->page[i], PAGE_BYTES, MADV_DONTNEED);
+    }
+
+    // array failing to shrink is just left larger than needed
+    ts->slot_cap = keep * PAGE_ENTRIES;
+    if ((v = realloc(ts->issued, ts->slot_cap * sizeof(*ts->issued)))) {
+        ts->issued = v;
+    }
+    if ((v = realloc(ts->tags, ts->slot_cap * sizeof(*ts->tags)))) {
+        ts->tags = v;
+    }
+    if ((v = realloc(ts->link, ts->slot_cap * sizeof(*ts->link)))) {
+        ts->link = v;
+    }
+    ts->resident = keep;
+
+#ifdef __GLIBC__
+    malloc_trim(0); // authinfo of expired entries is freed by now
+#endif
+}
+
+//
+// Reports bytes held by entries, and by pages currently in use for
+// them. Both include authinfo strings.
+//
+void
+token_store_usage(token_store *ts, size_t *live, size_t *resident) {
+    size_t per_entry = sizeof(token_entry) + sizeof(time_t) +
+                       sizeof(uint64_t) + sizeof(size_t);
+
+    *live     = ts->used * per_entry + ts->strings;
+    *resident = ts->resident * PAGE_ENTRIES * per_entry + ts->strings;
+}
@@ -0,0 +1,73 @@
+#ifndef _AUTH_COOKIE_STORE_H_
+#define _AUTH_COOKIE_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "authcore.h"
+
+#define TOKEN_LEN 32 // max length of token in hex string
+#define TOKEN_REHASH_TICK 1024 // buckets to move per periodic rehash
+
+// token to authinfo pairing
+typedef struct token_entry {
+    char    token[TOKEN_LEN + 1];
+    unsigned char realm[AC_REALM_LEN]; // tenant it was minted for
+    time_t  issued;       // time this token was minted
+    size_t  slot;         // position in store (entries move!)
+    char   *authinfo;     // base64(username + ":" + password)
+    size_t  authinfo_len;
+    ac_session_cache cache; // for backends, built on first use
+} token_entry;
+
+// hash table of all tokens issued (or replicated) so far
+typedef struct {
+    size_t *bucket; // slot + 1 of first entry in chain, 0 if none
+    size_t size; // number of buckets, always power of 2
+    size_t used; // number of entries
+
+    // entries packed densely into pages, in slot order, with what
+    // expiry sweep and lookup scan kept apart in arrays by slot:
+    // issue time, hash of token, and slot + 1 of next in chain
+    time_t       *issued;
+    uint64_t     *tags;
+    size_t       *link;
+    token_entry **page;
+    size_t        npages;   // pages mapped
+    size_t        resident; // pages in use, or not released yet
+    size_t        page_cap; // room in page, grown geometrically
+    size_t        slot_cap; // room in arrays by slot, ditto
+    size_t        strings;  // bytes of authinfo held by entries
+
+    // while resizing, entries move over from previous table a few
+    // buckets at a time, so no single request pays for whole table
+    size_t *old;
+    size_t old_size;
+    size_t moved;    // buckets of previous table moved so far
+    size_t released; // bytes of previous table given back so far
+} token_store;
+
+typedef void (*token_store_cb)(token_entry *te, void *ctx);
+typedef int (*token_store_match)(token_entry *te, void *ctx);
+
+token_store *token_store_init(void);
+void token_store_free(token_store *ts);
+
+token_entry *token_store_get(token_store *ts, const char *token, size_t len);
+token_entry *token_store_at(token_store *ts, size_t slot);
+token_entry *token_store_put(token_store *ts, const char *token, size_t len,
+                             time_t issued, const unsigned char *realm,
+                             const char *authinfo, size_t authinfo_len);
+int token_store_remove(token_store *ts, const char *token, size_t len);
+
+size_t token_store_expire(token_store *ts, time_t deadline,
+                          token_store_cb cb, void *ctx);
+size_t token_store_remove_if(token_store *ts, token_store_match match,
+                             token_store_cb cb, void *ctx);
+void token_store_walk(token_store *ts, token_store_cb cb, void *ctx);
+void token_store_rehash(token_store *ts, size_t steps);
+void token_store_compact(token_store *ts);
+void token_store_usage(token_store *ts, size_t *live, size_t *resident);
+
+#endif
@@ -0,0 +1,191 @@
+//
+// Verified ticket cache.
+//
+// Public-key signature is far too expensive to check on every
+// request, so once a ticket is verified, it is remembered here
+// until the ticket itself expires. Key is a cryptographic hash
+// of the ticket, so its leading bytes serve as a hash value.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tcache.h"
+
+#define INITIAL_SIZE 64
+
+static size_t
+slot(tcache *tc, const unsigned char *hash) {
+    size_t h;
+
+    memcpy(&h, hash, sizeof(h));
+    return h & (tc->size - 1);
+}
+
+static void
+entry_free(tcache_entry *e) {
+    free(e->authinfo);
+    free(e->cache.assertion);
+    free(e);
+}
+
+static void
+grow(tcache *tc) {
+    size_t i, size = tc->size;
+    tcache_entry **old = tc->bucket;
+
+    if ((tc->bucket = calloc(size << 1, sizeof(*old))) == NULL) {
+        tc->bucket = old; // keep using current table
+        return;
+    }
+    tc->size = size << 1;
+
+    for (i = 0; i < size; i++) {
+        tcache_entry *e, *next;
+        for (e = old[i]; e; e = next) {
+            size_t n = slot(tc, e->hash);
+            next = e->next;
+            e->next = tc->bucket[n];
+            tc->bucket[n] = e;
+        }
+    }
+    free(old);
+}
+
+tcache *
+tcache_init(size_t max) {
+    tcache *tc = calloc(1, sizeof(*tc));
+
+    tc->size   = INITIAL_SIZE;
+    tc->max    = max;
+    tc->bucket = calloc(tc->size, sizeof(*tc->bucket));
+    return tc;
+}
+
+void
+tcache_free(tcache *tc) {
+    size_t i;
+
+    if (! tc) return;
+
+    for (i = 0; i < tc->size; i++) {
+        tcache_entry *e, *next;
+        for (e = tc->bucket[i]; e; e = next) {
+            next = e->next;
+            entry_free(e);
+        }
+    }
+    free(tc->bucket);
+    free(tc);
+}
+
+tcache_entry *
+tcache_get(tcache *tc, const unsigned char *hash,
+           const unsigned char *realm, time_t now) {
+    tcache_entry *e;
+
+    for (e = tc->bucket[slot(tc, hash)]; e; e = e->next) {
+        if (memcmp(e->hash, hash, AC_MD5_LEN) == 0) {
+            if (! ac_realm_equal(e->realm, realm)) return NULL;
+            return e->expires >= now ? e : NULL;
+        }
+    }
+    return NULL;
+}
+
+//
+// Remember ticket verified in given realm. Returns NULL if cache
+// is full.
+//
+tcache_entry *
+tcache_put(tcache *tc, const unsigned char *hash,
+           const unsigned char *realm, time_t expires,
+           ac_slice authinfo, ac_slice bind) {
+    tcache_entry *e;
+    char *ai;
+    size_t n;
+
+    if (bind.len >= TCACHE_BIND_MAX) return NULL;
+
+    // replace stale entry for the same ticket, if any
+    for (e = tc->bucket[slot(tc, hash)]; e; e = e->next) {
+        if (memcmp(e->hash, hash, AC_MD5_LEN) == 0) break;
+    }
+    if (! e && tc->used >= tc->max) return NULL;
+
+    if ((ai = malloc(authinfo.len + 1)) == NULL) return NULL;
+    memcpy(ai, authinfo.ptr, authinfo.len);
+    ai[authinfo.len] = '\0';
+
+    if (! e) {
+        if ((e = calloc(1, sizeof(*e))) == NULL) {
+            free(ai);
+            return NULL;
+        }
+        memcpy(e->hash, hash, AC_MD5_LEN);
+
+        if (tc->used >= tc->size) grow(tc);
+        n = slot(tc, hash);
+        e->next = tc->bucket[n];
+        tc->bucket[n] = e;
+        tc->used++;
+    }
+    free(e->authinfo);
+    free(e->cache.assertion);
+    memset(&e->cache, 0, sizeof(e->cache));
+    e->authinfo     = ai;
+    e->authinfo_len = authinfo.len;
+    e->expires      = expires;
+    memcpy(e->realm, realm, AC_REALM_LEN);
+    memcpy(e->bind, bind.ptr, bind.len);
+    e->bind[bind.len] = '\0';
+    return e;
+}
+
+size_t
+tcache_expire(tcache *tc, time_t now) {
+    size_t i, n = 0;
+
+    for (i = 0; i < tc->size; i++) {
+        tcache_entry **pp = &tc->bucket[i];
+        while (*pp) {
+            tcache_entry *e = *pp;
+            if (e->expires >= now) {
+                pp = &e->next;
+                continue;
+            }
+            *pp = e->next;
+            entry_free(e);
+            tc->used--;
+            n++;
+        }
+    }
+    return n;
+}
+
+//
+// Removes all entries given matcher returns true for.
+// Given callback is called for each entry just before removal.
+//
+size_t
+tcache_remove_if(tcache *tc, tcache_match match,
+                 tcache_cb cb, void *ctx) {
+    size_t i, n = 0;
+
+    for (i = 0; i < tc->size; i++) {
+        tcache_entry **pp = &tc->bucket[i];
+        while (*pp) {
+            tcache_entry *e = *pp;
+            if (! match(e, ctx)) {
+                pp = &e->next;
+                continue;
+            }
+            if (cb) cb(e, ctx);
+            *pp = e->next;
+            entry_free(e);
+            tc->used--;
+            n++;
+        }
+    }
+    return n;
+}
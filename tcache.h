@@ -0,0 +1,47 @@
+#ifndef _AUTH_COOKIE_TCACHE_H_
+#define _AUTH_COOKIE_TCACHE_H_
+
+#include <stddef.h>
+#include <time.h>
+
+#include "authcore.h"
+
+#define TCACHE_BIND_MAX 48 // enough for textual IPv6 address
+
+// verified ticket, keyed by hash of the ticket itself
+typedef struct tcache_entry {
+    struct tcache_entry *next;
+
+    unsigned char hash[AC_MD5_LEN];
+    unsigned char realm[AC_REALM_LEN]; // tenant it was verified for
+    time_t  expires;                 // ticket's own expiry
+    char   *authinfo;                // base64(username + ":" + password)
+    size_t  authinfo_len;
+    char    bind[TCACHE_BIND_MAX];   // client address bound to, or ""
+    ac_session_cache cache;          // for backends, built on first use
+} tcache_entry;
+
+// cache of tickets whose signature has already been verified
+typedef struct {
+    tcache_entry **bucket;
+    size_t size;  // number of buckets, always power of 2
+    size_t used;  // number of entries
+    size_t max;   // upper limit of entries
+} tcache;
+
+typedef int (*tcache_match)(tcache_entry *e, void *ctx);
+typedef void (*tcache_cb)(tcache_entry *e, void *ctx);
+
+tcache *tcache_init(size_t max);
+void tcache_free(tcache *tc);
+
+tcache_entry *tcache_get(tcache *tc, const unsigned char *hash,
+                         const unsigned char *realm, time_t now);
+tcache_entry *tcache_put(tcache *tc, const unsigned char *hash,
+                         const unsigned char *realm, time_t expires,
+                         ac_slice authinfo, ac_slice bind);
+size_t tcache_expire(tcache *tc, time_t now);
+size_t tcache_remove_if(tcache *tc, tcache_match match,
+                        tcache_cb cb, void *ctx);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef _AUTH_COOKIE_TESTS_CHECK_H_
+#define _AUTH_COOKIE_TESTS_CHECK_H_
+
+//
+// Minimal checks for test drivers: report each failure, keep going,
+// and make the exit status tell if anything failed.
+//
+
+#include <stdio.h>
+
+static int check_failed;
+
+#define CHECK(cond) do {                                                \
+        if (! (cond)) {                                                 \
+            fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                    __FILE__, __LINE__, #cond);                         \
+            check_failed++;                                             \
+        }                                                               \
+    } while (0)
+
+static int
+check_done(const char *name) {
+    printf("%s: %s\n", name, check_failed ? "FAIL" : "ok");
+    return check_failed ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,320 @@
+//
+// Hostile input through the cookie path, under fixed time budgets.
+//
+// Each case feeds input crafted to hit the slow path of a parser
+// (near-miss cookie names, bad escapes, odd or non-hex digits,
+// garbage behind a valid signature, invalid base64) at two sizes,
+// and checks that:
+//
+//   - cost grows linearly: 8x input may take at most 24x time
+//     (linear is 8x, quadratic would be 64x),
+//   - the largest input a client can send stays within a budget,
+//   - nothing is allocated on the way.
+//
+// request() does what module_uri_handler() does to a "crypt:"
+// cookie, minus lighttpd: find, length check, unescape, dispatch
+// on prefix, verify and decrypt, and extract username.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "check.h"
+#include "authcore.h"
+#include "base64.h"
+#include "md5.h"
+
+#define INPUT_MAX   (1024 * 1024)
+#define HEADER_MAX  (64 * 1024)   // more than lighttpd takes in a header
+#define GROWTH      8
+#define GROWTH_MAX  24            // 3x slack over linear for noise
+#define ROUNDS      5
+
+#define KEY "secret"
+
+static char   input[INPUT_MAX + 1];
+static size_t input_len;
+static time_t now;
+static volatile int sink; // keeps work from being optimized out
+
+static size_t
+heap_in_use(void) {
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+    return mallinfo2().uordblks;
+#else
+    return 0;
+#endif
+}
+
+static double
+seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//
+// Best (least disturbed) time of a single call, over several rounds.
+//
+static double
+per_call(void (*work)(void), int reps) {
+    double best = 1e9;
+    int r, i;
+
+    for (r = 0; r < ROUNDS; r++) {
+        double t = seconds();
+
+        for (i = 0; i < reps; i++) work();
+        t = (seconds() - t) / reps;
+        if (t < best) best = t;
+    }
+    return best;
+}
+
+//
+// Run given case at size n and n * GROWTH, then check growth and
+// budget of the larger one.
+//
+static void
+run(const char *name, void (*build)(size_t), void (*work)(void),
+    size_t n, int reps, double budget) {
+    double small, large;
+    size_t heap;
+
+    build(n);
+    small = per_call(work, reps);
+
+    build(n * GROWTH);
+    heap = heap_in_use();
+    large = per_call(work, reps);
+    CHECK(heap_in_use() == heap);
+
+    printf("  %-24s %8zu bytes %9.1f us (%4.1fx)\n",
+           name, input_len, large * 1e6, large / small);
+    CHECK(large / small < GROWTH_MAX);
+    CHECK(large < budget);
+}
+
+static int
+request(ac_slice header) {
+    char buf[AC_COOKIE_MAX], authinfo[AC_AUTHINFO_MAX], user[AC_USER_MAX];
+    size_t authinfo_len, user_len;
+    ac_slice cv;
+    int rc;
+
+    if (ac_cookie_find(header, AC_STR("AuthName"), &cv) != AC_OK) {
+        return AC_EFORMAT;
+    }
+    if (cv.len >= sizeof(buf)) return AC_EFORMAT;
+
+    cv.len = ac_urldecode(buf, cv);
+    if (cv.len < 6 || memcmp(buf, "crypt:", 6) != 0) return AC_EFORMAT;
+
+    rc = ac_crypt_verify(AC_STR(KEY), AC_SLICE(buf + 6, cv.len - 6), now,
+                         authinfo, &authinfo_len);
+    if (rc != AC_OK) return rc;
+    return ac_authinfo_user(AC_SLICE(authinfo, authinfo_len),
+                            user, &user_len);
+}
+
+//
+// Sign given data part as the login page would (no encryption, as
+// garbage is what we want here), and return "<hash>:<data>".
+//
+static size_t
+sign(char *out, const char *data) {
+    unsigned char hash[AC_MD5_LEN];
+    char tmp[32];
+    MD5_CTX ctx;
+
+    snprintf(tmp, sizeof(tmp), "%lu", (unsigned long)(now - now % 5));
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, KEY, strlen(KEY));
+    MD5_Update(&ctx, tmp, strlen(tmp));
+    MD5_Update(&ctx, data, strlen(data));
+    MD5_Final(hash, &ctx);
+
+    ac_hex_encode(out, hash, sizeof(hash));
+    out[AC_MD5_LEN * 2] = ':';
+    strcpy(out + AC_MD5_LEN * 2 + 1, data);
+    return strlen(out);
+}
+
+static void
+fill(size_t n, const char *pattern) {
+    size_t len = strlen(pattern), i;
+
+    if (n > INPUT_MAX) n = INPUT_MAX;
+    for (i = 0; i < n; i++) input[i] = pattern[i % len];
+    input[n] = '\0';
+    input_len = n;
+}
+
+/**********************************************************************
+ * cases
+ **********************************************************************/
+
+// thousands of names that start like the one looked for
+static void
+build_near_miss(size_t n) {
+    static const char *names[] = { "AuthNameX", "AuthNam", "XAuthName",
+                                   "AuthName X", "AuthNameAuthName" };
+    size_t i = 0;
+
+    input_len = 0;
+    while (input_len + 40 < n) {
+        input_len += sprintf(input + input_len, "%s=%s; ",
+                             names[i++ % 5], "crypt:00");
+    }
+    input_len += sprintf(input + input_len, "AuthName=crypt:00");
+}
+
+static void
+work_request(void) {
+    sink += request(AC_SLICE(input, input_len));
+}
+
+// no cookie at all, only a very long value of some other one
+static void
+build_long_other(size_t n) {
+    fill(n, "other=%41%4%%4");
+}
+
+// escapes everywhere, in a value too long to be taken
+static void
+build_escaped_cookie(size_t n) {
+    fill(n, "%41%");
+    memcpy(input, "AuthName=crypt:", 15);
+}
+
+// escapes, valid and not, straight into the unescaper
+static void
+build_escaped(size_t n) {
+    fill(n, "%41%4g%%%");
+}
+
+static void
+work_urldecode(void) {
+    static char out[INPUT_MAX];
+
+    sink += ac_urldecode(out, AC_SLICE(input, input_len));
+}
+
+// odd number of hex digits
+static void
+build_odd_hex(size_t n) {
+    fill(n | 1, "0123456789abcdef");
+}
+
+static void
+work_hex_decode(void) {
+    static unsigned char out[INPUT_MAX / 2 + 1];
+
+    sink += ac_hex_decode(out, AC_SLICE(input, input_len));
+}
+
+// data part behind a plausible hash, with its only non-hex digit
+// at the very end, where it takes longest to find
+static void
+build_bad_data(size_t n) {
+    size_t len = n < AC_AUTHINFO_MAX * 2 ? n : AC_AUTHINFO_MAX * 2 - 2;
+
+    fill(AC_MD5_LEN * 2 + 1 + (len & ~1), "0123456789abcdef");
+    input[AC_MD5_LEN * 2] = ':';
+    input[input_len - 1] = 'g';
+}
+
+static void
+work_crypt_verify(void) {
+    char authinfo[AC_AUTHINFO_MAX];
+    size_t len;
+
+    sink += ac_crypt_verify(AC_STR(KEY), AC_SLICE(input, input_len), now,
+                            authinfo, &len);
+}
+
+// validly signed, but decrypts to non-printable bytes
+static void
+build_garbage_payload(size_t n) {
+    static char data[AC_AUTHINFO_MAX * 2];
+    size_t len = n / 2 < AC_AUTHINFO_MAX ? n / 2 : AC_AUTHINFO_MAX - 1, i;
+
+    for (i = 0; i < len; i++) {
+        sprintf(data + i * 2, "%02x", (unsigned)(i * 131 + 7) & 0xff);
+    }
+    data[len * 2] = '\0';
+    input_len = sign(input, data);
+}
+
+// invalid bytes with a base64 character here and there
+static void
+build_bad_base64(size_t n) {
+    fill(n, "\x01\xff!@#$A%^&*()\x80~`Q[]{}|\\\"'<>?,.");
+}
+
+static void
+work_base64(void) {
+    static unsigned char out[BASE64_DECODED_MAX(INPUT_MAX)];
+
+    sink += base64_decode(out, input, input_len);
+}
+
+static void
+work_authinfo_user(void) {
+    char user[AC_USER_MAX];
+    size_t len;
+
+    sink += ac_authinfo_user(AC_SLICE(input, input_len), user, &len);
+}
+
+int
+main(void) {
+    char buf[AC_AUTHINFO_MAX];
+    size_t len;
+
+    now = time(NULL);
+
+    // sanity: the pieces do reject what they should
+    build_near_miss(4096);
+    CHECK(request(AC_SLICE(input, input_len)) == AC_EFORMAT);
+    build_odd_hex(64);
+    CHECK(ac_hex_decode((unsigned char *)buf, AC_SLICE(input, 3)) == 1);
+    build_bad_data(64);
+    CHECK(ac_crypt_verify(AC_STR(KEY), AC_SLICE(input, input_len), now,
+                          buf, &len) == AC_EFORMAT);
+    input[input_len - 1] = '0';
+    CHECK(ac_crypt_verify(AC_STR(KEY), AC_SLICE(input, input_len - 1), now,
+                          buf, &len) == AC_EFORMAT);
+    build_garbage_payload(64);
+    CHECK(ac_crypt_verify(AC_STR(KEY), AC_SLICE(input, input_len), now,
+                          buf, &len) == AC_EDECRYPT);
+    CHECK(base64_decode((unsigned char *)buf, "\x01!@#", 4) == 0);
+
+    printf("adversarial (%dx input, at most %dx time):\n",
+           GROWTH, GROWTH_MAX);
+    run("cookie near-miss names", build_near_miss, work_request,
+        HEADER_MAX / GROWTH, 200, 2e-3);
+    run("cookie long other value", build_long_other, work_request,
+        HEADER_MAX / GROWTH, 200, 2e-3);
+    run("cookie escaped too long", build_escaped_cookie, work_request,
+        HEADER_MAX / GROWTH, 200, 2e-3);
+    run("urldecode bad escapes", build_escaped, work_urldecode,
+        INPUT_MAX / GROWTH, 20, 20e-3);
+    run("hex odd length", build_odd_hex, work_hex_decode,
+        INPUT_MAX / GROWTH, 20, 20e-3);
+    run("crypt non-hex data", build_bad_data, work_crypt_verify,
+        AC_AUTHINFO_MAX / 4, 2000, 100e-6);
+    run("crypt garbage payload", build_garbage_payload, work_crypt_verify,
+        AC_AUTHINFO_MAX / 4, 2000, 200e-6);
+    run("base64 invalid bytes", build_bad_base64, work_base64,
+        INPUT_MAX / GROWTH, 20, 20e-3);
+    run("authinfo invalid base64", build_bad_base64, work_authinfo_user,
+        AC_AUTHINFO_MAX / GROWTH, 2000, 100e-6);
+
+    return check_done("adversarial");
+}
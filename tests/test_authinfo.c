@@ -0,0 +1,44 @@
+//
+// Authinfo built for users verified by ticket schemes.
+//
+
+#include "check.h"
+#include "authcore.h"
+
+static int
+roundtrip(const char *name, char *user) {
+    char authinfo[AC_AUTHINFO_MAX];
+    size_t authinfo_len, user_len;
+
+    if (ac_user_authinfo(AC_STR(name), authinfo, &authinfo_len) != AC_OK) {
+        return AC_EFORMAT;
+    }
+    return ac_authinfo_user(AC_SLICE(authinfo, authinfo_len),
+                            user, &user_len);
+}
+
+int
+main(void) {
+    char user[AC_USER_MAX], name[AC_USER_MAX + 1];
+
+    CHECK(roundtrip("alice", user) == AC_OK && strcmp(user, "alice") == 0);
+    CHECK(roundtrip("bob@example.com", user) == AC_OK &&
+          strcmp(user, "bob@example.com") == 0);
+
+    // would come out as REMOTE_USER "admin"
+    CHECK(roundtrip("admin:x", user) == AC_EFORMAT);
+    CHECK(roundtrip(":", user) == AC_EFORMAT);
+
+    CHECK(roundtrip("", user) == AC_EFORMAT);
+    CHECK(roundtrip("eve\r\nX-Forwarded-User: admin", user) == AC_EFORMAT);
+    CHECK(roundtrip("eve\t", user) == AC_EFORMAT);
+    CHECK(roundtrip("eve\x7f", user) == AC_EFORMAT);
+
+    memset(name, 'a', AC_USER_MAX);
+    name[AC_USER_MAX] = '\0';
+    CHECK(roundtrip(name, user) == AC_EFORMAT);
+    name[AC_USER_MAX - 1] = '\0';
+    CHECK(roundtrip(name, user) == AC_OK);
+
+    return check_done("authinfo");
+}
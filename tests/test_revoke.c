@@ -0,0 +1,51 @@
+//
+// Revocation list loading.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "check.h"
+#include "revoke.h"
+
+static void
+load(ac_revoked **set, const char *text) {
+    char path[] = "/tmp/test_revoke.XXXXXX";
+    int fd = mkstemp(path);
+
+    CHECK(fd >= 0);
+    CHECK(write(fd, text, strlen(text)) == (ssize_t)strlen(text));
+    close(fd);
+
+    ac_revoked_free(*set);
+    *set = NULL;
+    CHECK(ac_revoked_reload(set, path) == 1);
+    unlink(path);
+}
+
+int
+main(void) {
+    ac_revoked *set = NULL;
+
+    // names are moved over comments and CR, so must be hashed after it
+    load(&set, "#\nadministrator\r\nwebmaster-ops\r\nbackup-operator\r\n");
+    CHECK(set->count == 3);
+    CHECK(ac_revoked_has(set, AC_STR("administrator")));
+    CHECK(ac_revoked_has(set, AC_STR("webmaster-ops")));
+    CHECK(ac_revoked_has(set, AC_STR("backup-operator")));
+    CHECK(! ac_revoked_has(set, AC_STR("admin")));
+
+    load(&set, "\n  alice\t\n# bob\n\ncarol\ncarol\ndave");
+    CHECK(set->count == 3);
+    CHECK(ac_revoked_has(set, AC_STR("alice")));
+    CHECK(! ac_revoked_has(set, AC_STR("bob")));
+    CHECK(ac_revoked_has(set, AC_STR("carol")));
+    CHECK(ac_revoked_has(set, AC_STR("dave")));
+
+    load(&set, "");
+    CHECK(! ac_revoked_has(set, AC_STR("alice")));
+
+    ac_revoked_free(set);
+    return check_done("revoke");
+}
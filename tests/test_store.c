@@ -0,0 +1,102 @@
+//
+// Token store: worst single insert as the store grows.
+//
+// Store is filled from empty to given number of tokens (10M by
+// default), timing every insert. Worst time in each decade of size
+// must stay within a fixed budget, i.e. no insert pays for growing
+// the whole table (or any array of the store) at once, however big
+// the store already is.
+//
+// Time is CPU time of the thread (including page faults and system
+// calls made), so that being preempted does not count against it.
+// Store is filled twice, and each insert is taken at the better of
+// its two times: growth happens at the same insert in both rounds,
+// while a stray stall of the host (reclaim, compaction) does not.
+//
+// Needs some 2GB of memory at 10M tokens; give smaller count as
+// argument on small machines.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "check.h"
+#include "store.h"
+
+#define COUNT_DEFAULT 10000000
+#define ROUNDS        2
+#define BUDGET        2e-3 // seconds, worst single insert
+#define AUTHINFO      "YWxpY2U6c2VjcmV0" // alice:secret
+
+static double
+seconds(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+token_of(char *token, size_t i) {
+    snprintf(token, TOKEN_LEN + 1, "%016zx%016zx", i * 2654435761u, i);
+}
+
+//
+// Fill a new store, keeping the best time of each insert so far.
+//
+static void
+fill(size_t count, float *best) {
+    token_store *ts = token_store_init();
+    char token[TOKEN_LEN + 1];
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        double t;
+
+        token_of(token, i);
+        t = seconds();
+        token_store_put(ts, token, TOKEN_LEN, 1, ac_no_realm,
+                        AUTHINFO, strlen(AUTHINFO));
+        t = seconds() - t;
+        if (t < best[i]) best[i] = t;
+    }
+    CHECK(ts->used == count);
+    CHECK(token_store_get(ts, token, TOKEN_LEN) != NULL);
+    token_store_free(ts);
+}
+
+int
+main(int argc, char *argv[]) {
+    size_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : COUNT_DEFAULT;
+    size_t i, band = 1000, band_start = 0;
+    double worst = 0, total = 0;
+    float *best;
+    int r;
+
+    if ((best = malloc(count * sizeof(*best))) == NULL) {
+        fprintf(stderr, "store: out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < count; i++) best[i] = 1e9;
+    for (r = 0; r < ROUNDS; r++) fill(count, best);
+
+    printf("store growth to %zu tokens (budget %.1f ms):\n",
+           count, BUDGET * 1e3);
+    for (i = 0; i < count; i++) {
+        total += best[i];
+        if (best[i] > worst) worst = best[i];
+
+        if (i + 1 == band || i + 1 == count) {
+            printf("  %9zu - %9zu: worst %7.1f us, mean %5.2f us\n",
+                   band_start, i + 1, worst * 1e6,
+                   total / (i + 1 - band_start) * 1e6);
+            CHECK(worst < BUDGET);
+            band_start = i + 1;
+            band *= 10;
+            worst = total = 0;
+        }
+    }
+    free(best);
+    return check_done("store");
+}
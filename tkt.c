@@ -0,0 +1,134 @@
+//
+// mod_auth_tkt compatible ticket.
+//
+// Ticket Format:
+//   <digest><ts><uid>!<tokens>!<udata>   (or <digest><ts><uid>!<udata>)
+//
+//   ts     = hex(issued time, 8 digits)
+//   digest = hex(H(hex(H(ip + ts + secret + uid + "\0" +
+//                        tokens + "\0" + udata)) + secret))
+//
+// where ip and ts are 4-byte big-endian binaries, and H is MD5,
+// SHA256 or SHA512. Everything is verified in place, so resulting
+// ac_tkt points into the given ticket.
+//
+
+#include <ctype.h>
+#include <stdint.h>
+#include <strings.h>
+
+#include "tkt.h"
+#include "md5.h"
+
+#ifdef USE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+#define TS_LEN 8
+
+static const size_t digest_len[] = { 32, 64, 128 }; // in hex
+
+//
+// Hash concatenation of given parts into hex-encoded digest.
+// Returns length of the digest, or 0 if not supported.
+//
+static size_t
+digest_hex(int type, const ac_slice *part, size_t n, char *hex) {
+    unsigned char md[64];
+    size_t i, len;
+
+    if (type == AC_TKT_MD5) {
+        MD5_CTX ctx;
+
+        MD5_Init(&ctx);
+        for (i = 0; i < n; i++) MD5_Update(&ctx, part[i].ptr, part[i].len);
+        MD5_Final(md, &ctx);
+        len = AC_MD5_LEN;
+    } else {
+#ifdef USE_OPENSSL
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        unsigned int mdlen = 0;
+        int ok;
+
+        if (! ctx) return 0;
+        ok = EVP_DigestInit_ex(ctx, type == AC_TKT_SHA256
+                               ? EVP_sha256() : EVP_sha512(), NULL);
+        for (i = 0; ok && i < n; i++) {
+            ok = EVP_DigestUpdate(ctx, part[i].ptr, part[i].len);
+        }
+        ok = ok && EVP_DigestFinal_ex(ctx, md, &mdlen);
+        EVP_MD_CTX_free(ctx);
+        if (! ok) return 0;
+        len = mdlen;
+#else
+        return 0;
+#endif
+    }
+    return ac_hex_encode(hex, md, len);
+}
+
+//
+// Map digest name (as in TKTAuthDigestType) to type, or -1.
+//
+int
+ac_tkt_digest_type(const char *name) {
+    if (strcasecmp(name, "MD5") == 0) return AC_TKT_MD5;
+#ifdef USE_OPENSSL
+    if (strcasecmp(name, "SHA256") == 0) return AC_TKT_SHA256;
+    if (strcasecmp(name, "SHA512") == 0) return AC_TKT_SHA512;
+#endif
+    return -1;
+}
+
+//
+// Verify ticket issued to given client address (0.0.0.0 when address
+// is not checked). Timestamp is left to the caller to check.
+//
+int
+ac_tkt_verify(ac_slice secret, ac_slice ticket,
+              const unsigned char ip[4], int type, ac_tkt *t) {
+    const char *p, *bang, *end = ticket.ptr + ticket.len;
+    char digest0[128 + 1], digest[128 + 1];
+    unsigned char ipts[8];
+    size_t i, n;
+
+    if (type < AC_TKT_MD5 || type > AC_TKT_SHA512) return AC_EFORMAT;
+    n = digest_len[type];
+    if (ticket.len < n + TS_LEN + 1) return AC_EFORMAT;
+
+    // issued time
+    p = ticket.ptr + n;
+    for (i = 0; i < TS_LEN; i++) {
+        if (! isxdigit((unsigned char)p[i])) return AC_EFORMAT;
+    }
+    memcpy(ipts, ip, 4);
+    ac_hex_decode(ipts + 4, AC_SLICE(p, TS_LEN));
+    t->ts = (time_t)((uint32_t)ipts[4] << 24 | ipts[5] << 16 |
+                     ipts[6] << 8 | ipts[7]);
+
+    // uid!tokens!udata, where tokens are optional
+    p += TS_LEN;
+    if ((bang = memchr(p, '!', end - p)) == NULL) return AC_EFORMAT;
+    t->uid = AC_SLICE(p, bang - p);
+    p = bang + 1;
+    if ((bang = memchr(p, '!', end - p)) != NULL) {
+        t->tokens = AC_SLICE(p, bang - p);
+        p = bang + 1;
+    } else {
+        t->tokens = AC_SLICE(p, 0);
+    }
+    t->udata = AC_SLICE(p, end - p);
+
+    // compute digest in two rounds
+    ac_slice part0[] = {
+        AC_SLICE((const char *)ipts, sizeof(ipts)), secret,
+        t->uid, AC_SLICE("", 1), t->tokens, AC_SLICE("", 1), t->udata,
+    };
+    if (digest_hex(type, part0, 7, digest0) != n) return AC_EFORMAT;
+
+    ac_slice part1[] = { AC_SLICE(digest0, n), secret };
+    if (digest_hex(type, part1, 2, digest) != n) return AC_EFORMAT;
+
+    if (strncasecmp(digest, ticket.ptr, n) != 0) return AC_EVERIFY;
+    return AC_OK;
+}
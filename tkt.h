@@ -0,0 +1,23 @@
+#ifndef _AUTH_COOKIE_TKT_H_
+#define _AUTH_COOKIE_TKT_H_
+
+#include "authcore.h"
+
+// digest types, as TKTAuthDigestType of mod_auth_tkt
+#define AC_TKT_MD5    0
+#define AC_TKT_SHA256 1
+#define AC_TKT_SHA512 2
+
+// mod_auth_tkt ticket, as slices into the original cookie value
+typedef struct {
+    ac_slice uid;
+    ac_slice tokens;
+    ac_slice udata;
+    time_t   ts;     // time ticket was issued
+} ac_tkt;
+
+int ac_tkt_digest_type(const char *name);
+int ac_tkt_verify(ac_slice secret, ac_slice ticket,
+                  const unsigned char ip[4], int type, ac_tkt *t);
+
+#endif
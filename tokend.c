@@ -0,0 +1,355 @@
+//
+// Non-blocking client for authtokend.
+//
+// Requests are only queued by tokend_*() calls, and written out
+// together once the socket becomes writable, so all lookups made
+// within one round of event loop go out in a single write. Replies
+// come back in request order, so pending requests are kept in a
+// simple FIFO.
+//
+// Put is only done once authtokend says so. Until then, its body is
+// kept along with the request, and if connection is lost first, it
+// is handed back to the caller to be kept elsewhere.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/un.h>
+
+#include "tokend.h"
+#include "tokend_proto.h"
+#include "log.h"
+#include "fdevent.h"
+
+#define TOKEND_TIMEOUT 5 // seconds to wait for reply before giving up
+
+typedef struct {
+    uint32_t  id;
+    time_t    sent;
+    tokend_cb cb;  // NULL if nobody cares about reply
+    void     *ctx;
+    char     *put; // body of put request, until acknowledged
+    size_t    put_len;
+} pending;
+
+struct tokend {
+    buffer *path;
+    int     fd;
+    int     fde_ndx;
+    time_t  last_connect;
+
+    char   *out;             // requests not yet written
+    size_t  outlen, outsize;
+
+    char    in[TOKEND_FRAME_MAX * 2];
+    size_t  inlen;
+
+    pending *pend;           // ring buffer of requests waiting for reply
+    size_t   head, npend, psize;
+    uint32_t next_id;
+
+    tokend_lost_cb lost;     // where unacknowledged puts go
+    void          *lost_ctx;
+};
+
+//
+// hand body of put request back to the caller.
+//
+static void
+put_lost(server *srv, tokend *td, pending *p) {
+    const char *b = p->put, *token = b + TOKEND_PUT_HEAD;
+    size_t toklen = (uint8_t)b[TOKEND_PUT_HEAD - 1];
+
+    if (td->lost) {
+        td->lost(srv, td->lost_ctx, token, toklen, TOKEND_GET32(b),
+                 (const unsigned char *)b + 4, token + toklen,
+                 p->put_len - TOKEND_PUT_HEAD - toklen);
+    }
+    free(p->put);
+    p->put = NULL;
+}
+
+static void
+disconnect(server *srv, tokend *td) {
+    if (td->fd < 0) return;
+
+    fdevent_event_del(srv->ev, &td->fde_ndx, td->fd);
+    fdevent_unregister(srv->ev, td->fd);
+    close(td->fd);
+    td->fd     = -1;
+    td->outlen = 0;
+    td->inlen  = 0;
+
+    // nothing will be answered any more
+    while (td->npend) {
+        pending *p = &td->pend[td->head];
+        td->head = (td->head + 1) & (td->psize - 1);
+        td->npend--;
+        if (p->cb) p->cb(srv, p->ctx, 0, 0, NULL, NULL, 0);
+        if (p->put) put_lost(srv, td, p);
+    }
+}
+
+static int
+do_write(tokend *td) {
+    ssize_t n = write(td->fd, td->out, td->outlen);
+
+    if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    memmove(td->out, td->out + n, td->outlen - n);
+    td->outlen -= n;
+    return 0;
+}
+
+static int
+do_read(server *srv, tokend *td) {
+    for (;;) {
+        size_t off = 0;
+        ssize_t n = read(td->fd, td->in + td->inlen,
+                         sizeof(td->in) - td->inlen);
+
+        if (n == 0) return -1;
+        if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        td->inlen += n;
+
+        while (td->inlen - off >= 2) {
+            const char *f = td->in + off;
+            size_t len = TOKEND_GET16(f) + 2;
+            pending *p;
+
+            if (len < TOKEND_HEADER_LEN || len > TOKEND_FRAME_MAX) return -1;
+            if (td->inlen - off < len) break;
+
+            // replies come back in order
+            p = &td->pend[td->head];
+            if (td->npend == 0 || p->id != TOKEND_GET32(f + 2)) return -1;
+            td->head = (td->head + 1) & (td->psize - 1);
+            td->npend--;
+
+            if (p->cb && f[6] == TOKEND_FOUND &&
+                len >= TOKEND_HEADER_LEN + TOKEND_FOUND_HEAD) {
+                const char *b = f + TOKEND_HEADER_LEN;
+
+                p->cb(srv, p->ctx, 1, TOKEND_GET32(b),
+                      (const unsigned char *)b + 4, b + TOKEND_FOUND_HEAD,
+                      len - TOKEND_HEADER_LEN - TOKEND_FOUND_HEAD);
+            } else if (p->cb) {
+                p->cb(srv, p->ctx, 0, 0, NULL, NULL, 0);
+            }
+            if (p->put && f[6] == TOKEND_OK) {
+                free(p->put);
+                p->put = NULL;
+            } else if (p->put) {
+                put_lost(srv, td, p);
+            }
+            off += len;
+        }
+        memmove(td->in, td->in + off, td->inlen - off);
+        td->inlen -= off;
+    }
+}
+
+static handler_t
+tokend_handle_fdevent(server *srv, void *ctx, int revents) {
+    tokend *td = ctx;
+
+    if ((revents & FDEVENT_OUT) && do_write(td) != 0) {
+        disconnect(srv, td);
+        return HANDLER_GO_ON;
+    }
+    if ((revents & (FDEVENT_IN | FDEVENT_HUP | FDEVENT_ERR)) &&
+        do_read(srv, td) != 0) {
+        log_error_write(srv, __FILE__, __LINE__, "sb",
+                        "tokend: lost connection to", td->path);
+        disconnect(srv, td);
+        return HANDLER_GO_ON;
+    }
+    if (td->fd >= 0 && td->outlen == 0) {
+        fdevent_event_add(srv->ev, &td->fde_ndx, td->fd, FDEVENT_IN);
+    }
+    return HANDLER_GO_ON;
+}
+
+static int
+connect_to(server *srv, tokend *td) {
+    struct sockaddr_un sun;
+
+    if (td->fd >= 0) return 0;
+
+    // avoid hammering dead daemon on every request
+    if (td->last_connect == srv->cur_ts) return -1;
+    td->last_connect = srv->cur_ts;
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, td->path->ptr, sizeof(sun.sun_path) - 1);
+
+    if ((td->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+    fcntl(td->fd, F_SETFD, FD_CLOEXEC);
+    fcntl(td->fd, F_SETFL, O_NONBLOCK | O_RDWR);
+
+    if (connect(td->fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        log_error_write(srv, __FILE__, __LINE__, "sbss",
+                        "tokend: cannot connect to", td->path, ":",
+                        strerror(errno));
+        close(td->fd);
+        td->fd = -1;
+        return -1;
+    }
+
+    td->fde_ndx = -1;
+    fdevent_register(srv->ev, td->fd, tokend_handle_fdevent, td);
+    fdevent_event_add(srv->ev, &td->fde_ndx, td->fd, FDEVENT_IN);
+    return 0;
+}
+
+//
+// queue a request frame, expecting a reply for it.
+//
+static int
+send_request(server *srv, tokend *td, char code, tokend_cb cb, void *ctx,
+             const char *b0, size_t l0, const char *b1, size_t l1) {
+    size_t len = TOKEND_HEADER_LEN + l0 + l1;
+    pending *p;
+    char *f;
+
+    if (len > TOKEND_FRAME_MAX || connect_to(srv, td) != 0) return -1;
+
+    if (td->outlen + len > td->outsize) {
+        size_t size = (td->outsize + len) * 2;
+        if ((f = realloc(td->out, size)) == NULL) return -1;
+        td->out     = f;
+        td->outsize = size;
+    }
+    if (td->npend == td->psize) {
+        size_t i, size = td->psize ? td->psize * 2 : 64;
+        pending *pend = malloc(size * sizeof(*pend));
+
+        if (! pend) return -1;
+        for (i = 0; i < td->npend; i++) {
+            pend[i] = td->pend[(td->head + i) & (td->psize - 1)];
+        }
+        free(td->pend);
+        td->pend  = pend;
+        td->psize = size;
+        td->head  = 0;
+    }
+
+    p = &td->pend[(td->head + td->npend++) & (td->psize - 1)];
+    p->id   = td->next_id++;
+    p->sent = srv->cur_ts;
+    p->cb   = cb;
+    p->ctx  = ctx;
+    p->put  = NULL;
+
+    f = td->out + td->outlen;
+    TOKEND_PUT16(f, len - 2);
+    TOKEND_PUT32(f + 2, p->id);
+    f[6] = code;
+    memcpy(f + TOKEND_HEADER_LEN, b0, l0);
+    memcpy(f + TOKEND_HEADER_LEN + l0, b1, l1);
+    td->outlen += len;
+
+    fdevent_event_add(srv->ev, &td->fde_ndx, td->fd, FDEVENT_IN | FDEVENT_OUT);
+    return 0;
+}
+
+/**********************************************************************
+ * interface
+ **********************************************************************/
+
+tokend *
+tokend_init(server *srv, buffer *path, tokend_lost_cb lost, void *lost_ctx) {
+    tokend *td = calloc(1, sizeof(*td));
+
+    UNUSED(srv);
+
+    td->path     = buffer_init_buffer(path);
+    td->fd       = -1;
+    td->fde_ndx  = -1;
+    td->lost     = lost;
+    td->lost_ctx = lost_ctx;
+    return td;
+}
+
+void
+tokend_free(server *srv, tokend *td) {
+    if (! td) return;
+
+    td->lost = NULL; // nowhere to keep them any more
+    disconnect(srv, td);
+    buffer_free(td->path);
+    free(td->out);
+    free(td->pend);
+    free(td);
+}
+
+int
+tokend_get(server *srv, tokend *td, const char *token, size_t len,
+           tokend_cb cb, void *ctx) {
+    return send_request(srv, td, TOKEND_GET, cb, ctx, token, len, NULL, 0);
+}
+
+int
+tokend_put(server *srv, tokend *td, const char *token, size_t len,
+           time_t issued, const unsigned char *realm,
+           const char *authinfo, size_t authinfo_len) {
+    char head[TOKEND_PUT_HEAD + 255], *put;
+    size_t head_len = TOKEND_PUT_HEAD + len;
+    size_t put_len = head_len + authinfo_len;
+    pending *p;
+
+    if (len > 255 || (put = malloc(put_len)) == NULL) return -1;
+
+    TOKEND_PUT32(head, (uint32_t)issued);
+    memcpy(head + 4, realm, AC_REALM_LEN);
+    head[TOKEND_PUT_HEAD - 1] = len;
+    memcpy(head + TOKEND_PUT_HEAD, token, len);
+    if (send_request(srv, td, TOKEND_PUT, NULL, NULL,
+                     head, head_len, authinfo, authinfo_len) != 0) {
+        free(put);
+        return -1;
+    }
+
+    // keep it until acknowledged (last one queued is the put)
+    memcpy(put, head, head_len);
+    memcpy(put + head_len, authinfo, authinfo_len);
+    p = &td->pend[(td->head + td->npend - 1) & (td->psize - 1)];
+    p->put     = put;
+    p->put_len = put_len;
+    return 0;
+}
+
+int
+tokend_remove(server *srv, tokend *td, const char *token, size_t len) {
+    return send_request(srv, td, TOKEND_REMOVE, NULL, NULL, token, len, NULL, 0);
+}
+
+//
+// Forget callback context - used when connection goes away
+// while waiting for reply.
+//
+void
+tokend_cancel(tokend *td, void *ctx) {
+    size_t i;
+
+    if (! td) return;
+
+    for (i = 0; i < td->npend; i++) {
+        pending *p = &td->pend[(td->head + i) & (td->psize - 1)];
+        if (p->ctx == ctx) p->cb = NULL;
+    }
+}
+
+void
+tokend_trigger(server *srv, tokend *td) {
+    if (! td) return;
+
+    // give up on daemon not answering for too long
+    if (td->npend && srv->cur_ts - td->pend[td->head].sent > TOKEND_TIMEOUT) {
+        log_error_write(srv, __FILE__, __LINE__, "sb",
+                        "tokend: no reply from", td->path);
+        disconnect(srv, td);
+    }
+    connect_to(srv, td);
+}
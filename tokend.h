@@ -0,0 +1,33 @@
+#ifndef _AUTH_COOKIE_TOKEND_H_
+#define _AUTH_COOKIE_TOKEND_H_
+
+#include "base.h"
+
+// client side of connection to authtokend
+typedef struct tokend tokend;
+
+// called once reply to tokend_get() arrives (or connection is lost)
+typedef void (*tokend_cb)(server *srv, void *ctx, int found, time_t issued,
+                          const unsigned char *realm,
+                          const char *authinfo, size_t authinfo_len);
+
+// called for each put never acknowledged, as connection was lost first
+typedef void (*tokend_lost_cb)(server *srv, void *ctx,
+                               const char *token, size_t len, time_t issued,
+                               const unsigned char *realm,
+                               const char *authinfo, size_t authinfo_len);
+
+tokend *tokend_init(server *srv, buffer *path,
+                    tokend_lost_cb lost, void *lost_ctx);
+void tokend_free(server *srv, tokend *td);
+
+int tokend_get(server *srv, tokend *td, const char *token, size_t len,
+               tokend_cb cb, void *ctx);
+int tokend_put(server *srv, tokend *td, const char *token, size_t len,
+               time_t issued, const unsigned char *realm,
+               const char *authinfo, size_t authinfo_len);
+int tokend_remove(server *srv, tokend *td, const char *token, size_t len);
+void tokend_cancel(tokend *td, void *ctx);
+void tokend_trigger(server *srv, tokend *td);
+
+#endif
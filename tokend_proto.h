@@ -0,0 +1,57 @@
+#ifndef _AUTH_COOKIE_TOKEND_PROTO_H_
+#define _AUTH_COOKIE_TOKEND_PROTO_H_
+
+//
+// Wire protocol between mod_auth_cookie and authtokend.
+//
+// Both request and reply are framed as
+//
+//   frame = length(2) + id(4) + code(1) + body
+//
+// where length counts bytes after itself. Integers are big-endian.
+// Requests can be pipelined, and replies come back in the same order,
+// carrying id of the request they answer.
+//
+//   request 'G'et    body = token
+//   request 'P'ut    body = issued(4) + realm(16) + toklen(1) + token
+//                           + authinfo
+//   request 'R'emove body = token
+//
+//   reply   'Y'es    body = issued(4) + realm(16) + authinfo  (for 'G')
+//   reply   'N'o     body = (empty)                          (for 'G')
+//   reply   'K'      body = (empty)                    (for 'P' and 'R')
+//
+// Realm is ID of the tenant token was minted for (see ac_realm_id()),
+// kept as is so the module can tell whether it is taken in another.
+//
+
+#include "authcore.h"
+
+#define TOKEND_HEADER_LEN 7      // length(2) + id(4) + code(1)
+#define TOKEND_FRAME_MAX  4096
+#define TOKEND_PUT_HEAD   (4 + AC_REALM_LEN + 1) // put body before token
+#define TOKEND_FOUND_HEAD (4 + AC_REALM_LEN)     // found body before authinfo
+
+#define TOKEND_GET    'G'
+#define TOKEND_PUT    'P'
+#define TOKEND_REMOVE 'R'
+
+#define TOKEND_FOUND    'Y'
+#define TOKEND_NOTFOUND 'N'
+#define TOKEND_OK       'K'
+
+#define TOKEND_GET16(p) ((uint16_t)((uint8_t)(p)[0] << 8 | (uint8_t)(p)[1]))
+#define TOKEND_GET32(p) ((uint32_t)(uint8_t)(p)[0] << 24 |     \
+                         (uint32_t)(uint8_t)(p)[1] << 16 |     \
+                         (uint32_t)(uint8_t)(p)[2] << 8  |     \
+                         (uint32_t)(uint8_t)(p)[3])
+
+#define TOKEND_PUT16(p, v) do {                 \
+        (p)[0] = (v) >> 8; (p)[1] = (v);        \
+    } while (0)
+#define TOKEND_PUT32(p, v) do {                 \
+        (p)[0] = (v) >> 24; (p)[1] = (v) >> 16; \
+        (p)[2] = (v) >> 8;  (p)[3] = (v);       \
+    } while (0)
+
+#endif
@@ -0,0 +1,118 @@
+//
+// Per-user request accounting.
+//
+// Each user gets a record of plain counters, found once per session
+// (the pointer is kept in session cache), so counting a request is
+// just an increment. Records are never removed, so the pointer stays
+// valid as long as the session; the table stops growing at given
+// limit instead, and users beyond it are not counted.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ustats.h"
+
+#define INITIAL_SIZE 64
+
+static size_t
+hash(const char *s, size_t len) {
+    size_t h = 2166136261u; // FNV-1a
+
+    while (len--) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void
+grow(ac_ustats *us) {
+    size_t i, size = us->size << 1;
+    ac_user_stats **bucket = calloc(size, sizeof(*bucket));
+
+    if (! bucket) return; // keep using current table
+
+    for (i = 0; i < us->size; i++) {
+        ac_user_stats *st, *next;
+        for (st = us->bucket[i]; st; st = next) {
+            size_t n = hash(st->user, st->user_len) & (size - 1);
+            next = st->next;
+            st->next = bucket[n];
+            bucket[n] = st;
+        }
+    }
+    free(us->bucket);
+    us->bucket = bucket;
+    us->size   = size;
+}
+
+ac_ustats *
+ac_ustats_init(size_t max) {
+    ac_ustats *us = calloc(1, sizeof(*us));
+
+    us->size   = INITIAL_SIZE;
+    us->max    = max;
+    us->bucket = calloc(us->size, sizeof(*us->bucket));
+    return us;
+}
+
+void
+ac_ustats_free(ac_ustats *us) {
+    size_t i;
+
+    if (! us) return;
+
+    for (i = 0; i < us->size; i++) {
+        ac_user_stats *st, *next;
+        for (st = us->bucket[i]; st; st = next) {
+            next = st->next;
+            free(st);
+        }
+    }
+    free(us->bucket);
+    free(us);
+}
+
+//
+// Find record of given user, or add one. Returns NULL if the table
+// is full (or user is empty).
+//
+ac_user_stats *
+ac_ustats_get(ac_ustats *us, ac_slice user) {
+    ac_user_stats *st;
+    size_t n;
+
+    if (user.len == 0) return NULL;
+
+    n = hash(user.ptr, user.len) & (us->size - 1);
+    for (st = us->bucket[n]; st; st = st->next) {
+        if (st->user_len == user.len &&
+            memcmp(st->user, user.ptr, user.len) == 0) {
+            return st;
+        }
+    }
+    if (us->used >= us->max) return NULL;
+
+    if ((st = calloc(1, sizeof(*st) + user.len)) == NULL) return NULL;
+    memcpy(st->user, user.ptr, user.len);
+    st->user[user.len] = '\0';
+    st->user_len = user.len;
+
+    if (us->used >= us->size) grow(us);
+    n = hash(user.ptr, user.len) & (us->size - 1);
+    st->next = us->bucket[n];
+    us->bucket[n] = st;
+    us->used++;
+    return st;
+}
+
+void
+ac_ustats_walk(ac_ustats *us, ac_ustats_cb cb, void *ctx) {
+    size_t i;
+
+    for (i = 0; i < us->size; i++) {
+        ac_user_stats *st;
+        for (st = us->bucket[i]; st; st = st->next) cb(st, ctx);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef _AUTH_COOKIE_USTATS_H_
+#define _AUTH_COOKIE_USTATS_H_
+
+#include <stddef.h>
+#include <time.h>
+
+#include "authcore.h"
+
+// counters of a user, kept until shutdown
+typedef struct ac_user_stats {
+    struct ac_user_stats *next;
+
+    unsigned long requests;  // requests accepted
+    unsigned long redirects; // sessions rejected (expired, revoked, ...)
+    unsigned long mints;     // tokens minted
+    time_t        last_seen;
+    size_t        user_len;
+    char          user[1];   // allocated with the entry
+} ac_user_stats;
+
+// table of all users seen so far
+typedef struct {
+    ac_user_stats **bucket;
+    size_t size; // number of buckets, always power of 2
+    size_t used; // number of entries
+    size_t max;  // upper limit of entries
+} ac_ustats;
+
+typedef void (*ac_ustats_cb)(ac_user_stats *st, void *ctx);
+
+ac_ustats *ac_ustats_init(size_t max);
+void ac_ustats_free(ac_ustats *us);
+
+ac_user_stats *ac_ustats_get(ac_ustats *us, ac_slice user);
+void ac_ustats_walk(ac_ustats *us, ac_ustats_cb cb, void *ctx);
+
+#endif
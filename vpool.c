@@ -0,0 +1,224 @@
+//
+// Verification thread pool.
+//
+// Public-key signature takes tens of microseconds to check, which
+// stalls every other connection handled by the same event loop.
+// Such jobs are queued here, run by worker threads, and handed back
+// to the event loop through an eventfd.
+//
+// Each worker takes whatever has been queued (up to BATCH_MAX jobs)
+// in one go, and hands back the whole batch with a single wakeup,
+// so a burst of requests costs one lock round trip and one event
+// instead of one per job.
+//
+// Threads are started on first use, not at vpool_init(), as lighttpd
+// forks (daemonize and server.max-worker) after set_defaults stage.
+//
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "vpool.h"
+#include "log.h"
+#include "fdevent.h"
+
+#define BATCH_MAX 32
+
+typedef struct task {
+    struct task  *next;
+    void         *ctx;
+    vpool_run_cb  run;
+    vpool_done_cb done;
+} task;
+
+struct vpool {
+    int fd; // eventfd to wake up event loop
+    int fde_ndx;
+    int registered;
+    int started; // tried to start, successfully or not
+
+    pthread_t *threads;
+    int        nthreads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    task  *queue, **queue_tail; // waiting to run
+    task  *done,  **done_tail;  // waiting to be handed back
+    int    stop;
+};
+
+static void *
+worker(void *arg) {
+    vpool *vp = arg;
+
+    pthread_mutex_lock(&vp->lock);
+    for (;;) {
+        task *batch, *t, **tail;
+        uint64_t one = 1;
+        int n;
+
+        while (! vp->queue && ! vp->stop) {
+            pthread_cond_wait(&vp->cond, &vp->lock);
+        }
+        if (vp->stop) break;
+
+        // take up to BATCH_MAX jobs, and leave the rest to others
+        batch = vp->queue;
+        for (tail = &batch, n = 0; *tail && n < BATCH_MAX; n++) {
+            tail = &(*tail)->next;
+        }
+        vp->queue = *tail;
+        if (! vp->queue) vp->queue_tail = &vp->queue;
+        *tail = NULL;
+        pthread_mutex_unlock(&vp->lock);
+
+        for (t = batch; t; t = t->next) t->run(t->ctx);
+
+        pthread_mutex_lock(&vp->lock);
+        *vp->done_tail = batch;
+        vp->done_tail  = tail;
+        pthread_mutex_unlock(&vp->lock);
+
+        while (write(vp->fd, &one, sizeof(one)) < 0 && errno == EINTR);
+
+        pthread_mutex_lock(&vp->lock);
+    }
+    pthread_mutex_unlock(&vp->lock);
+    return NULL;
+}
+
+static handler_t
+vpool_handle_fdevent(server *srv, void *ctx, int revents) {
+    vpool *vp = ctx;
+    uint64_t n;
+    task *t, *next;
+
+    UNUSED(revents);
+
+    while (read(vp->fd, &n, sizeof(n)) < 0 && errno == EINTR);
+
+    pthread_mutex_lock(&vp->lock);
+    t = vp->done;
+    vp->done = NULL;
+    vp->done_tail = &vp->done;
+    pthread_mutex_unlock(&vp->lock);
+
+    for (; t; t = next) {
+        next = t->next;
+        t->done(srv, t->ctx);
+        free(t);
+    }
+    return HANDLER_GO_ON;
+}
+
+static void
+start(server *srv, vpool *vp) {
+    int i;
+
+    vp->started = 1;
+
+    vp->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (vp->fd < 0) {
+        log_error_write(srv, __FILE__, __LINE__, "ss",
+                        "vpool: eventfd failed:", strerror(errno));
+        vp->nthreads = 0;
+        return;
+    }
+    fdevent_register(srv->ev, vp->fd, vpool_handle_fdevent, vp);
+    fdevent_event_add(srv->ev, &vp->fde_ndx, vp->fd, FDEVENT_IN);
+    vp->registered = 1;
+
+    for (i = 0; i < vp->nthreads; i++) {
+        if (pthread_create(&vp->threads[i], NULL, worker, vp) != 0) {
+            log_error_write(srv, __FILE__, __LINE__, "sd",
+                            "vpool: cannot start thread", i);
+            break;
+        }
+    }
+    vp->nthreads = i;
+}
+
+/**********************************************************************
+ * interface
+ **********************************************************************/
+
+vpool *
+vpool_init(server *srv, int threads) {
+    vpool *vp = calloc(1, sizeof(*vp));
+
+    UNUSED(srv);
+
+    vp->fd         = -1;
+    vp->fde_ndx    = -1;
+    vp->nthreads   = threads;
+    vp->threads    = calloc(threads, sizeof(pthread_t));
+    vp->queue_tail = &vp->queue;
+    vp->done_tail  = &vp->done;
+    pthread_mutex_init(&vp->lock, NULL);
+    pthread_cond_init(&vp->cond, NULL);
+    return vp;
+}
+
+//
+// Stop all threads. Jobs not handed back yet are dropped, without
+// calling their done_cb.
+//
+void
+vpool_free(server *srv, vpool *vp) {
+    task *t, *next;
+    int i;
+
+    if (! vp) return;
+
+    pthread_mutex_lock(&vp->lock);
+    vp->stop = 1;
+    pthread_cond_broadcast(&vp->cond);
+    pthread_mutex_unlock(&vp->lock);
+
+    for (i = 0; vp->started && i < vp->nthreads; i++) {
+        pthread_join(vp->threads[i], NULL);
+    }
+    if (vp->registered) {
+        fdevent_event_del(srv->ev, &vp->fde_ndx, vp->fd);
+        fdevent_unregister(srv->ev, vp->fd);
+    }
+    if (vp->fd >= 0) close(vp->fd);
+
+    for (t = vp->queue; t; t = next) next = t->next, free(t);
+    for (t = vp->done;  t; t = next) next = t->next, free(t);
+
+    pthread_mutex_destroy(&vp->lock);
+    pthread_cond_destroy(&vp->cond);
+    free(vp->threads);
+    free(vp);
+}
+
+//
+// Queue job to run in worker thread. Returns -1 if the pool is not
+// available, in which case caller should do the job by itself.
+//
+int
+vpool_submit(server *srv, vpool *vp, void *ctx,
+             vpool_run_cb run, vpool_done_cb done) {
+    task *t;
+
+    if (! vp) return -1;
+    if (! vp->started) start(srv, vp);
+    if (vp->nthreads == 0) return -1;
+
+    if ((t = malloc(sizeof(*t))) == NULL) return -1;
+    t->next = NULL;
+    t->ctx  = ctx;
+    t->run  = run;
+    t->done = done;
+
+    pthread_mutex_lock(&vp->lock);
+    *vp->queue_tail = t;
+    vp->queue_tail  = &t->next;
+    pthread_cond_signal(&vp->cond);
+    pthread_mutex_unlock(&vp->lock);
+    return 0;
+}
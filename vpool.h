@@ -0,0 +1,21 @@
+#ifndef _AUTH_COOKIE_VPOOL_H_
+#define _AUTH_COOKIE_VPOOL_H_
+
+#include "base.h"
+
+// thread pool to run signature verification off the event loop
+typedef struct vpool vpool;
+
+// called in worker thread - must not touch server state
+typedef void (*vpool_run_cb)(void *ctx);
+
+// called in event loop once run_cb has finished
+typedef void (*vpool_done_cb)(server *srv, void *ctx);
+
+vpool *vpool_init(server *srv, int threads);
+void vpool_free(server *srv, vpool *vp);
+
+int vpool_submit(server *srv, vpool *vp, void *ctx,
+                 vpool_run_cb run, vpool_done_cb done);
+
+#endif